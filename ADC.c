@@ -10,6 +10,13 @@
  * PA4 = ADC4_CH1
  * PA5 = ADC5_CH1
  *
+ * TIM2 triggers a scan of all five channels ADC_SAMPLE_HZ times a second,
+ * and DMA2 stream 0 drops each scan into one of two buffers in turn (see
+ * DMA.c). Each complete frame is published to a mailbox (mailbox.c), so
+ * ADC_read just hands back the last one, whole - nothing is started or
+ * waited on by the caller. Each frame also goes through the filter
+ * pipeline (filter.c) as it lands.
+ *
  * Documentation references:
  * [1]: STM32F40x Reference Manual
  * [2]: STM32F407VG Datasheet
@@ -19,11 +26,28 @@
  */
 
 #include "stm32f4xx.h"
+#include "clock.h"
 #include "io.h"
 #include "DMA.h"
+#include "ADC.h"
+#include "filter.h"
+#include "sched.h"
+#include "timebase.h"
+#include "mailbox.h"
+#include "profile.h"
+#include "trace.h"
+
+// Fastest ADCCLK at VDDA 2.4-3.6 V - [2] Table 66
+#define ADC_CLK_MAX_HZ 36000000
 
 int initialized = 0;
 
+// The two DMA targets, and the newest complete frame for the main loop
+static uint32_t adc_buf[2][5];
+static joint_mailbox_t frames = MAILBOX_INIT;
+
+volatile uint32_t ADC_overruns = 0;
+
 void ADC_init(void) {
 
 
@@ -52,6 +76,15 @@ void ADC_init(void) {
 	 * Configure ADC1 for 5 channels
 	 *******************************************/
 
+	// ADCCLK is PCLK2 / 2, 4, 6 or 8 and mustn't go over 36 MHz ([2] Table 66):
+	// take the fastest that fits (84 MHz / 4 = 21 MHz)
+	// Set bits 17:16 (ADCPRE) of ADC_CCR to div/2 - 1
+	// [1] 11.13.16 p.300
+	uint32_t div = 2;
+	while (clock_pclk2_hz / div > ADC_CLK_MAX_HZ && div < 8)
+		div += 2;
+	ADC_COMMON->ADC_CCR = (ADC_COMMON->ADC_CCR & ~(0x3 << 16)) | ((div / 2 - 1) << 16);
+
 	// Set the regular sequence to length 5
 	// set bits 23:20 of SQR1 to 0b0100
 	// [1] 11.13.9 p. 296
@@ -76,11 +109,12 @@ void ADC_init(void) {
 	// 11.13.5 p. 294
 	// Assume 10k ohms is the worst case resistance
 	// Using Equation 1 from 5.3.20 [2]
-	// k = 10.43 (solved from other)
-	// f_ADC = 16 MHz
+	// k = 15 cycles
+	// f_ADC = 21 MHz (at 168 MHz, see above)
 	// C_ADC = 4 pF (typ)
 	// N = 12 (bits of resolution)
 	// R_ADC = 6 kOhms
+	// => R_AIN up to 11.8 kOhms
 	ADC1->ADC_SMPR2 &= ~(0x7<<3); // clear those bits
 	ADC1->ADC_SMPR2 |= (1<<3); // set to 15 cycles
 
@@ -107,41 +141,131 @@ void ADC_init(void) {
 	// 11.13.2 p. 290
 	ADC1->ADC_CR1 |= 1 << 8;
 
-	// Enable DMA mode
-	// set bit 8 (DMA) in ADC_CR2 to high
+	// Interrupt on overrun so we can restart the DMA
+	// set bit 26 (OVRIE) of CR1 high
+	// 11.13.2 p. 290
+	ADC1->ADC_CR1 |= 1 << 26;
+
+	/* Enable the ADC interrupt in the NVIC
+	 * Position 18 in the vector table [1]-10.2 p.249
+	 * Set bit 18 in NVIC_ISER0 [4]-4.3.11 p.205
+	 */
+	uint32_t *NVIC_ISER0 = (uint32_t*)0xE000E100;
+	*NVIC_ISER0 |= 1 << 18;
+
+	// Start each scan on the rising edge of TIM2 TRGO
+	// set bits 27:24 (EXTSEL) of CR2 to '0110' and bits 29:28 (EXTEN) to '01'
+	// Ref: [1] 11.13.3 p.292
+	ADC1->ADC_CR2 = (ADC1->ADC_CR2 & ~0x3F000000) | (0x6 << 24) | (0x1 << 28);
+
+	// Enable DMA mode, and keep issuing DMA requests after the first scan
+	// set bit 8 (DMA) and bit 9 (DDS) in ADC_CR2 to high
 	// Ref: [1] 11.13.3, p.293
-	ADC1->ADC_CR2 |= 1 << 8;
+	ADC1->ADC_CR2 |= (1 << 9) | (1 << 8);
+
+	// Point the DMA at our two buffers
+	start_DMA_double_buffer(adc_buf[0], adc_buf[1]);
 
 	// Enable conversions
 	// set the ADON bit in CR2 to high
 	// 11.13.3 p. 293
 	ADC1->ADC_CR2 |= 0x1; // Enable ADC
+
+	/*******************************************
+	 * Configure TIM2 to trigger the scans
+	 *******************************************/
+	// Enable clock for TIM2
+	// Set bit 0 of RCC_APB1ENR (TIM2EN) to high
+	// Ref: [1] 6.3.16 p.152
+	RCC->APB1ENR |= 1;
+
+	// Set prescaler to count at 1 MHz (83 from APB1's 84 MHz timer clock)
+	// Ref: [1] 18.4.11 p.535
+	TIM2->TIMx_PSC = clock_timer_hz(CLOCK_APB1) / 1000000 - 1;
+
+	// One update per sample period - [1] 18.4.12 p.535
+	TIM2->TIMx_ARR = 1000000 / ADC_SAMPLE_HZ - 1;
+
+	// Send the update event out on TRGO
+	// Set bits 6:4 (MMS) of TIMx_CR2 to '010'
+	// Ref: [1] 18.4.2 p.520
+	TIM2->TIMx_CR2 = (TIM2->TIMx_CR2 & ~0x70) | 0x20;
+
+	// TIM2 is left stopped: ADC_run starts the scans when they're wanted
+
 	initialized = 1;
 }
 
 /**
- * Accepts a 5-element integer array to store the data
+ * Start or stop the scans. Stopped, there are no conversions and no
+ * DMA interrupts, and ADC_read keeps giving the last frame. A restart
+ * begins the filter afresh rather than mixing in the old history.
  */
-void ADC_read(uint32_t *data) {
-	if (!initialized) {
-		return;
+void ADC_run(int on) {
+	if (on) {
+		if (TIM2->TIMx_CR1 & 1)
+			return;
+		filter_init();
 	}
 
-	// Set DMA bit to 0 then to 1 to reenable
-	// Ref: [1] 11.8.1, p.274
-	ADC1->ADC_CR2 &= ~(1 << 8);
-	ADC1->ADC_CR2 |= 1 << 8;
+	// Set or clear CEN (bit 0 of CR1)
+	// Ref: [1] 18.4.1 p.519
+	if (on)
+		TIM2->TIMx_CR1 |= 1;
+	else
+		TIM2->TIMx_CR1 &= ~1;
+}
 
-	// Set DMA stream location
-	start_DMA_transfer(data);
+/**
+ * Copy the latest complete 5-channel frame into data.
+ * Returns right away - the frame was converted in the background.
+ * Gives all zeros before the first scan completes. Main loop only
+ * (the mailbox has one reader).
+ */
+void ADC_read(uint32_t *data) {
+	PROFILE_ENTER(PROF_ADC_READ);
+	const joint_state_t *s = mailbox_read(&frames);
 
-	// Clear EOC bit
-	ADC1->ADC_CR2 |= 1 << 30; // set bit 30 (SWSTART)
+	for (int i=0; i<5; i++)
+		data[i] = s->values[i];
+	PROFILE_EXIT(PROF_ADC_READ);
+}
 
-	// Tight loop until finished
-//	while (!(ADC1->ADC_SR & ADC_SR_EOC));
+/*
+ * A buffer is full: it's now the latest frame and the DMA
+ * has already moved on to the other one
+ */
+void __attribute__ ((interrupt)) DMA2_stream0_handler(void) {
+	uint32_t flags = DMA2->DMA_LISR;
+
+	// Clear the stream 0 flags
+	DMA2->DMA_LIFCR = 0x3D;
+
+	if (flags & (1 << 5)) { // TCIF0
+		int latest = DMA_completed_buffer();
+
+		mailbox_write(&frames, time_now_us(), adc_buf[latest]);
+		// A new filtered reading: let the task that sends them know
+		if (filter_push(adc_buf[latest])) {
+			TRACE(TRACE_ADC_FRAME, 0, filter_output_count());
+			sched_post(TASK_COMMAND, SCHED_EV_POST);
+		}
+	}
+}
+
+/*
+ * Overrun: the ADC stops DMA requests until it's cleared,
+ * so clear it and restart the stream from the first channel
+ */
+void __attribute__ ((interrupt)) ADC_handler(void) {
+	if (ADC1->ADC_SR & (1 << 5)) { // OVR
+		ADC_overruns++;
 
-	if (ADC1->ADC_SR & (1 << 5)) { // if OVR (overrun) bit
-		print_string("Overflow\n");
+		// Turn off DMA requests, restart the stream, clear OVR and turn them back on
+		// Ref: [1] 11.8.1, p.274
+		ADC1->ADC_CR2 &= ~(1 << 8);
+		start_DMA_double_buffer(adc_buf[0], adc_buf[1]);
+		ADC1->ADC_SR &= ~(1 << 5);
+		ADC1->ADC_CR2 |= 1 << 8;
 	}
 }
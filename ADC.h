@@ -8,7 +8,18 @@
 #ifndef ADC_H_
 #define ADC_H_
 
+#include "stdint.h"
+
+// How often TIM2 triggers a scan of all five channels
+#define ADC_SAMPLE_HZ 1000
+
+extern volatile uint32_t ADC_overruns;
+
 void ADC_init(void);
+void ADC_run(int on);
 void ADC_read(uint32_t *data);
 
+void __attribute__ ((interrupt)) DMA2_stream0_handler(void);
+void __attribute__ ((interrupt)) ADC_handler(void);
+
 #endif /* ADC_H_ */
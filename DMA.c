@@ -3,6 +3,14 @@
  *
  * Configure the DMA2 (Direct memory Access) for the ADC to read bytes into
  *
+ * Stream 0 runs in double-buffer mode: the DMA fills one 5-channel buffer
+ * while the other holds the last complete frame, and swaps on its own at
+ * the end of every scan. The transfer complete interrupt fires once per
+ * buffer, which is the half/full point of the pair.
+ *
+ * Streams 5 and 1 load the servo compare registers from memory on each
+ * TIM1/TIM8 update event (DMA_servo_init).
+ *
  * References:
  * [1] DM00031020 RM0090 STM32F40x Reference Manual.pdf
  * [2]
@@ -10,6 +18,7 @@
  *      Author: matthew
  */
 #include "stm32f4xx.h"
+#include "DMA.h"
 
 void DMA_init(void) {
 	// Enable clock to DMA2
@@ -64,33 +73,128 @@ void DMA_init(void) {
 	// Ref: [1] 9.5.6, p.240
 	DMA2->DMA_S0NDTR = 5;
 
-	// Set the peripheral (ADC) to control the flow
-	// Set bit 5 (PFCTRL) of DMA_S0CR to '1'
+	// The DMA controls the flow (a circular stream can't be peripheral-controlled)
+	// Set bit 5 (PFCTRL) of DMA_S0CR to '0'
 	// Ref: [1] 9.5.5, p.239
-	DMA2->DMA_S0CR |= 1 << 5;
+	DMA2->DMA_S0CR &= ~(1 << 5);
+
+	// Double-buffer mode and circular mode
+	// Set bit 18 (DBM) and bit 8 (CIRC) of DMA_S0CR to high
+	// Ref: [1] 9.3.10, 9.5.5 p.238
+	DMA2->DMA_S0CR |= (1 << 18) | (1 << 8);
+
+	// Interrupt when each buffer fills, and on transfer errors
+	// Set bit 4 (TCIE) and bit 2 (TEIE) of DMA_S0CR to high
+	// Ref: [1] 9.5.5 p.239
+	DMA2->DMA_S0CR |= (1 << 4) | (1 << 2);
+
+	/* Enable DMA2 stream 0 in the NVIC
+	 * Position 56 in the vector table [1]-10.2 p.250
+	 * Set bit 24 in NVIC_ISER1 [4]-4.3.11 p.205
+	 */
+	uint32_t *NVIC_ISER1 = (uint32_t*)0xE000E104;
+	*NVIC_ISER1 |= 1 << 24;
 }
 
-void start_DMA_transfer(uint32_t *addr) {
-	if (DMA2->DMA_S0CR & 1) // if enabled
-		DMA2->DMA_S0CR &= ~1;
+/*
+ * Start (or restart) stream 0 filling buf0 and buf1 alternately, 5 words each
+ */
+void start_DMA_double_buffer(uint32_t *buf0, uint32_t *buf1) {
+	// Stop the stream and wait for it to actually stop
+	// Ref: [1] 9.5.5 p.240
+	DMA2->DMA_S0CR &= ~1;
+	while (DMA2->DMA_S0CR & 1);
 
 	// Clear the flags relating to stream 0
 	// Required before starting transfer ([1] 9.5.5 p.240)
 	// Set bits 5:2, 0, of DMA_LIFCR to high (clear flags)
 	DMA2->DMA_LIFCR |= 0x3D;
 
-	// Set the number of data items to transfer to 5 (maybe not necessary if it remembers from init?)
 	// Set bits 15:0 of DMA_S0NDTR to 5
 	// Ref: [1] 9.5.6, p.240
 	DMA2->DMA_S0NDTR = 5;
 
-	// Set the memory address of the target to the given argument
-	// Set bits 31:0 of DMA_S0M0AR to the address
-	// Ref: [1] 9.5.8, p.241
-	DMA2->DMA_S0M0AR = (uint32_t)addr;
+	// Set the two memory targets, and start with memory 0
+	// Clear bit 19 (CT) of DMA_S0CR
+	// Ref: [1] 9.5.5 p.238, 9.5.8-9.5.9 p.241
+	DMA2->DMA_S0M0AR = (uint32_t)buf0;
+	DMA2->DMA_S0M1AR = (uint32_t)buf1;
+	DMA2->DMA_S0CR &= ~(1 << 19);
 
 	// Enable the stream
 	// Set bit 1 (EN) of DMA_S0CR to high
 	// Ref: [1] 9.5.5, p.240
 	DMA2->DMA_S0CR |= 1;
 }
+
+/*
+ * Which buffer the DMA has just finished: returns 0 for buf0, 1 for buf1.
+ * Only meaningful in the transfer complete interrupt, when the stream has
+ * already moved on to the other one (CT, bit 19).
+ */
+int DMA_completed_buffer(void) {
+	return (DMA2->DMA_S0CR & (1 << 19)) ? 0 : 1;
+}
+
+/*
+ * Set up the two streams that load the servo compare registers on each
+ * PWM update event (see servo_commit_frame):
+ *   stream 5, channel 6 (TIM1_UP): 4 words into TIM1_DMAR, which the
+ *     timer's DMA burst spreads over CCR1-CCR4
+ *   stream 1, channel 7 (TIM8_UP): the same for TIM8
+ * Ref: [1] 9.3.3, Table 35, p.217
+ * Call after DMA_init (which turns on the DMA2 clock).
+ */
+void DMA_servo_init(void) {
+	// Channel 6, memory-to-peripheral, 32-bit both sides, high priority
+	// Set bits 27:25 (CHSEL) to '110', 17:16 (PL) to '10', 14:13 (MSIZE)
+	// and 12:11 (PSIZE) to '10', 7:6 (DIR) to '01' of DMA_S5CR
+	// Ref: [1] 9.5.5, p.237-239
+	DMA2->DMA_S5CR = (6 << 25) | (2 << 16) | (2 << 13) | (2 << 11) | (1 << 6);
+
+	// Step through the four CCR values
+	// Set bit 10 (MINC) of DMA_S5CR to high
+	// Ref: [1] 9.5.5, p.238
+	DMA2->DMA_S5CR |= 1 << 10;
+
+	// Every word goes to the burst register
+	// Ref: [1] 9.5.7, p.240, 14.4.20 p.414
+	DMA2->DMA_S5PAR = (uint32_t)&(TIM1->TIMx_DMAR);
+
+	// Channel 7, the rest the same, into TIM8's burst register
+	// Ref: [1] 9.5.5, p.237-239
+	DMA2->DMA_S1CR = (7 << 25) | (2 << 16) | (2 << 13) | (2 << 11) | (1 << 10) | (1 << 6);
+	DMA2->DMA_S1PAR = (uint32_t)&(TIM8->TIMx_DMAR);
+}
+
+/*
+ * Arm one servo stream (DMA_SERVO_TIM1 or DMA_SERVO_TIM8) with a new
+ * frame of CCR1-CCR4. It fires on the next update event of its timer.
+ */
+void start_DMA_servo_frame(int which, uint32_t *ccrs) {
+	if (which == DMA_SERVO_TIM1) {
+		// Stop the stream and wait for it to actually stop
+		// Ref: [1] 9.5.5 p.240
+		DMA2->DMA_S5CR &= ~1;
+		while (DMA2->DMA_S5CR & 1);
+
+		// Clear the flags of stream 5
+		// Set bits 11:8, 6 of DMA_HIFCR
+		// Ref: [1] 9.5.4 p.236
+		DMA2->DMA_HIFCR = 0xF40;
+
+		DMA2->DMA_S5NDTR = 4;
+		DMA2->DMA_S5M0AR = (uint32_t)ccrs;
+		DMA2->DMA_S5CR |= 1;
+	} else {
+		// The same for stream 1, flags in DMA_LIFCR
+		// Ref: [1] 9.5.3 p.236
+		DMA2->DMA_S1CR &= ~1;
+		while (DMA2->DMA_S1CR & 1);
+		DMA2->DMA_LIFCR = 0xF40;
+
+		DMA2->DMA_S1NDTR = 4;
+		DMA2->DMA_S1M0AR = (uint32_t)ccrs;
+		DMA2->DMA_S1CR |= 1;
+	}
+}
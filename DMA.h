@@ -9,6 +9,13 @@
 #define DMA_H_
 
 void DMA_init(void);
-void start_DMA_transfer(uint32_t *addr);
+void start_DMA_double_buffer(uint32_t *buf0, uint32_t *buf1);
+int DMA_completed_buffer(void);
+// Servo compare register streams
+#define DMA_SERVO_TIM1 0	// DMA2 stream 5
+#define DMA_SERVO_TIM8 1	// DMA2 stream 1
+
+void DMA_servo_init(void);
+void start_DMA_servo_frame(int which, uint32_t *ccrs);
 
 #endif /* DMA_H_ */
@@ -19,6 +19,47 @@
  */
 
 #include "stm32f4xx.h"
+#include "clock.h"
+#include "mutex.h"
+#include "ring.h"
+#include "USART2.h"
+
+#define USART2_BAUD 115200
+
+/* Console output, drained by DMA1 stream 6 (channel 4, USART2_TX)
+ * See [1]-9.3.3 Table 42
+ *
+ * Two rings, so each has one producer (see ring.c): one for the main
+ * loop, one for interrupt handlers, which all share the default NVIC
+ * priority and so never interrupt each other. The DMA takes a run from
+ * whichever has something, handlers' first - unless someone has the
+ * console to themselves (USART2_claim), when the handlers' bytes wait
+ * until the claim's bytes are all out.
+ */
+#define TX_BUF_SIZE 1024 // must be a power of 2
+#define TX_RING_MAIN 0
+#define TX_RING_HANDLER 1
+
+static uint8_t tx_buf[2][TX_BUF_SIZE];
+static ring_t tx_ring[2];
+static volatile uint32_t tx_dma_ring = 0;	// which the transfer in progress is from
+static volatile uint32_t tx_dma_len = 0;
+/* While the console is claimed the handler ring is held back (HOLD_ON),
+ * and once it's given up, until the main ring has emptied (HOLD_DRAIN).
+ * tx_claimed turns other main loop writes away.
+ */
+#define HOLD_OFF 0
+#define HOLD_ON 1
+#define HOLD_DRAIN 2
+static volatile uint32_t tx_hold_handler = HOLD_OFF;
+static volatile uint32_t tx_claimed = 0;
+// Nonzero while the stream is running; whoever swaps it to 1 starts it
+static volatile uint32_t tx_busy = 0;
+
+static volatile int tx_policy = USART2_TX_DROP;
+
+// Writes thrown away because there wasn't room
+volatile uint32_t USART2_tx_dropped = 0;
 
 void USART2_init(void) {
 	/* We'll run USART2 through ports PD5 (TX) and PD6 (RX)
@@ -37,6 +78,9 @@ void USART2_init(void) {
 	 */
 	RCC->APB1ENR |= 1 << 17;
 
+	ring_init(&tx_ring[TX_RING_MAIN], tx_buf[TX_RING_MAIN], TX_BUF_SIZE);
+	ring_init(&tx_ring[TX_RING_HANDLER], tx_buf[TX_RING_HANDLER], TX_BUF_SIZE);
+
 	/*
 	 * Configure GPIOD Pin 5 (TX) as:
 	 *   Alternate function output, AF7
@@ -78,17 +122,13 @@ void USART2_init(void) {
 	 */
 	USART2->USART_CR1 |= 0x2000;
 
-	/* Set the baudrate to 57600.
-	 * SYSCLK = 16 MHz:
-	 * 16,000,000 / 57,600 = 278
+	/* Set the baud rate to USART2_BAUD from APB1's clock.
+	 * With 16x oversampling BRR is just PCLK1 / baud, the low 4 bits being
+	 * the fraction: at 42 MHz, 115200 baud gives 365 (0.1% fast).
 	 *
-	 *
-	 * See	[1]-26.6.3
-	 * Following USART2 code given - doesn't make sense with documentation but I know it works
+	 * See	[1]-26.3.4, [1]-26.6.3
 	 */
-//	USART2->USART_BRR = 0xFFFF & 1667; // baud rate 9600
-//	USART2->USART_BRR = 0xFFFF & 278; // baud rate 57600
-	USART2->USART_BRR = 0xFFFF & 139; // baud rate 115200
+	USART2->USART_BRR = 0xFFFF & ((clock_pclk1_hz + USART2_BAUD / 2) / USART2_BAUD);
 
 	/* Configure interrupts *from* the USART
 	 * Set bit 5 in USART3_CR1
@@ -109,13 +149,237 @@ void USART2_init(void) {
 	 * See [1]-26.6.4 pp.782-783
 	 */
 	USART2->USART_CR1 |= 0xC;
+
+	/*******************************************
+	 * Configure DMA1 stream 6 for transmit
+	 *******************************************/
+	// Enable clock to DMA1
+	// Set bit 21 (DMA1EN) of RCC_AHB1ENR to high
+	// [1] 6.3.12 p.145
+	RCC->AHB1ENR |= 1 << 21;
+
+	// Make sure the stream is off before configuring it
+	// [1] 9.5.5 p.240
+	DMA1->DMA_S6CR &= ~1;
+	while (DMA1->DMA_S6CR & 1);
+
+	// Channel 4 (bits 27:25 = '100'), memory-to-peripheral (DIR, bits 7:6 = '01'),
+	// memory increment (MINC, bit 10), byte sizes (PSIZE/MSIZE = '00'),
+	// low priority (PL, bits 17:16 = '00'), transfer complete interrupt (TCIE, bit 4)
+	// and transfer error interrupt (TEIE, bit 2)
+	// [1] 9.5.5 pp.237-240
+	DMA1->DMA_S6CR = (4 << 25) | (1 << 10) | (1 << 6) | (1 << 4) | (1 << 2);
+
+	// Peripheral address is the USART2 data register
+	// [1] 9.5.7 p.240
+	DMA1->DMA_S6PAR = (uint32_t)&(USART2->USART_DR);
+
+	// Let the USART request DMA transfers on transmit
+	// Set bit 7 (DMAT) of USART_CR3
+	// [1] 26.6.6 p.787
+	USART2->USART_CR3 |= 1 << 7;
+
+	/* Enable DMA1 stream 6 in the NVIC
+	 * Position 17 in the vector table [1]-10.2 p.249
+	 * Set bit 17 in NVIC_ISER0 [4]-4.3.11 p.205
+	 */
+	uint32_t *NVIC_ISER0 = (uint32_t*)0xE000E100;
+	*NVIC_ISER0 |= 1 << 17;
+}
+
+/*
+ * Kick off a DMA transfer of the next contiguous run from one of the
+ * rings. Only called by whoever set tx_busy. Returns 0 if there was
+ * nothing to send.
+ */
+static int start_tx_dma(void) {
+	const uint8_t *data;
+	uint32_t len;
+	int r = TX_RING_HANDLER;
+
+	len = tx_hold_handler ? 0 : ring_peek(&tx_ring[r], &data);
+	if (len == 0) {
+		r = TX_RING_MAIN;
+		len = ring_peek(&tx_ring[r], &data);
+		if (len == 0)
+			return 0;
+	}
+	tx_dma_ring = r;
+	tx_dma_len = len;
+
+	// Clear the stream 6 flags (bits 21:16 of HIFCR) before enabling
+	// [1] 9.5.4 p.236
+	DMA1->DMA_HIFCR = 0x003D0000;
+	DMA1->DMA_S6M0AR = (uint32_t)data;
+	DMA1->DMA_S6NDTR = len;
+	DMA1->DMA_S6CR |= 1;
+	return 1;
+}
+
+/*
+ * Bytes the DMA may take now
+ */
+static uint32_t tx_ready(void) {
+	uint32_t n = ring_count(&tx_ring[TX_RING_MAIN]);
+
+	if (!tx_hold_handler)
+		n += ring_count(&tx_ring[TX_RING_HANDLER]);
+	return n;
+}
+
+/*
+ * Start the stream if there's anything queued and it isn't running
+ * (as in USART3.c)
+ */
+static void kick_tx(void) {
+	while (tx_ready() && atomic_swap(&tx_busy, 1) == 0) {
+		if (start_tx_dma())
+			return;
+		store_release(&tx_busy, 0);
+	}
+}
+
+/*
+ * Nonzero in an interrupt handler - IPSR holds the exception number
+ * [4] 2.1.3 p.18
+ */
+static int in_handler(void) {
+	uint32_t ipsr;
+
+	__asm volatile ("mrs %0, ipsr" : "=r" (ipsr));
+	return ipsr != 0;
+}
+
+/*
+ * Queue len bytes for the console and return.
+ * With USART2_TX_DROP (and always in a handler, where waiting would
+ * hold off the DMA interrupt that makes room) it's all or nothing:
+ * returns -1 and drops the lot if there isn't room. With
+ * USART2_TX_BLOCK the main loop waits for room instead.
+ * While the console is claimed (USART2_claim), main loop writes other
+ * than the claim's own are dropped.
+ */
+int USART2_write(const char *data, int len) {
+	ring_t *r;
+	uint32_t n;
+
+	if (in_handler()) {
+		r = &tx_ring[TX_RING_HANDLER];
+	} else {
+		r = &tx_ring[TX_RING_MAIN];
+		if (tx_claimed) {
+			USART2_tx_dropped++;
+			return -1;
+		}
+		if (tx_policy == USART2_TX_BLOCK) {
+			while (len > 0) {
+				n = len < TX_BUF_SIZE ? len : TX_BUF_SIZE;
+				while (ring_space(r) < n)
+					;
+				ring_write(r, data, n);
+				kick_tx();
+				data += n;
+				len -= n;
+			}
+			return 0;
+		}
+	}
+
+	if (ring_write(r, data, len)) {
+		USART2_tx_dropped++;
+		return -1;
+	}
+	kick_tx();
+	return 0;
+}
+
+/*
+ * What USART2_write does when the ring's full, USART2_TX_DROP or
+ * USART2_TX_BLOCK. Returns the old one.
+ */
+int USART2_set_policy(int policy) {
+	int old = tx_policy;
+
+	tx_policy = policy;
+	return old;
+}
+
+/*
+ * Nonzero takes the console for a run of writes that has to go out
+ * whole (a trace dump, say), made with USART2_write_claimed: until it's
+ * given back, other main loop writes are dropped and what handlers write
+ * is held back (queued, and dropped once their ring is full). A handler
+ * run already going out finishes first. Zero gives it back; the
+ * handlers' bytes follow once the claim's are all out. Main loop only.
+ */
+void USART2_claim(int claim) {
+	if (claim) {
+		tx_hold_handler = HOLD_ON;
+		tx_claimed = 1;
+		return;
+	}
+	tx_claimed = 0;
+	tx_hold_handler = HOLD_DRAIN;
+	// (the DMA handler lets go when the main ring empties, if not now)
+	if (!ring_count(&tx_ring[TX_RING_MAIN]))
+		tx_hold_handler = HOLD_OFF;
+	kick_tx();
+}
+
+/*
+ * USART2_write for whoever has claimed the console: all or nothing,
+ * returns -1 without queueing if there isn't room. Main loop only.
+ */
+int USART2_write_claimed(const char *data, int len) {
+	if (ring_write(&tx_ring[TX_RING_MAIN], data, len))
+		return -1;
+	kick_tx();
+	return 0;
+}
+
+/*
+ * Room in the main loop's ring, for USART2_write_claimed
+ */
+int USART2_tx_space(void) {
+	return ring_space(&tx_ring[TX_RING_MAIN]);
+}
+
+/*
+ * Bytes still waiting to go out
+ */
+int USART2_tx_pending(void) {
+	return ring_count(&tx_ring[TX_RING_MAIN]) + ring_count(&tx_ring[TX_RING_HANDLER]);
+}
+
+void __attribute__ ((interrupt)) DMA1_stream6_handler(void) {
+	uint32_t flags = DMA1->DMA_HISR;
+
+	// Clear all the stream 6 flags
+	DMA1->DMA_HIFCR = 0x003D0000;
+
+	if (flags & (1 << 21)) { // TCIF6: the run went out, move past it
+		ring_skip(&tx_ring[tx_dma_ring], tx_dma_len);
+	} else if (flags & (1 << 19)) { // TEIF6: throw the run away
+		ring_skip(&tx_ring[tx_dma_ring], tx_dma_len);
+		USART2_tx_dropped++;
+	} else {
+		return; // still going
+	}
+	tx_dma_len = 0;
+
+	// A claim's bytes are all out: the handlers' can go now
+	if (tx_hold_handler == HOLD_DRAIN && !ring_count(&tx_ring[TX_RING_MAIN]))
+		tx_hold_handler = HOLD_OFF;
+
+	// Start on whatever was queued in the meantime
+	store_release(&tx_busy, 0);
+	kick_tx();
 }
 
 
 void USART2_send(char c) {
- 	/* Wait for USART transmit shift register to be empty */
-	while (!(USART2->USART_SR & (1 << 7)));
- 	USART2->USART_DR = 0xFF & c;
+	// Queued like everything else, so it can't cut into a DMA run
+	USART2_write(&c, 1);
 }
 
 
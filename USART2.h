@@ -8,10 +8,28 @@
 #ifndef USART2_H_
 #define USART2_H_
 
+#include "stdint.h"
+
+// What USART2_write does when the transmit ring is full
+#define USART2_TX_DROP 0	// throw the write away (and count it)
+#define USART2_TX_BLOCK 1	// wait for room - main loop only, handlers always drop
+
 void USART2_init(void);
-void USART2_send(int c);
-int USART2_recv(void);
+void USART2_send(char c);
+char USART2_recv(void);
+
+// Non-blocking, DMA-driven transmit
+// Returns 0 if queued, -1 if it was dropped
+int USART2_write(const char *data, int len);
+int USART2_set_policy(int policy);
+// A run of writes that nothing else may cut into (see USART2.c)
+void USART2_claim(int claim);
+int USART2_write_claimed(const char *data, int len);
+int USART2_tx_space(void);
+int USART2_tx_pending(void);
+extern volatile uint32_t USART2_tx_dropped;
 
 void __attribute__ ((interrupt)) USART2_handler(void);
+void __attribute__ ((interrupt)) DMA1_stream6_handler(void);
 
 #endif /* USART2_H_ */
@@ -19,6 +19,47 @@
  */
 
 #include "stm32f4xx.h"
+#include "clock.h"
+#include "mutex.h"
+#include "ring.h"
+
+#define USART3_BAUD 115200 // what the ESP8266 is set to
+
+/* Transmit rings, drained by DMA1 stream 3 (channel 4, USART3_TX)
+ * See [1]-9.3.3 Table 42
+ *
+ * USART3_write is the producer and the DMA completion handler the
+ * consumer (see ring.c). A ring only takes one producer, and there are
+ * two: the console handler passes bytes through in CONFIGURE, and the
+ * main loop can still be sending a packet when EXTI0 switches to it. So,
+ * as in USART2.c, the main loop and interrupt handlers each have their
+ * own ring, and the DMA takes a run from whichever has something,
+ * handlers' first.
+ */
+#define TX_BUF_SIZE 256 // must be a power of 2
+#define TX_RING_MAIN 0
+#define TX_RING_HANDLER 1
+
+static uint8_t tx_buf[2][TX_BUF_SIZE];
+static ring_t tx_ring[2];
+static volatile uint32_t tx_dma_ring = 0; // which the transfer in progress is from
+static volatile uint32_t tx_dma_len = 0; // bytes in the transfer in progress
+// Nonzero while the stream is running; whoever swaps it to 1 starts it
+static volatile uint32_t tx_busy = 0;
+
+// Number of packets thrown away because the ring was full
+volatile uint32_t USART3_tx_dropped = 0;
+
+/* Receive ring, filled by DMA1 stream 1 (channel 4, USART3_RX) in circular mode.
+ * The write position comes from the stream's NDTR, rx_read is how far
+ * USART3_read has consumed.
+ */
+#define RX_BUF_SIZE 256
+
+static char rx_buf[RX_BUF_SIZE];
+static uint32_t rx_read = 0;
+
+static int start_tx_dma(void);
 
 void USART3_init(void) {
 	/* We'll run USART3 through ports PD8 (TX) and PD9 (RX)
@@ -37,6 +78,9 @@ void USART3_init(void) {
 	 */
 	RCC->APB1ENR |= 1 << 18;
 
+	ring_init(&tx_ring[TX_RING_MAIN], tx_buf[TX_RING_MAIN], TX_BUF_SIZE);
+	ring_init(&tx_ring[TX_RING_HANDLER], tx_buf[TX_RING_HANDLER], TX_BUF_SIZE);
+
 	/*
 	 * Configure GPIOD Pin 8 (TX) as:
 	 *   Alternate function output, AF7
@@ -79,24 +123,63 @@ void USART3_init(void) {
 	 */
 	USART3->USART_CR1 |= 0x2000;
 
-	/* Set the baudrate to 57600.
-	 * SYSCLK = 16 MHz:
-	 * 16,000,000 / 57,600 = 278
-	 *
+	/* Set the baud rate to USART3_BAUD from APB1's clock.
+	 * With 16x oversampling BRR is just PCLK1 / baud, the low 4 bits being
+	 * the fraction: at 42 MHz, 115200 baud gives 365 (0.1% fast).
 	 *
-	 * See	[1]-26.6.3
-	 * Following USART2 code given - doesn't make sense with documentation but I know it works
+	 * See	[1]-26.3.4, [1]-26.6.3
 	 */
-//	USART3->USART_BRR = 0xFFFF & 1667; // baud rate 9600
-//	USART3->USART_BRR = 0xFFFF & 278; // baud rate 57600
-	USART3->USART_BRR = 0xFFFF & 139; // baud rate 57600
+	USART3->USART_BRR = 0xFFFF & ((clock_pclk1_hz + USART3_BAUD / 2) / USART3_BAUD);
+
+	/*******************************************
+	 * Configure DMA1 stream 1 for receive
+	 *******************************************/
+	// Enable clock to DMA1
+	// Set bit 21 (DMA1EN) of RCC_AHB1ENR to high
+	// [1] 6.3.12 p.145
+	RCC->AHB1ENR |= 1 << 21;
+
+	// Make sure the stream is off before configuring it
+	// [1] 9.5.5 p.240
+	DMA1->DMA_S1CR &= ~1;
+	while (DMA1->DMA_S1CR & 1);
+
+	// Channel 4 (bits 27:25 = '100'), peripheral-to-memory (DIR, bits 7:6 = '00'),
+	// circular mode (CIRC, bit 8), memory increment (MINC, bit 10), byte sizes,
+	// high priority (PL, bits 17:16 = '10'), half-transfer and transfer complete
+	// interrupts (HTIE, bit 3 and TCIE, bit 4)
+	// [1] 9.5.5 pp.237-240
+	DMA1->DMA_S1CR = (4 << 25) | (2 << 16) | (1 << 10) | (1 << 8) | (1 << 4) | (1 << 3);
+
+	// Peripheral is the USART3 data register, memory is the receive ring
+	// [1] 9.5.6-9.5.8 pp.240-241
+	DMA1->DMA_S1PAR = (uint32_t)&(USART3->USART_DR);
+	DMA1->DMA_S1M0AR = (uint32_t)rx_buf;
+	DMA1->DMA_S1NDTR = RX_BUF_SIZE;
+
+	// Clear the stream 1 flags (bits 11:6 of LIFCR) and enable the stream
+	DMA1->DMA_LIFCR = 0xF40;
+	DMA1->DMA_S1CR |= 1;
+
+	// Let the USART request DMA transfers on receive
+	// Set bit 6 (DMAR) of USART_CR3
+	// [1] 26.6.6 p.787
+	USART3->USART_CR3 |= 1 << 6;
+
+	/* Enable DMA1 stream 1 in the NVIC
+	 * Position 12 in the vector table [1]-10.2 p.249
+	 * Set bit 12 in NVIC_ISER0 [4]-4.3.11 p.205
+	 */
+	uint32_t *NVIC_ISER0 = (uint32_t*)0xE000E100;
+	*NVIC_ISER0 |= 1 << 12;
 
 	/* Configure interrupts *from* the USART
-	 * Set bit 5 in USART3_CR1
-	 * RXNE interrupt enable
+	 * Set bit 4 in USART3_CR1
+	 * IDLE interrupt enable - the DMA takes the bytes, we only
+	 * want to hear about the gap at the end of a frame
 	 * See	[1]-26.6.4
 	 */
-	USART3->USART_CR1 |= 1 << 5;
+	USART3->USART_CR1 |= 1 << 4;
 
 	/* Configure the NVIC to pass interrupts *from* the USART *to* the processor
 	 * Enable position 39 in the vector table [1]-10.2 p.249
@@ -110,17 +193,193 @@ void USART3_init(void) {
 	 * See [1]-26.6.4 pp.782-783
 	 */
 	USART3->USART_CR1 |= 0xC;
+
+	/*******************************************
+	 * Configure DMA1 stream 3 for transmit
+	 *******************************************/
+	// Make sure the stream is off before configuring it
+	// [1] 9.5.5 p.240
+	DMA1->DMA_S3CR &= ~1;
+	while (DMA1->DMA_S3CR & 1);
+
+	// Channel 4 (bits 27:25 = '100'), memory-to-peripheral (DIR, bits 7:6 = '01'),
+	// memory increment (MINC, bit 10), byte sizes (PSIZE/MSIZE = '00'),
+	// medium priority (PL, bits 17:16 = '01'), transfer complete interrupt (TCIE, bit 4)
+	// and transfer error interrupt (TEIE, bit 2)
+	// [1] 9.5.5 pp.237-240
+	DMA1->DMA_S3CR = (4 << 25) | (1 << 16) | (1 << 10) | (1 << 6) | (1 << 4) | (1 << 2);
+
+	// Peripheral address is the USART3 data register
+	// [1] 9.5.7 p.240
+	DMA1->DMA_S3PAR = (uint32_t)&(USART3->USART_DR);
+
+	// Let the USART request DMA transfers on transmit
+	// Set bit 7 (DMAT) of USART_CR3
+	// [1] 26.6.6 p.787
+	USART3->USART_CR3 |= 1 << 7;
+
+	/* Enable DMA1 stream 3 in the NVIC
+	 * Position 14 in the vector table [1]-10.2 p.249
+	 * Set bit 14 in NVIC_ISER0 [4]-4.3.11 p.205
+	 */
+	*NVIC_ISER0 |= 1 << 14;
 }
 
+/*
+ * Kick off a DMA transfer of the next contiguous run of queued bytes
+ * from one of the rings (up to the end of the ring - the wrapped part
+ * goes in the next transfer). Only called by whoever set tx_busy.
+ * Returns 0 if there was nothing to send.
+ */
+static int start_tx_dma(void) {
+	const uint8_t *data;
+	uint32_t len;
+	int r = TX_RING_HANDLER;
+
+	len = ring_peek(&tx_ring[r], &data);
+	if (len == 0) {
+		r = TX_RING_MAIN;
+		len = ring_peek(&tx_ring[r], &data);
+		if (len == 0)
+			return 0;
+	}
+	tx_dma_ring = r;
+	tx_dma_len = len;
+
+	// Clear the stream 3 flags (bits 27:22 of LIFCR) before enabling
+	// [1] 9.5.3 p.235
+	DMA1->DMA_LIFCR = 0x0F400000;
+	DMA1->DMA_S3M0AR = (uint32_t)data;
+	DMA1->DMA_S3NDTR = len;
+	DMA1->DMA_S3CR |= 1;
+	return 1;
+}
 
+/*
+ * Start the stream if there's anything queued and it isn't running.
+ * The writer and the completion handler both call this after they've
+ * done their part, so whichever of them is last to look sees the bytes;
+ * the swap makes sure only one of them starts it.
+ */
+static void kick_tx(void) {
+	while ((ring_count(&tx_ring[TX_RING_MAIN]) || ring_count(&tx_ring[TX_RING_HANDLER])) &&
+			atomic_swap(&tx_busy, 1) == 0) {
+		if (start_tx_dma())
+			return;
+		store_release(&tx_busy, 0); // taken already, look again
+	}
+}
+
+/*
+ * Nonzero in an interrupt handler - IPSR holds the exception number
+ * [4] 2.1.3 p.18
+ */
+static int in_handler(void) {
+	uint32_t ipsr;
+
+	__asm volatile ("mrs %0, ipsr" : "=r" (ipsr));
+	return ipsr != 0;
+}
+
+/*
+ * Queue len bytes for transmission and return immediately, on the main
+ * loop's ring or, from an interrupt handler, the handlers' one.
+ * The bytes are queued all-or-nothing so a packet is never cut short:
+ * returns 0 if queued, -1 if there wasn't room (the data is dropped).
+ */
+int USART3_write(const char *data, int len) {
+	ring_t *r = &tx_ring[in_handler() ? TX_RING_HANDLER : TX_RING_MAIN];
+
+	if (ring_write(r, data, len)) {
+		atomic_add(&USART3_tx_dropped, 1); // the other ring's producer counts here too
+		return -1;
+	}
+	kick_tx();
+	return 0;
+}
+
+/*
+ * Number of bytes still waiting to go out
+ */
+int USART3_tx_pending(void) {
+	return ring_count(&tx_ring[TX_RING_MAIN]) + ring_count(&tx_ring[TX_RING_HANDLER]);
+}
 
 void USART3_send(char c) {
- 	/* Wait for USART transmit shift register to be empty */
-	uint32_t done_flag = 1 << 7;
-	while (!(USART3->USART_SR & done_flag));
- 	USART3->USART_DR = 0xFF & c;
+	/* Queue a single byte - shares the DMA path so it can't
+	 * collide with a packet that's already going out
+	 */
+	USART3_write(&c, 1);
+}
+
+void __attribute__ ((interrupt)) DMA1_stream3_handler(void) {
+	uint32_t flags = DMA1->DMA_LISR;
+
+	// Clear all the stream 3 flags
+	DMA1->DMA_LIFCR = 0x0F400000;
+
+	if (flags & (1 << 27)) { // TCIF3: the run went out, move past it
+		ring_skip(&tx_ring[tx_dma_ring], tx_dma_len);
+	} else if (flags & (1 << 25)) { // TEIF3: throw the run away
+		ring_skip(&tx_ring[tx_dma_ring], tx_dma_len);
+		USART3_tx_dropped++;
+	} else {
+		return; // still going
+	}
+	tx_dma_len = 0;
+
+	// Start on whatever was queued in the meantime
+	store_release(&tx_busy, 0);
+	kick_tx();
+}
+
+
+/*
+ * Copy up to max newly received bytes out of the DMA ring into buf.
+ * Returns the number of bytes copied. Bytes past max stay queued for the
+ * next call. Only call from one context (the USART3 handler).
+ */
+int USART3_read(char *buf, int max) {
+	// NDTR counts down from RX_BUF_SIZE as the DMA fills the ring
+	uint32_t write = RX_BUF_SIZE - DMA1->DMA_S1NDTR;
+	int n = 0;
+
+	if (write == RX_BUF_SIZE)
+		write = 0;
+
+	while (rx_read != write && n < max) {
+		buf[n++] = rx_buf[rx_read];
+		if (++rx_read == RX_BUF_SIZE)
+			rx_read = 0;
+	}
+	return n;
 }
 
+/*
+ * Returns nonzero if the line went idle (end of a frame) since the last call,
+ * and clears the flag: IDLE is cleared by reading SR then DR [1]-26.6.1
+ */
+int USART3_rx_idle(void) {
+	if (USART3->USART_SR & (1 << 4)) {
+		(void)USART3->USART_DR;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Half and full ring events: nothing to do here but make sure the
+ * bytes get drained before the DMA laps them, so pend the USART3
+ * interrupt and let its handler pick them up.
+ */
+void __attribute__ ((interrupt)) DMA1_stream1_handler(void) {
+	// Clear the stream 1 flags
+	DMA1->DMA_LIFCR = 0xF40;
+
+	// Set bit 7 in NVIC_ISPR1 (USART3 is position 39) [4]-4.3.13 p.206
+	uint32_t *NVIC_ISPR1 = (uint32_t*)0xE000E204;
+	*NVIC_ISPR1 = 0x80;
+}
 
 char USART3_recv(void) {
 	// Wait for a bit to be received
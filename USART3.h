@@ -8,10 +8,25 @@
 #ifndef USART3_H_
 #define USART3_H_
 
+#include "stdint.h"
+
 void USART3_init(void);
 void USART3_send(int c);
 int USART3_recv(void);
 
+// Non-blocking, DMA-driven transmit
+// Returns 0 if queued, -1 if the transmit ring is full
+int USART3_write(const char *data, int len);
+int USART3_tx_pending(void);
+extern volatile uint32_t USART3_tx_dropped;
+
+// DMA-driven receive
+// USART3_read returns how many bytes were copied into buf
+int USART3_read(char *buf, int max);
+int USART3_rx_idle(void);
+
 void __attribute__ ((interrupt)) USART3_handler(void);
+void __attribute__ ((interrupt)) DMA1_stream1_handler(void);
+void __attribute__ ((interrupt)) DMA1_stream3_handler(void);
 
 #endif /* USART3_H_ */
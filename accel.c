@@ -15,8 +15,12 @@
 
 #include "stm32f4xx.h"
 #include "stdint.h"
+#include "clock.h"
 #include "accel.h"
 
+// Keep SCLK at or under 1 MHz whatever APB2 runs at
+#define ACCEL_SPI_MAX_HZ 1000000
+
 void accel_cs_high(void);
 void accel_config(void);
 
@@ -68,11 +72,15 @@ void accel_init(void)
 	// Reference: [1] 6.3.17
 	RCC->APB2ENR |= 0x1000;
 
-	// Set the baud rate to divide clock by 16 => 1 MHz
-	// by setting BR[2:0] <= 011
+	// Set the baud rate: PCLK2 / 2^(BR+1), the smallest divider that
+	// keeps under ACCEL_SPI_MAX_HZ (84 MHz / 128 => 656 kHz)
+	// by setting BR[2:0]
 	// Reference:	[1] 27.3.3 p.799
 	//				[1] 27.5.1 p.833
-	SPI1->SPI_CR1 = (SPI1->SPI_CR1 & ~0x38) | 0x18;
+	val = 0;
+	while ((clock_pclk2_hz >> (val + 1)) > ACCEL_SPI_MAX_HZ && val < 7)
+		val++;
+	SPI1->SPI_CR1 = (SPI1->SPI_CR1 & ~0x38) | (val << 3);
 
 	// Set the clock idle to high
 	// Set bit 1 (CPOL) of SPI_CR1 to high
@@ -0,0 +1,142 @@
+/*
+ * calib.c
+ *
+ * Maps each joint's pot reading to a servo t_high with integers only.
+ * Every joint has its own pot endpoints and pulse range, so a pot that
+ * only turns through part of its travel still drives the whole servo
+ * range (or a servo that can't take 1000-2000 us gets what it can).
+ *
+ * Once calib_update has worked out the slope, a conversion is a clamp,
+ * one multiply and a shift.
+ *
+ * Capture: calib_capture_start, then feed it samples while every joint is
+ * moved end to end, then calib_capture_finish takes the extremes it saw
+ * as the new endpoints.
+ */
+
+#include "stdint.h"
+#include "calib.h"
+
+// Defaults: full 12-bit pot range onto 1000-2000 us
+calib_t calib[NUM_JOINTS] = {
+	{ 0, 0xFFF, 1000, 2000, 0, 0, 0 },
+	{ 0, 0xFFF, 1000, 2000, 0, 0, 0 },
+	{ 0, 0xFFF, 1000, 2000, 0, 0, 0 },
+	{ 0, 0xFFF, 1000, 2000, 0, 0, 0 },
+	{ 0, 0xFFF, 1000, 2000, 0, 0, 0 },
+};
+
+static int capturing = 0;
+static uint16_t seen_min[NUM_JOINTS];
+static uint16_t seen_max[NUM_JOINTS];
+
+/**
+ * Work out the slopes for the table above
+ */
+void calib_init(void) {
+	for (int i=PIVOT_ID; i<=GRIP_ID; i++)
+		calib_update(i);
+}
+
+/**
+ * Recompute a joint's slope after changing its endpoints
+ */
+void calib_update(int joint) {
+	calib_t *c = &calib[joint];
+	uint32_t span = c->adc_max - c->adc_min;
+	uint32_t us_span = c->us_max - c->us_min;
+
+	if (c->adc_max <= c->adc_min) {
+		c->slope = 0;
+		return;
+	}
+
+	// Q12: in calib_map (counts into the span) * slope stays around
+	// us_span << 12, well inside 32 bits
+	c->slope = ((us_span << 12) + span / 2) / span;
+}
+
+/**
+ * Convert a 12-bit pot reading for the given joint (PIVOT_ID - GRIP_ID)
+ * to a servo t_high in us
+ */
+int calib_map(int joint, uint32_t sample) {
+	const calib_t *c = &calib[joint];
+	uint32_t us_span = c->us_max - c->us_min;
+	uint32_t us;
+
+	if (sample <= c->adc_min)
+		us = 0;
+	else if (sample >= c->adc_max)
+		us = us_span;
+	else
+		us = ((sample - c->adc_min) * c->slope + (1 << 11)) >> 12;
+
+	if (us > us_span)
+		us = us_span;
+	if (c->invert)
+		us = us_span - us;
+
+	return c->us_min + (int)us + c->offset_us;
+}
+
+/**
+ * Start recording the extremes each joint reaches
+ */
+void calib_capture_start(void) {
+	for (int i=PIVOT_ID; i<=GRIP_ID; i++) {
+		seen_min[i] = 0xFFF;
+		seen_max[i] = 0;
+	}
+	capturing = 1;
+}
+
+/**
+ * Record one frame of (filtered) pot readings
+ */
+void calib_capture_sample(const uint32_t *data) {
+	if (!capturing)
+		return;
+
+	for (int i=PIVOT_ID; i<=GRIP_ID; i++) {
+		if (data[i] < seen_min[i])
+			seen_min[i] = data[i];
+		if (data[i] > seen_max[i])
+			seen_max[i] = data[i];
+	}
+}
+
+/**
+ * Stop recording and use what was seen as each joint's endpoints.
+ * A joint that moved less than CALIB_MIN_SPAN keeps its old endpoints.
+ * Returns a bitmask of the joints that were updated.
+ */
+int calib_capture_finish(void) {
+	int updated = 0;
+
+	if (!capturing)
+		return 0;
+	capturing = 0;
+
+	for (int i=PIVOT_ID; i<=GRIP_ID; i++) {
+		if (seen_max[i] < seen_min[i] + CALIB_MIN_SPAN)
+			continue;
+		calib[i].adc_min = seen_min[i];
+		calib[i].adc_max = seen_max[i];
+		calib_update(i);
+		updated |= 1 << i;
+	}
+	return updated;
+}
+
+/**
+ * Stop recording and keep the endpoints as they were (e.g. when the mode
+ * changes part way through a capture)
+ */
+void calib_capture_cancel(void) {
+	capturing = 0;
+}
+
+int calib_capturing(void) {
+	return capturing;
+}
@@ -0,0 +1,38 @@
+/*
+ * calib.h
+ *
+ * Per-joint mapping from pot readings to servo pulse widths
+ */
+
+#ifndef CALIB_H_
+#define CALIB_H_
+
+#include "stdint.h"
+#include "network.h"
+
+// Narrowest pot sweep (ADC counts) a capture will accept
+#define CALIB_MIN_SPAN 256
+
+typedef struct {
+	uint16_t adc_min;	// pot reading at one end of travel
+	uint16_t adc_max;	// ... and the other
+	uint16_t us_min;	// t_high (us) the joint maps to at adc_min
+	uint16_t us_max;	// ... and at adc_max
+	int16_t offset_us;	// trim added after mapping
+	uint8_t invert;		// nonzero: adc_min maps to us_max instead
+	uint32_t slope;		// us per count in Q12, set by calib_update
+} calib_t;
+
+extern calib_t calib[NUM_JOINTS];
+
+void calib_init(void);
+void calib_update(int joint);
+int calib_map(int joint, uint32_t sample);
+
+void calib_capture_start(void);
+void calib_capture_sample(const uint32_t *data);
+int calib_capture_finish(void);
+void calib_capture_cancel(void);
+int calib_capturing(void);
+
+#endif /* CALIB_H_ */
@@ -0,0 +1,152 @@
+/*
+ * clock.c
+ *
+ * Out of reset everything runs from the 16 MHz HSI oscillator. This
+ * brings up the 8 MHz crystal and runs the core from the PLL at
+ * 168 MHz, with the flash wait states, prefetch and caches that needs,
+ * and the APB buses at their limits (42 and 84 MHz).
+ *
+ * Peripherals don't assume any of those: they read clock_pclk1_hz etc.
+ * (or clock_timer_hz) when they're set up, so clock_init has to run
+ * before any of them.
+ *
+ * If the crystal doesn't start the PLL is fed from HSI instead, which
+ * gets to the same frequencies (less accurately - HSI is +-1%).
+ *
+ * Documentation references:
+ * [1]: STM32F40x Reference Manual
+ * [2]: STM32F407VG Datasheet
+ */
+
+#include "stm32f4xx.h"
+#include "stdint.h"
+#include "clock.h"
+
+// How many times to poll HSERDY before giving up on the crystal
+#define HSE_STARTUP_TIMEOUT 0x8000
+
+uint32_t clock_sysclk_hz = CLOCK_HSI_HZ;
+uint32_t clock_hclk_hz = CLOCK_HSI_HZ;
+uint32_t clock_pclk1_hz = CLOCK_HSI_HZ;
+uint32_t clock_pclk2_hz = CLOCK_HSI_HZ;
+int clock_on_hsi = 1;
+
+static uint32_t apb1_div = 1;
+static uint32_t apb2_div = 1;
+
+/*
+ * Start HSE, returns 1 once it's ready or 0 if it never came up
+ */
+static int hse_start(void)
+{
+	// Set bit 16 (HSEON) of RCC_CR, wait for bit 17 (HSERDY)
+	// Ref: [1] 6.3.1 p.161
+	RCC->CR |= 1 << 16;
+	for (int i=0; i<HSE_STARTUP_TIMEOUT; i++)
+		if (RCC->CR & (1 << 17))
+			return 1;
+
+	RCC->CR &= ~(1 << 16);
+	return 0;
+}
+
+/*
+ * Switch SYSCLK to the PLL at 168 MHz
+ */
+void clock_init(void)
+{
+	uint32_t src_hz, m, val;
+
+	/*******************************************
+	 * Regulator
+	 *******************************************/
+	// Voltage scale 1 is needed above 144 MHz
+	// Set bit 28 (PWREN) of RCC_APB1ENR, then bit 14 (VOS) of PWR_CR
+	// Ref: [1] 6.3.13 p.148, 5.4.1 p.118
+	RCC->APB1ENR |= 1 << 28;
+	PWR->PWR_CR |= 1 << 14;
+
+	/*******************************************
+	 * PLL
+	 *******************************************/
+	if (hse_start()) {
+		clock_on_hsi = 0;
+		src_hz = CLOCK_HSE_HZ;
+	} else {
+		src_hz = CLOCK_HSI_HZ;
+	}
+	m = src_hz / 1000000;
+
+	// PLLM (5:0), PLLN (14:6), PLLP (17:16, 00 = /2), PLLSRC (22), PLLQ (27:24)
+	// The other bits are reserved and keep their reset value
+	// Ref: [1] 6.3.2 p.163
+	val = RCC->PLLCFGR & ~0x0F437FFF;
+	val |= m;
+	val |= CLOCK_PLL_N << 6;
+	val |= (CLOCK_PLL_P / 2 - 1) << 16;
+	if (!clock_on_hsi)
+		val |= 1 << 22;
+	val |= CLOCK_PLL_Q << 24;
+	RCC->PLLCFGR = val;
+
+	// Set bit 24 (PLLON) of RCC_CR, wait for bit 25 (PLLRDY)
+	// Ref: [1] 6.3.1 p.160
+	RCC->CR |= 1 << 24;
+	while (!(RCC->CR & (1 << 25)))
+		;
+
+	/*******************************************
+	 * Flash
+	 *******************************************/
+	// The caches have to be off to be reset, so flush them first
+	// Bits 9 (ICEN), 10 (DCEN), 11 (ICRST), 12 (DCRST) of FLASH_ACR
+	// Ref: [1] 3.9.1 p.98
+	FLASH->FLASH_ACR &= ~((1 << 9) | (1 << 10));
+	FLASH->FLASH_ACR |= (1 << 11) | (1 << 12);
+	FLASH->FLASH_ACR &= ~((1 << 11) | (1 << 12));
+
+	// Wait states before the clock goes up, then prefetch (bit 8) and both
+	// caches (the ART accelerator) - [1] 3.5.1, 3.5.2
+	FLASH->FLASH_ACR = (FLASH->FLASH_ACR & ~0x7) | CLOCK_FLASH_LATENCY;
+	FLASH->FLASH_ACR |= (1 << 8) | (1 << 9) | (1 << 10);
+
+	// Must read back before it's safe to speed up - [1] 3.5.1 p.81
+	while ((FLASH->FLASH_ACR & 0x7) != CLOCK_FLASH_LATENCY)
+		;
+
+	/*******************************************
+	 * Bus prescalers and switch over
+	 *******************************************/
+	// HPRE (7:4) = 0xxx: AHB /1
+	// PPRE1 (12:10) = 101: APB1 /4
+	// PPRE2 (15:13) = 100: APB2 /2
+	// Ref: [1] 6.3.3 p.165
+	val = RCC->CFGR & ~0xFCF0;
+	val |= 5 << 10;
+	val |= 4 << 13;
+	RCC->CFGR = val;
+
+	// Set bits 1:0 (SW) to '10' (PLL), wait for bits 3:2 (SWS) to agree
+	// Ref: [1] 6.3.3 p.166
+	RCC->CFGR = (RCC->CFGR & ~0x3) | 0x2;
+	while ((RCC->CFGR & 0xC) != 0x8)
+		;
+
+	clock_sysclk_hz = src_hz / m * CLOCK_PLL_N / CLOCK_PLL_P;
+	clock_hclk_hz = clock_sysclk_hz;
+	apb1_div = CLOCK_APB1_DIV;
+	apb2_div = CLOCK_APB2_DIV;
+	clock_pclk1_hz = clock_hclk_hz / apb1_div;
+	clock_pclk2_hz = clock_hclk_hz / apb2_div;
+}
+
+/**
+ * The clock the timers on APB1 or APB2 count: twice the bus clock
+ * whenever the bus is divided down - [1] 6.2 p.134
+ */
+uint32_t clock_timer_hz(int apb)
+{
+	if (apb == CLOCK_APB1)
+		return apb1_div == 1 ? clock_pclk1_hz : 2 * clock_pclk1_hz;
+	return apb2_div == 1 ? clock_pclk2_hz : 2 * clock_pclk2_hz;
+}
@@ -0,0 +1,48 @@
+/*
+ * clock.h
+ *
+ * System clock tree: 168 MHz from the PLL, and the bus frequencies the
+ * peripherals work their dividers out from
+ */
+
+#ifndef CLOCK_H_
+#define CLOCK_H_
+
+#include "stdint.h"
+
+#define CLOCK_HSE_HZ 8000000		// crystal on the Discovery board (X2)
+#define CLOCK_HSI_HZ 16000000
+
+/* PLL: VCO in = 1 MHz (2 MHz is better for jitter but 1 MHz lets the
+ * same N serve both sources), VCO out = 336 MHz,
+ * SYSCLK = VCO / 2 = 168 MHz, 48 MHz clock = VCO / 7
+ */
+#define CLOCK_PLL_N 336
+#define CLOCK_PLL_P 2
+#define CLOCK_PLL_Q 7
+
+// AHB /1, APB1 /4 (42 MHz max), APB2 /2 (84 MHz max)
+#define CLOCK_APB1_DIV 4
+#define CLOCK_APB2_DIV 2
+
+// Flash wait states for 168 MHz at 2.7-3.6 V - [1] 3.5.1 Table 10
+#define CLOCK_FLASH_LATENCY 5
+
+#define CLOCK_APB1 1
+#define CLOCK_APB2 2
+
+/* What the clocks are running at. Until clock_init these hold the reset
+ * values (everything on HSI); afterwards, whatever it managed.
+ */
+extern uint32_t clock_sysclk_hz;
+extern uint32_t clock_hclk_hz;
+extern uint32_t clock_pclk1_hz;
+extern uint32_t clock_pclk2_hz;
+
+// Set if the crystal didn't start and the PLL is running from HSI instead
+extern int clock_on_hsi;
+
+void clock_init(void);
+uint32_t clock_timer_hz(int apb);
+
+#endif /* CLOCK_H_ */
@@ -0,0 +1,261 @@
+/*
+ * filter.c
+ *
+ * Fixed-point filtering of the joint potentiometers (see filter.h for the
+ * pipeline). filter_push is called from the ADC's DMA interrupt with each
+ * new frame; the main loop picks the result up with filter_read.
+ *
+ * Two channels go in each 32-bit word (channel 2k in the low halfword,
+ * 2k+1 in the high), and the M4 DSP instructions work on both halves at
+ * once:
+ *   SSUB16 + SEL  - per-halfword min/max for the median
+ *   UADD16        - per-halfword sums for the oversampling
+ *   PKHBT/PKHTB   - pair a new sample with the filter state
+ *   SMLAD         - (1 - alpha) * y + alpha * x in one instruction
+ *
+ * References:
+ * [1] DM00031020 RM0090 STM32F40x Reference Manual.pdf
+ * [2] PM0214 STM32F3/F4 Cortex-M4 Programming Manual
+ * [3] ARM DDI 0403 ARMv7-M Architecture Reference Manual
+ */
+
+#include "stdint.h"
+#include "profile.h"
+#include "filter.h"
+
+#if FILTER_OVERSAMPLE_SHIFT > 4
+#error "FILTER_OVERSAMPLE_SHIFT must be 4 or less (sums are 16 bits)"
+#endif
+
+#define FILTER_WORDS ((FILTER_CHANNELS + 1) / 2)
+
+int filter_iir_alpha = FILTER_IIR_ALPHA;
+
+#if FILTER_BENCHMARK
+volatile uint32_t filter_cycles_last = 0;
+volatile uint32_t filter_cycles_max = 0;
+#endif
+
+// The two frames before the current one, for the median
+static uint32_t hist[2][FILTER_WORDS];
+// Running sums for the decimation
+static uint32_t acc[FILTER_WORDS];
+static int acc_n = 0;
+// IIR state, Q15
+static uint32_t state[FILTER_WORDS];
+static int primed = 0;
+
+// Latest output, and a count to tell when it changes under a reader
+static int16_t output[FILTER_CHANNELS];
+static volatile uint32_t output_count = 0;
+
+/*
+ * Two-halfword helpers. On the M4 these are single DSP instructions
+ * ([3] A7.7); elsewhere plain C does the same thing per halfword.
+ */
+#if defined(__ARM_FEATURE_DSP)
+
+// Larger of each pair of signed halfwords
+static inline uint32_t max16(uint32_t a, uint32_t b) {
+	uint32_t r;
+	__asm__ ("ssub16 %0, %1, %2\n\tsel %0, %1, %2" : "=&r" (r) : "r" (a), "r" (b));
+	return r;
+}
+
+// Smaller of each pair of signed halfwords
+static inline uint32_t min16(uint32_t a, uint32_t b) {
+	uint32_t r;
+	__asm__ ("ssub16 %0, %1, %2\n\tsel %0, %2, %1" : "=&r" (r) : "r" (a), "r" (b));
+	return r;
+}
+
+static inline uint32_t uadd16(uint32_t a, uint32_t b) {
+	uint32_t r;
+	__asm__ ("uadd16 %0, %1, %2" : "=r" (r) : "r" (a), "r" (b));
+	return r;
+}
+
+// Low halfword of a, low halfword of b on top
+static inline uint32_t pack_low(uint32_t a, uint32_t b) {
+	uint32_t r;
+	__asm__ ("pkhbt %0, %1, %2, lsl #16" : "=r" (r) : "r" (a), "r" (b));
+	return r;
+}
+
+// High halfword of b, high halfword of a on top
+static inline uint32_t pack_high(uint32_t a, uint32_t b) {
+	uint32_t r;
+	__asm__ ("pkhtb %0, %1, %2, asr #16" : "=r" (r) : "r" (a), "r" (b));
+	return r;
+}
+
+// acc + low(a) * low(b) + high(a) * high(b)
+static inline int32_t smlad(uint32_t a, uint32_t b, int32_t acc) {
+	int32_t r;
+	__asm__ ("smlad %0, %1, %2, %3" : "=r" (r) : "r" (a), "r" (b), "r" (acc));
+	return r;
+}
+
+#else
+
+static inline uint32_t max16(uint32_t a, uint32_t b) {
+	uint32_t lo = ((int16_t)a >= (int16_t)b ? a : b) & 0xFFFF;
+	uint32_t hi = ((int16_t)(a >> 16) >= (int16_t)(b >> 16) ? a : b) & 0xFFFF0000;
+	return hi | lo;
+}
+
+static inline uint32_t min16(uint32_t a, uint32_t b) {
+	uint32_t lo = ((int16_t)a >= (int16_t)b ? b : a) & 0xFFFF;
+	uint32_t hi = ((int16_t)(a >> 16) >= (int16_t)(b >> 16) ? b : a) & 0xFFFF0000;
+	return hi | lo;
+}
+
+static inline uint32_t uadd16(uint32_t a, uint32_t b) {
+	return ((a + b) & 0xFFFF) | (((a >> 16) + (b >> 16)) << 16);
+}
+
+static inline uint32_t pack_low(uint32_t a, uint32_t b) {
+	return (a & 0xFFFF) | (b << 16);
+}
+
+static inline uint32_t pack_high(uint32_t a, uint32_t b) {
+	return (a & 0xFFFF0000) | (b >> 16);
+}
+
+static inline int32_t smlad(uint32_t a, uint32_t b, int32_t acc) {
+	return acc + (int16_t)a * (int16_t)b + (int16_t)(a >> 16) * (int16_t)(b >> 16);
+}
+
+#endif
+
+// Median of three, per halfword
+static inline uint32_t median16(uint32_t a, uint32_t b, uint32_t c) {
+	return max16(min16(a, b), min16(max16(a, b), c));
+}
+
+/**
+ * Reset the pipeline. The first frame pushed fills the history, so
+ * there's no ramp up from zero.
+ */
+void filter_init(void) {
+	for (int w=0; w<FILTER_WORDS; w++)
+		acc[w] = 0;
+	acc_n = 0;
+	primed = 0;
+
+#if FILTER_BENCHMARK
+	profile_cycles_start();
+	filter_cycles_max = 0;
+#endif
+}
+
+/**
+ * Run one 12-bit ADC frame through the pipeline.
+ * Returns 1 if it completed a decimated output, else 0.
+ */
+int filter_push(const uint32_t *frame) {
+	uint32_t in[FILTER_WORDS];
+	int done = 0;
+
+#if FILTER_BENCHMARK
+	uint32_t start = PROFILE_CYCCNT;
+#endif
+
+	// Pack the channels two to a word (the ADC leaves bits 31:12 clear)
+	for (int w=0; w<FILTER_WORDS; w++) {
+		uint32_t hi = (2*w + 1 < FILTER_CHANNELS) ? frame[2*w + 1] : 0;
+		in[w] = pack_low(frame[2*w], hi);
+	}
+
+	if (!primed) {
+		for (int w=0; w<FILTER_WORDS; w++)
+			hist[0][w] = hist[1][w] = in[w];
+	}
+
+	// Median of this frame and the two before it, then into the sums
+	for (int w=0; w<FILTER_WORDS; w++) {
+		uint32_t m = median16(hist[1][w], hist[0][w], in[w]);
+		hist[1][w] = hist[0][w];
+		hist[0][w] = in[w];
+		acc[w] = uadd16(acc[w], m);
+	}
+
+	if (++acc_n == (1 << FILTER_OVERSAMPLE_SHIFT)) {
+		int alpha = filter_iir_alpha;
+		if (alpha < 1)
+			alpha = 1;
+		if (alpha > 32767)
+			alpha = 32767;
+		// low half multiplies the new sample, high half the old output
+		uint32_t coef = ((uint32_t)(32768 - alpha) << 16) | (uint32_t)alpha;
+
+		for (int w=0; w<FILTER_WORDS; w++) {
+			// Scale the sums of 12-bit samples to Q15 (both halves at once -
+			// neither can carry into the other)
+#if FILTER_OVERSAMPLE_SHIFT <= 3
+			uint32_t x = acc[w] << (3 - FILTER_OVERSAMPLE_SHIFT);
+#else
+			uint32_t x = (acc[w] >> 1) & 0x7FFF7FFF;
+#endif
+			acc[w] = 0;
+
+			if (!primed) {
+				state[w] = x;
+				continue;
+			}
+
+			// y = ((1 - alpha) * y + alpha * x) / 32768, rounded
+			int32_t lo = smlad(pack_low(x, state[w]), coef, 1 << 14) >> 15;
+			int32_t hi = smlad(pack_high(state[w], x), coef, 1 << 14) >> 15;
+			state[w] = pack_low((uint32_t)lo, (uint32_t)hi);
+		}
+		acc_n = 0;
+		primed = 1;
+
+		for (int i=0; i<FILTER_CHANNELS; i++)
+			output[i] = (int16_t)(state[i / 2] >> (16 * (i & 1)));
+		output_count++;
+		done = 1;
+	}
+
+#if FILTER_BENCHMARK
+	filter_cycles_last = PROFILE_CYCCNT - start;
+	if (filter_cycles_last > filter_cycles_max)
+		filter_cycles_max = filter_cycles_last;
+#endif
+
+	return done;
+}
+
+/**
+ * Copy the latest filtered output as Q15 (0 - 32767 = 0 - full scale)
+ */
+void filter_read_q15(int16_t *data) {
+	uint32_t count;
+
+	// If an output landed mid-copy, copy again
+	do {
+		count = output_count;
+		for (int i=0; i<FILTER_CHANNELS; i++)
+			data[i] = output[i];
+	} while (count != output_count);
+}
+
+/**
+ * Copy the latest filtered output, scaled back to 12 bits so it can
+ * stand in for ADC_read
+ */
+void filter_read(uint32_t *data) {
+	int16_t q15[FILTER_CHANNELS];
+
+	filter_read_q15(q15);
+	for (int i=0; i<FILTER_CHANNELS; i++)
+		data[i] = (uint16_t)q15[i] >> 3;
+}
+
+/**
+ * Number of outputs produced since filter_init
+ */
+uint32_t filter_output_count(void) {
+	return output_count;
+}
@@ -0,0 +1,46 @@
+/*
+ * filter.h
+ *
+ * Fixed-point filtering of the joint potentiometers, run on every ADC frame
+ */
+
+#ifndef FILTER_H_
+#define FILTER_H_
+
+#include "stdint.h"
+
+#define FILTER_CHANNELS 5
+
+/* Pipeline, per channel:
+ *   12-bit sample -> median of the last 3 (throws away single-frame spikes)
+ *   -> sum 2^FILTER_OVERSAMPLE_SHIFT frames and decimate
+ *   -> first-order IIR low-pass, y += alpha * (x - y), in Q15
+ * The channels are packed two to a word and done with the M4 SIMD
+ * instructions, so five channels cost three passes.
+ */
+
+// Decimate by 2^this (1 kHz in, 250 Hz out at 2). At most 4 so the
+// sums still fit in 16 bits.
+#define FILTER_OVERSAMPLE_SHIFT 2
+
+// IIR alpha in Q15 (32767 = no smoothing, 8192 = 0.25)
+#define FILTER_IIR_ALPHA 8192
+
+// Set to 1 to count the cycles each frame takes in the DMA interrupt
+// (filter_cycles_last / filter_cycles_max)
+#define FILTER_BENCHMARK 0
+
+extern int filter_iir_alpha;
+
+#if FILTER_BENCHMARK
+extern volatile uint32_t filter_cycles_last;
+extern volatile uint32_t filter_cycles_max;
+#endif
+
+void filter_init(void);
+int filter_push(const uint32_t *frame);
+void filter_read(uint32_t *data);
+void filter_read_q15(int16_t *data);
+uint32_t filter_output_count(void);
+
+#endif /* FILTER_H_ */
@@ -0,0 +1,148 @@
+/*
+ * framing.c
+ *
+ * Self-synchronizing framing for packets over USART3.
+ *
+ * A frame on the wire is
+ *   0x00, COBS(payload, CRC-16 low byte, CRC-16 high byte), 0x00
+ *
+ * COBS (Consistent Overhead Byte Stuffing) removes every 0x00 from the
+ * data, so 0x00 only ever appears as a delimiter. After a dropped or
+ * corrupted byte the receiver throws away at most the frame it was in
+ * and picks up again at the next delimiter - no timeouts needed.
+ *
+ * The CRC is CRC-16/CCITT (poly 0x1021, init 0xFFFF).
+ */
+
+#include "stdint.h"
+#include "framing.h"
+#include "trace.h"
+
+// CRC-16/CCITT, one entry per nibble to keep the table small
+static const uint16_t crc_table[16] = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+	0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+};
+
+uint16_t crc16(const uint8_t *data, int len) {
+	uint16_t crc = 0xFFFF;
+
+	for (int i=0; i<len; i++) {
+		crc = (crc << 4) ^ crc_table[(crc >> 12) ^ (data[i] >> 4)];
+		crc = (crc << 4) ^ crc_table[(crc >> 12) ^ (data[i] & 0xF)];
+	}
+	return crc;
+}
+
+/*
+ * Encode len bytes of payload into out (at least FRAME_MAX_SIZE bytes).
+ * Returns the number of bytes to send, or -1 if the payload is too big.
+ */
+int frame_encode(const uint8_t *payload, int len, uint8_t *out) {
+	uint16_t crc = crc16(payload, len);
+	int n = 0;
+	int code_at;
+	uint8_t code = 1;
+	uint8_t b;
+
+	if (len > FRAME_MAX_PAYLOAD)
+		return -1;
+
+	out[n++] = 0; // start marker - ends any garbage the receiver is holding
+	code_at = n++;
+
+	for (int i=0; i<len+2; i++) {
+		if (i < len)
+			b = payload[i];
+		else if (i == len)
+			b = crc & 0xFF;
+		else
+			b = crc >> 8;
+
+		if (b == 0) {
+			// Close the block: its code says how far to the next zero
+			out[code_at] = code;
+			code = 1;
+			code_at = n++;
+		} else {
+			out[n++] = b;
+			if (++code == 0xFF) { // longest block - close it with no zero
+				out[code_at] = code;
+				code = 1;
+				code_at = n++;
+			}
+		}
+	}
+	out[code_at] = code;
+	out[n++] = 0; // end marker
+	return n;
+}
+
+/*
+ * Undo COBS in place. Returns the decoded length or -1 if the
+ * block codes don't fit the data.
+ */
+static int cobs_decode(uint8_t *buf, int len) {
+	int r = 0;
+	int w = 0;
+
+	while (r < len) {
+		int code = buf[r++];
+		if (code == 0 || r + code - 1 > len)
+			return -1;
+		for (int i=1; i<code; i++)
+			buf[w++] = buf[r++];
+		if (code < 0xFF && r < len)
+			buf[w++] = 0;
+	}
+	return w;
+}
+
+/*
+ * Feed one received byte to the decoder.
+ * Returns the payload length when c completes a good frame - the payload
+ * is then in d->buf until the next call - otherwise 0.
+ */
+int frame_push(frame_decoder_t *d, uint8_t c) {
+	int len, coded;
+
+	if (c != 0) {
+		if (d->len < FRAME_MAX_CODED)
+			d->buf[d->len++] = c;
+		else
+			d->overflow = 1;
+		return 0;
+	}
+
+	// Delimiter: whatever we've gathered is a complete frame
+	len = d->len;
+	d->len = 0;
+
+	if (len == 0) // back-to-back delimiters, nothing in between
+		return 0;
+
+	if (d->overflow) {
+		d->overflow = 0;
+		d->frames_bad++;
+		TRACE(TRACE_RESYNC, TRACE_RESYNC_OVERFLOW, len);
+		return 0;
+	}
+
+	coded = len;
+	len = cobs_decode(d->buf, len);
+	if (len < 3) { // need at least one payload byte and the CRC
+		d->frames_bad++;
+		TRACE(TRACE_RESYNC, TRACE_RESYNC_COBS, coded);
+		return 0;
+	}
+
+	len -= 2;
+	if (crc16(d->buf, len) != (d->buf[len] | (d->buf[len+1] << 8))) {
+		d->frames_crc_err++;
+		TRACE(TRACE_RESYNC, TRACE_RESYNC_CRC, coded);
+		return 0;
+	}
+
+	d->frames_ok++;
+	return len;
+}
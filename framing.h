@@ -0,0 +1,35 @@
+/*
+ * framing.h
+ *
+ * Self-synchronizing packet framing for the WiFly link: COBS-encoded
+ * payload + CRC-16, delimited by 0x00 bytes.
+ */
+
+#ifndef FRAMING_H_
+#define FRAMING_H_
+#include "stdint.h"
+
+// Largest payload a frame can carry: the biggest v1 message, sizeof(Msg_t)
+// (network.c won't build if that outgrows it)
+#define FRAME_MAX_PAYLOAD 132
+// COBS adds a code byte per 254 bytes, plus the 2 CRC bytes
+#define FRAME_MAX_CODED (FRAME_MAX_PAYLOAD + 2 + (FRAME_MAX_PAYLOAD + 2)/254 + 1)
+// Encoded frame including the leading and trailing delimiters
+#define FRAME_MAX_SIZE (FRAME_MAX_CODED + 2)
+
+typedef struct {
+	uint8_t buf[FRAME_MAX_CODED];
+	int len;
+	int overflow;
+
+	// Statistics
+	uint32_t frames_ok;
+	uint32_t frames_crc_err;	// decoded fine but the CRC didn't match
+	uint32_t frames_bad;		// too long, too short or bad COBS
+} frame_decoder_t;
+
+uint16_t crc16(const uint8_t *data, int len);
+int frame_encode(const uint8_t *payload, int len, uint8_t *out);
+int frame_push(frame_decoder_t *d, uint8_t c);
+
+#endif /* FRAMING_H_ */
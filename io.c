@@ -1,260 +1,99 @@
 /*
  * io.c
  *
+ * Console printing. Each call formats into a small buffer and hands the
+ * whole thing to USART2_write in one go, which queues it for the DMA and
+ * returns - so printing costs the formatting and a copy, not the time
+ * the bytes take on the wire, and a number is never split by output
+ * from an interrupt. What happens when the ring's full is
+ * USART2_set_policy's to say (drop, by default).
+ *
  *  Created on: Feb 9, 2016
  *      Author: matthew
  */
 #include "USART2.h"
 #include "stdint.h"
 #include "network.h"
-#define LSNibble 0xF
+
+static const char digits[16] = "0123456789ABCDEF";
+
+/*
+ * val in base 10 or 16 into the end of buf (at least 11 bytes), at
+ * least min_digits long. Returns where it starts.
+ */
+static char *format(char *end, uint32_t val, uint32_t base, int min_digits)
+{
+	char *p = end;
+
+	do {
+		*--p = digits[val % base];
+		val /= base;
+		min_digits--;
+	} while (val || min_digits > 0);
+	return p;
+}
+
+static void write_from(const char *p, const char *end)
+{
+	USART2_write(p, end - p);
+}
 
 //hex print for 32 bit
 void print(uint32_t val) {
-	int started = 0;
-	int part;
-	USART2_send('0');
-	USART2_send('x');
-	for (int nibble = 7; nibble >= 0; nibble--) {
-		part = (val >> nibble*4) & LSNibble;
-		if (part && !started)
-			started = 1;
+	char buf[10];
+	char *p = format(buf + sizeof(buf), val, 16, 8);
 
-		switch (part) {
-		case 0x0:
-//			if (started)
-			USART2_send('0');
-			break;
-		case 0x1:
-			USART2_send('1');
-			break;
-		case 0x2:
-			USART2_send('2');
-			break;
-		case 0x3:
-			USART2_send('3');
-			break;
-		case 0x4:
-			USART2_send('4');
-			break;
-		case 0x5:
-			USART2_send('5');
-			break;
-		case 0x6:
-			USART2_send('6');
-			break;
-		case 0x7:
-			USART2_send('7');
-			break;
-		case 0x8:
-			USART2_send('8');
-			break;
-		case 0x9:
-			USART2_send('9');
-			break;
-		case 0xA:
-			USART2_send('A');
-			break;
-		case 0xB:
-			USART2_send('B');
-			break;
-		case 0xC:
-			USART2_send('C');
-			break;
-		case 0xD:
-			USART2_send('D');
-			break;
-		case 0xE:
-			USART2_send('E');
-			break;
-		case 0xF:
-			USART2_send('F');
-			break;
-		}
-	}
+	*--p = 'x';
+	*--p = '0';
+	write_from(p, buf + sizeof(buf));
 }
 
 //hex print for 16 bit
 void printHex(uint16_t val) {
-	int started = 0;
-	int part;
-	USART2_send('0');
-	USART2_send('x');
-	for (int nibble = 3; nibble >= 0; nibble--) {
-		part = (val >> nibble*4) & LSNibble;
-		if (part && !started)
-			started = 1;
+	char buf[6];
+	char *p = format(buf + sizeof(buf), val, 16, 4);
 
-		switch (part) {
-		case 0x0:
-//			if (started)
-			USART2_send('0');
-			break;
-		case 0x1:
-			USART2_send('1');
-			break;
-		case 0x2:
-			USART2_send('2');
-			break;
-		case 0x3:
-			USART2_send('3');
-			break;
-		case 0x4:
-			USART2_send('4');
-			break;
-		case 0x5:
-			USART2_send('5');
-			break;
-		case 0x6:
-			USART2_send('6');
-			break;
-		case 0x7:
-			USART2_send('7');
-			break;
-		case 0x8:
-			USART2_send('8');
-			break;
-		case 0x9:
-			USART2_send('9');
-			break;
-		case 0xA:
-			USART2_send('A');
-			break;
-		case 0xB:
-			USART2_send('B');
-			break;
-		case 0xC:
-			USART2_send('C');
-			break;
-		case 0xD:
-			USART2_send('D');
-			break;
-		case 0xE:
-			USART2_send('E');
-			break;
-		case 0xF:
-			USART2_send('F');
-			break;
-		}
-	}
+	*--p = 'x';
+	*--p = '0';
+	write_from(p, buf + sizeof(buf));
 }
 
-void printUnsignedDecimal(int16_t val) {
-	int digits[5];
-	for (int i=0; i<5; i++) {
-		digits[i] = val % 10;
-		val = val / 10;
-	}
-
-	int started = 0;
+//decimal print, no leading zeros
+void printUnsignedDecimal(uint32_t val) {
+	char buf[10];
 
-	for (int i=4; i>=0; i--) {
-		if (!started && digits[i]) started = 1;
-
-		switch (digits[i]) {
-		case 0:
-			if (started || i==0) {
-				USART2_send('0');
-			}
-			break;
-		case 1:
-			USART2_send('1');
-			break;
-		case 2:
-			USART2_send('2');
-			break;
-		case 3:
-			USART2_send('3');
-			break;
-		case 4:
-			USART2_send('4');
-			break;
-		case 5:
-			USART2_send('5');
-			break;
-		case 6:
-			USART2_send('6');
-			break;
-		case 7:
-			USART2_send('7');
-			break;
-		case 8:
-			USART2_send('8');
-			break;
-		case 9:
-			USART2_send('9');
-			break;
-		}
-	}
+	write_from(format(buf + sizeof(buf), val, 10, 1), buf + sizeof(buf));
 }
 
-void printSignedDecimal(int16_t val) {
-	uint16_t uval;
-
-	if (val & 0x8000) {// If the sign bit is set
-		USART2_send('-');
-		uval = ~val + 1;
-	} else {
-		USART2_send(' ');
-		uval = val;
-	}
-
-	int digits[5];
-	for (int i=0; i<5; i++) {
-		digits[i] = uval % 10;
-		uval = uval / 10;
-	}
+//signed decimal print, with a space in place of a '+'
+void printSignedDecimal(int32_t val) {
+	char buf[11];
+	uint32_t uval = val < 0 ? -(uint32_t)val : (uint32_t)val;
+	char *p = format(buf + sizeof(buf), uval, 10, 1);
 
-	for (int i=4; i>=0; i--) {
-
-		switch (digits[i]) {
-		case 0:
-			USART2_send('0');
-			break;
-		case 1:
-			USART2_send('1');
-			break;
-		case 2:
-			USART2_send('2');
-			break;
-		case 3:
-			USART2_send('3');
-			break;
-		case 4:
-			USART2_send('4');
-			break;
-		case 5:
-			USART2_send('5');
-			break;
-		case 6:
-			USART2_send('6');
-			break;
-		case 7:
-			USART2_send('7');
-			break;
-		case 8:
-			USART2_send('8');
-			break;
-		case 9:
-			USART2_send('9');
-			break;
-		}
-	}
+	*--p = val < 0 ? '-' : ' ';
+	write_from(p, buf + sizeof(buf));
 }
 
 void println(uint32_t val) {
-	print(val);
-	USART2_send('\n');
+	char buf[11];
+	char *p = format(buf + sizeof(buf) - 1, val, 16, 8);
+
+	*--p = 'x';
+	*--p = '0';
+	buf[sizeof(buf) - 1] = '\n';
+	write_from(p, buf + sizeof(buf));
 }
 
 void print_string(char *str) {
-	while (*str != '\0') {
-		USART2_send(*str);
-		str++;
-	}
+	int len = 0;
+
+	while (str[len] != '\0')
+		len++;
+	USART2_write(str, len);
 }
 
-void print_msg(volatile Msg_t *msg) {
+void print_msg(Msg_t *msg) {
 	switch (msg->pingmsg.type) {
 	case TYPE_PING:
 		print_string("[PING,id=");
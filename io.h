@@ -12,8 +12,8 @@
 #include "network.h"
 void println(uint32_t val);
 void printHex(uint16_t val);
-void printSignedDecimal(int16_t val);
-void printUnsignedDecimal(int16_t val);
+void printSignedDecimal(int32_t val);
+void printUnsignedDecimal(uint32_t val);
 void print_string(char *str);
 void print_msg(Msg_t *msg);
 #endif /* IO_H_ */
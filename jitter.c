@@ -0,0 +1,296 @@
+/*
+ * jitter.c
+ *
+ * Replies from the server arrive whenever the WiFi gets them here, so
+ * applying each one on arrival turns network jitter (and the gaps where
+ * a reply was dropped and timed out) straight into stutter in the arm.
+ *
+ * Instead each setpoint is stamped with when its request was sent (a
+ * steady clock, see net_reply_t) and queued. Once per PWM
+ * frame jitter_step plays the queue back a fixed delay behind real time,
+ * interpolating between the two setpoints either side of the play point,
+ * and hands the result to the motion engine.
+ *
+ * The delay tracks the measured transit time and its jitter (the RTP
+ * estimator, RFC 3550 A.8): mean transit + one interval + JITTER_MARGIN
+ * times the jitter, so the next setpoint has nearly always arrived by
+ * the time it's needed. It moves a little each frame so playback speeds
+ * up or slows down slightly instead of jumping.
+ *
+ * If the queue does run dry (a reply or three lost), the joints keep
+ * going at the velocity an alpha-beta tracker has been estimating from
+ * the setpoints, for a bounded horizon, then hold. When real setpoints
+ * come back, the difference between where the prediction had got to and
+ * where playback resumes is faded out over a few frames rather than
+ * jumped.
+ *
+ * jitter_push runs in the main loop and jitter_step in the TIM1 update
+ * interrupt, one each side of a message ring (ring.c), so it needs no
+ * lock; jitter_step reads the setpoints where they sit in it.
+ */
+
+#include "stdint.h"
+#include "timebase.h"
+#include "ring.h"
+#include "trace.h"
+#include "motion.h"
+#include "jitter.h"
+
+// How far (us) the delay moves toward its target each frame
+#define JITTER_SLEW 400
+
+// The tracker counts time in steps of 2^TRACK_SHIFT us, so its velocity
+// keeps some resolution and v * horizon still fits in 32 bits
+#define TRACK_SHIFT 8
+#define PREDICT_VMAX 500000
+
+typedef struct {
+	uint32_t t;					// when its request was sent
+	uint16_t seq;				// ... and its sequence number, for the trace
+	int values[NUM_JOINTS];		// t_high (us) for each joint
+} setpoint_t;
+
+static setpoint_t slots[JITTER_SLOTS];
+static msgq_t queue = { .buf = (uint8_t *)slots, .size = sizeof(setpoint_t), .slots = JITTER_SLOTS };
+
+// Arrival statistics (jitter_push only)
+static int have_prev = 0;
+static uint32_t prev_t;
+static int32_t prev_transit;
+static int32_t mean_transit;
+static int32_t mean_interval;
+static int32_t jit;
+
+// Playback delay: the target is set by jitter_push, delay follows it in jitter_step
+static volatile int32_t target_delay = JITTER_INIT_DELAY;
+static int32_t delay = JITTER_INIT_DELAY;
+
+// Alpha-beta tracker (jitter_push): position in us, velocity in us << 16
+// per tracker step (256 us)
+static int track_x[NUM_JOINTS];
+static volatile int32_t track_v[NUM_JOINTS];
+
+// Output side (jitter_step): what was last sent and how far it moved,
+// and the fade after a prediction
+static int last_out[NUM_JOINTS];
+static int last_step[NUM_JOINTS];
+static int fade[NUM_JOINTS];
+static int predicting = 0;
+// The last setpoint playback got to, so each is traced once, when the
+// first frame that carries it is committed (jitter_reached)
+static uint16_t reached_seq;
+static int reached = 0;
+static int reached_new = 0;	// reached_seq not yet taken by jitter_reached
+
+volatile jitter_stats_t jitter_stats;
+
+/**
+ * Empty the queue and start measuring again (on a mode change)
+ */
+void jitter_reset(void) {
+	uint32_t primask;
+
+	// Both ends at once, so keep jitter_step out
+	__asm volatile ("mrs %0, primask\n\tcpsid i" : "=r" (primask));
+	msgq_drop(&queue, msgq_count(&queue));
+	have_prev = 0;
+	predicting = 0;
+	reached = 0;
+	reached_new = 0;
+	for (int i=0; i<NUM_JOINTS; i++) {
+		track_v[i] = 0;
+		last_step[i] = 0;
+		fade[i] = 0;
+	}
+	target_delay = JITTER_INIT_DELAY;
+	delay = JITTER_INIT_DELAY;
+	__asm volatile ("msr primask, %0" : : "r" (primask));
+}
+
+/**
+ * Queue a setpoint whose request (number seq) was sent at t (time_now_us)
+ */
+void jitter_push(uint32_t t, uint16_t seq, const int *values) {
+	uint32_t now = time_now_us();
+	int32_t transit = (int32_t)(now - t);
+	int32_t d, target;
+	setpoint_t *sp;
+
+	if (have_prev) {
+		int32_t dt = (int32_t)(t - prev_t);
+
+		if (dt <= 0) { // not newer than what we have
+			jitter_stats.dropped++;
+			return;
+		}
+		mean_interval += (dt - mean_interval) / 8;
+		int32_t steps = dt >> TRACK_SHIFT;
+		if (steps == 0)
+			steps = 1;
+
+		// Track each joint: predict to t, then pull toward what arrived
+		for (int i=0; i<NUM_JOINTS; i++) {
+			if (dt > PREDICT_MAX_HORIZON) { // too long a gap to say anything
+				track_x[i] = values[i];
+				track_v[i] = 0;
+				continue;
+			}
+			int x = track_x[i] + ((track_v[i] * steps) >> 16);
+			int r = values[i] - x;
+			int32_t v = track_v[i] + ((PREDICT_BETA * r) << 8) / steps;
+			if (v > PREDICT_VMAX)
+				v = PREDICT_VMAX;
+			if (v < -PREDICT_VMAX)
+				v = -PREDICT_VMAX;
+			track_x[i] = x + ((PREDICT_ALPHA * r) >> 8);
+			track_v[i] = v;
+		}
+		d = transit - prev_transit;
+		if (d < 0)
+			d = -d;
+		jit += (d - jit) / 16;
+		mean_transit += (transit - mean_transit) / 8;
+	} else {
+		mean_interval = 0;
+		jit = 0;
+		mean_transit = transit;
+		have_prev = 1;
+		for (int i=0; i<NUM_JOINTS; i++) {
+			track_x[i] = values[i];
+			track_v[i] = 0;
+		}
+	}
+	prev_t = t;
+	prev_transit = transit;
+
+	target = mean_transit + mean_interval + JITTER_MARGIN * jit;
+	if (target < JITTER_MIN_DELAY)
+		target = JITTER_MIN_DELAY;
+	if (target > JITTER_MAX_DELAY)
+		target = JITTER_MAX_DELAY;
+	target_delay = target;
+	jitter_stats.jitter = jit;
+
+	// Its play time has already gone by - it's still the newest we have
+	if ((int32_t)(t + delay - now) < 0)
+		jitter_stats.late++;
+
+	sp = msgq_alloc(&queue);
+	if (!sp) {
+		jitter_stats.dropped++;
+		return;
+	}
+	sp->t = t;
+	sp->seq = seq;
+	for (int i=0; i<NUM_JOINTS; i++)
+		sp->values[i] = values[i];
+	msgq_commit(&queue);
+	jitter_stats.pushed++;
+}
+
+/*
+ * Hand a frame's setpoint to the motion engine. Coming out of a
+ * prediction, the gap between the setpoints and where the prediction
+ * would have got to this frame is faded out (by 1/4 each frame) instead
+ * of jumped.
+ */
+static void output(const int *out, int predicted) {
+	int o;
+
+	for (int i=0; i<NUM_JOINTS; i++) {
+		if (predicting && !predicted)
+			fade[i] = last_out[i] + last_step[i] - out[i];
+		else
+			fade[i] -= fade[i] / 4;
+		o = out[i] + fade[i];
+		last_step[i] = o - last_out[i];
+		last_out[i] = o;
+		motion_set_target(i+1, o);
+	}
+	predicting = predicted;
+}
+
+/**
+ * Returns 1, with its seq, if playback has reached a new setpoint since
+ * the last call. Called from the same frame interrupt as jitter_step.
+ */
+int jitter_reached(uint16_t *seq) {
+	if (!reached_new)
+		return 0;
+	reached_new = 0;
+	*seq = reached_seq;
+	return 1;
+}
+
+/**
+ * Once per PWM frame: set the motion targets from the setpoints either
+ * side of (now - delay), or dead reckon past the last one.
+ * Returns 1 if it set them, 0 if nothing's queued.
+ */
+int jitter_step(void) {
+	uint32_t n = msgq_count(&queue);
+	uint32_t play;
+	const setpoint_t *a, *b;
+	int32_t since;
+	int out[NUM_JOINTS];
+
+	if (n == 0)
+		return 0;
+
+	if (delay < target_delay)
+		delay += delay + JITTER_SLEW < target_delay ? JITTER_SLEW : target_delay - delay;
+	else if (delay > target_delay)
+		delay -= delay - JITTER_SLEW > target_delay ? JITTER_SLEW : delay - target_delay;
+	jitter_stats.delay = delay;
+
+	play = time_now_us() - delay;
+
+	// Drop setpoints once the play point is past the next one
+	while (n >= 2 && (int32_t)(((setpoint_t *)msgq_peek(&queue, 1))->t - play) <= 0) {
+		msgq_drop(&queue, 1);
+		n--;
+	}
+
+	a = msgq_peek(&queue, 0);
+	since = (int32_t)(play - a->t);
+
+	if (since > 0 && (!reached || a->seq != reached_seq)) {
+		reached_seq = a->seq;
+		reached = 1;
+		reached_new = 1;
+	}
+
+	if (since <= 0) {
+		// Not up to the first one yet: hold it
+		output(a->values, 0);
+	} else if (n >= 2) {
+		// Between a and b
+		b = msgq_peek(&queue, 1);
+		int32_t span = (int32_t)(b->t - a->t);
+		while (span > 0x7FFFFF) { // keep since << 8 in range over long gaps
+			span >>= 1;
+			since >>= 1;
+		}
+		int32_t frac = (since << 8) / span;
+		for (int i=0; i<NUM_JOINTS; i++)
+			out[i] = a->values[i] + (((b->values[i] - a->values[i]) * frac) >> 8);
+		output(out, 0);
+	} else {
+		// Ran out: keep going at the tracked velocity, for a while
+		int32_t horizon = PREDICT_INTERVALS * mean_interval;
+		if (horizon > PREDICT_MAX_HORIZON)
+			horizon = PREDICT_MAX_HORIZON;
+
+		if (!predicting)
+			TRACE(TRACE_PREDICT, 0, a->seq);
+		jitter_stats.underruns++;
+		if (since < horizon)
+			jitter_stats.predicted++;
+		else
+			since = horizon;
+		for (int i=0; i<NUM_JOINTS; i++)
+			out[i] = a->values[i] + ((track_v[i] * (since >> TRACK_SHIFT)) >> 16);
+		output(out, 1);
+	}
+	return 1;
+}
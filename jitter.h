@@ -0,0 +1,50 @@
+/*
+ * jitter.h
+ *
+ * Jitter buffer for the servo setpoints played back in CLIENT mode
+ */
+
+#ifndef JITTER_H_
+#define JITTER_H_
+
+#include "stdint.h"
+#include "network.h"
+
+#define JITTER_SLOTS 8				// setpoints held (power of 2)
+
+// Playback delay limits and starting point, in us
+#define JITTER_MIN_DELAY 50000
+#define JITTER_MAX_DELAY 600000
+#define JITTER_INIT_DELAY 200000
+
+// Delay = mean transit + interval + JITTER_MARGIN * measured jitter
+#define JITTER_MARGIN 4
+
+/* Dead reckoning when the queue runs dry: carry on at the estimated
+ * velocity for PREDICT_INTERVALS setpoint intervals (at most
+ * PREDICT_MAX_HORIZON), then hold. Velocity comes from an alpha-beta
+ * tracker on the setpoints (gains in Q8).
+ */
+#define PREDICT_INTERVALS 4
+#define PREDICT_MAX_HORIZON 300000		// us
+#define PREDICT_ALPHA 192
+#define PREDICT_BETA 96
+
+typedef struct {
+	uint32_t pushed;		// setpoints queued
+	uint32_t late;			// arrived after their play time had passed
+	uint32_t dropped;		// older than what's queued, or no room
+	uint32_t underruns;		// frames that ran out of setpoints
+	uint32_t predicted;		// ... and were covered by extrapolation
+	uint32_t delay;			// current playback delay (us)
+	uint32_t jitter;		// transit time jitter (us)
+} jitter_stats_t;
+
+extern volatile jitter_stats_t jitter_stats;
+
+void jitter_reset(void);
+void jitter_push(uint32_t t, uint16_t seq, const int *values);
+int jitter_step(void);
+int jitter_reached(uint16_t *seq);
+
+#endif /* JITTER_H_ */
@@ -0,0 +1,82 @@
+/*
+ * mailbox.c
+ *
+ * A triple buffer. The writer fills its own buffer and publishes it by
+ * swapping it for the middle one (atomic_swap in mutex.S), with a bit
+ * set to say it's fresh; the reader, if that bit is set, swaps its own
+ * buffer for the middle one. Each side only ever touches the buffer it
+ * holds, so the reader can't see a snapshot that's half one update and
+ * half the next, and neither side waits or retries - both calls take
+ * the same few instructions every time.
+ *
+ * If the writer publishes twice before the reader looks, the older
+ * snapshot is simply replaced: only the latest is worth having. The gen
+ * count in each snapshot says how many were published, so a reader can
+ * tell whether it's seen this one before (or how many it missed).
+ *
+ * One writer context and one reader context per mailbox.
+ */
+
+#include "stdint.h"
+#include "mutex.h"
+#include "mailbox.h"
+
+#define FRESH (1u << 31)
+#define INDEX 0x3
+
+void mailbox_init(joint_mailbox_t *mb)
+{
+	for (int b=0; b<3; b++) {
+		mb->buf[b].gen = 0;
+		mb->buf[b].t = 0;
+		for (int i=0; i<MAILBOX_JOINTS; i++)
+			mb->buf[b].values[i] = 0;
+	}
+	mb->front = 0;
+	mb->middle = 1;
+	mb->back = 2;
+	mb->gen = 0;
+}
+
+/**
+ * The writer's buffer to fill in. Its contents are whatever it last held.
+ */
+joint_state_t *mailbox_begin(joint_mailbox_t *mb)
+{
+	return &mb->buf[mb->back];
+}
+
+/**
+ * Hand the writer's buffer over as the newest snapshot
+ */
+void mailbox_publish(joint_mailbox_t *mb)
+{
+	mb->buf[mb->back].gen = ++mb->gen;
+	// atomic_swap's leading dmb puts the snapshot out before the index
+	mb->back = atomic_swap(&mb->middle, mb->back | FRESH) & INDEX;
+}
+
+/**
+ * Publish values for time t in one go
+ */
+void mailbox_write(joint_mailbox_t *mb, uint32_t t, const uint32_t *values)
+{
+	joint_state_t *s = mailbox_begin(mb);
+
+	s->t = t;
+	for (int i=0; i<MAILBOX_JOINTS; i++)
+		s->values[i] = values[i];
+	mailbox_publish(mb);
+}
+
+/**
+ * The newest snapshot published. It's the reader's until it calls
+ * this again.
+ */
+const joint_state_t *mailbox_read(joint_mailbox_t *mb)
+{
+	// and its trailing one keeps the snapshot's reads after the swap
+	if (mb->middle & FRESH)
+		mb->front = atomic_swap(&mb->middle, mb->front) & INDEX;
+	return &mb->buf[mb->front];
+}
@@ -0,0 +1,45 @@
+/*
+ * mailbox.h
+ *
+ * Latest-value mailbox for the joint state: one writer hands over whole
+ * snapshots, one reader always gets the newest complete one
+ */
+
+#ifndef MAILBOX_H_
+#define MAILBOX_H_
+
+#include "stdint.h"
+
+#define MAILBOX_JOINTS 5	// NUM_JOINTS, and the five pots
+
+typedef struct {
+	uint32_t gen;			// publish count, 1 for the first
+	uint32_t t;				// time_now_us it describes
+	uint32_t values[MAILBOX_JOINTS];
+} joint_state_t;
+
+/* Three buffers: the writer's, the reader's, and the one passed between
+ * them. Set up with mailbox_init, or MAILBOX_INIT for a static one.
+ */
+typedef struct {
+	joint_state_t buf[3];
+	volatile uint32_t middle;	// index of the buffer passed between, | fresh bit
+	uint32_t back;				// writer's
+	uint32_t front;				// reader's
+	uint32_t gen;				// writer's count
+} joint_mailbox_t;
+
+#define MAILBOX_INIT { .middle = 1, .back = 2 }
+
+void mailbox_init(joint_mailbox_t *mb);
+
+// Writer: fill in the buffer mailbox_begin gives, then mailbox_publish it
+joint_state_t *mailbox_begin(joint_mailbox_t *mb);
+void mailbox_publish(joint_mailbox_t *mb);
+void mailbox_write(joint_mailbox_t *mb, uint32_t t, const uint32_t *values);
+
+// Reader: the newest snapshot, left alone until the reader's next call
+// (gen 0 if nothing's been published)
+const joint_state_t *mailbox_read(joint_mailbox_t *mb);
+
+#endif /* MAILBOX_H_ */
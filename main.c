@@ -4,6 +4,7 @@
 
 #include "stdint.h"     /* uint32_t, etc... */
 #include "stm32f4xx.h"  /* Useful definitions for the MCU */
+#include "clock.h"      /* 168 MHz clock tree */
 #include "LED.h"        /* C routines in LED.c */
 #include "systick.h"	/* Systick initializer */
 #include "USART2.h"		/* USART2 */
@@ -12,31 +13,22 @@
 #include "io.h"			/* print, printHex, printUnsignedDecimal, etc */
 #include "ADC.h"		/* Initialize and read ADCs */
 #include "servo.h"		/* Servo initialization and setting */
+#include "motion.h"		/* Servo motion profiles */
+#include "jitter.h"		/* Setpoint playback in CLIENT mode */
 #include "network.h"	/* Network routines and prototypes */
 #include "update.h"		/* Functions to update servos from server or server from ADCs */
 #include "DMA.h"        /* Direct Memory Access */
+#include "filter.h"     /* Potentiometer filtering */
+#include "calib.h"      /* Pot to servo calibration */
+#include "sched.h"      /* Task scheduler */
+#include "timebase.h"   /* Microsecond clock and software timers */
+#include "profile.h"    /* Cycle-count probes */
+#include "trace.h"      /* Event trace */
 
 #define DEBUG 0
 
 volatile int systemTicks = 0;
 
-// Flags set from systick
-volatile int update_f = 0;
-volatile int update_leds_f = 1;
-volatile int update_servos_from_server_f = 0;
-volatile int send_update_f = 0;
-
-// Flags about wifi sending
-volatile int waiting_to_recv_packet = 0;
-volatile int received_new_packet = 0;
-
-// Globals to hold received data
-volatile int recv_offset = 0;
-volatile Msg_t recv_msg;
-
-// Test flag
-int test_flag = 0;
-
 typedef enum {
 	CONFIGURE_S = 0,
 	CLIENT_S,
@@ -45,219 +37,369 @@ typedef enum {
 
 state_t mode_state = CONFIGURE_S;
 
+// TASK_DEBUG events: print the profile / send the trace instead of the
+// usual dump
+#define DEBUG_EV_PROFILE (1u << 1)
+#define DEBUG_EV_TRACE (1u << 2)
+
+#if TRACE_ENABLE
+// A trace dump goes out a ring's worth at a time: how often to top it up
+// (about 230 bytes at 115200 baud)
+#define TRACE_DUMP_POLL_US 20000
+
+static sw_timer_t trace_dump_timer;
+
+static void trace_dump_more(void *arg)
+{
+	sched_post(TASK_DEBUG, DEBUG_EV_TRACE);
+}
+#endif
+
+// How long a batch of filtered readings is current for (us)
+#define FILTER_PERIOD_US ((1000000 << FILTER_OVERSAMPLE_SHIFT) / ADC_SAMPLE_HZ)
+
 void buttonResponse(void);
 void __attribute__ ((interrupt)) systick_handler(void);
 void __attribute__ ((interrupt)) USART2_handler(void);
 void __attribute__ ((interrupt)) USART3_handler(void);
 void __attribute__ ((interrupt)) EXTI0_handler(void);
 
+static void net_rx_task(uint32_t events);
+static void mode_task(uint32_t events);
+static void calib_key_task(uint32_t events);
+static void client_poll_task(uint32_t events);
+static void command_task(uint32_t events);
+static void heartbeat_task(uint32_t events);
+static void debug_task(uint32_t events);
+
 int main()
 {
-	int which_to_update = 6; // start greater than 5 so we get data
-	uint32_t data[5]; // Array to hold ADC data
-
 	// Initialize all the things
+	clock_init(); // first: everything below works its dividers out from it
+	timebase_init();
+	sched_init();
+	profile_init();
 	LED_init();
-	systick_init(400000); // Timer goes off 10 times per second
+	systick_init(clock_hclk_hz / SYSTICK_CLK_DIV / SYSTICK_HZ);
 	USART2_init();
 	USART3_init();
 	button_init();
+	DMA_init(); // before ADC_init, which starts the ADC's DMA stream
+	filter_init();
 	ADC_init();
 	servo_init();
-	DMA_init();
+	motion_init(); // after servo_init, starts moving the servos every frame
+	calib_init();
+
+	/* The work, highest priority first (see sched.h). Each is posted by
+	 * the interrupt that has something for it, or comes round on a
+	 * period in systicks. Deadlines are in us, 0 for none.
+	 */
+	sched_task(TASK_NET_RX, net_rx_task, 0, 1000000 / MOTION_HZ);
+	sched_task(TASK_MODE, mode_task, 0, 0);
+	sched_task(TASK_CALIB_KEY, calib_key_task, 0, 0);
+	sched_task(TASK_CLIENT_POLL, client_poll_task, 1, 1000000 / SYSTICK_HZ);
+	sched_task(TASK_COMMAND, command_task, 0, FILTER_PERIOD_US);
+	sched_task(TASK_HEARTBEAT, heartbeat_task, SYSTICK_HZ / 2, 0);
+	sched_task(TASK_DEBUG, debug_task, DEBUG ? SYSTICK_HZ / 2 : 0, 0);
+
+	// Set up the LEDs etc. for the mode we start in
+	sched_post(TASK_MODE, SCHED_EV_POST);
 
 	/* Enable interrupts */
 	__asm ("  cpsie i \n" );
 
-
 	/* Main program loop */
-	while(1)
-	{
-		// State specific behavior (every time)
-		switch (mode_state) {
-		case CONFIGURE_S:
-			// Don't do anything
-			break;
-		case COMMAND_S:
-		{
-			/* Send in two cases:
-			 * a) we're not waiting for a packet
-			 * b) the update flag is set (every second, because sometimes packets get dropped
-			 * 	and we don't want to wait forever)
-			 *
-			 * When we send a byte, we'll send whichever is next in the sequence (the current one
-			 * is stored in the local variable (in main) which_to_update). When it goes over 5,
-			 * we read in all the data for the next round of packets.
-			 */
-			if (!waiting_to_recv_packet || send_update_f) {
-//			if (send_update_f) {
-				if (which_to_update > 5) { // finished updating
-					ADC_read(data);
-					which_to_update = 1;
-				}
-
-				// We will be waiting for a packet back, so set this ahead of time
-				waiting_to_recv_packet=1;
-				// A new packet will be inbound, so reset the offset to 0 (in case it got messed up before)
-				recv_offset = 0;
-				update_server(which_to_update, data);
-				which_to_update++;
-
-				send_update_f = 0;
-			}
+	sched_run();
 
-			break;
-		}
-		case CLIENT_S:
-		{
-			/*
-			 * Update the servos on the high tick of this flag. That is set in systick, and happens 10 times
-			 * per second
-			 */
-			if (update_servos_from_server_f) {
-				// We're about to receive a response packet, so we reset the recv_offset to 0
-				recv_offset = 0;
-				waiting_to_recv_packet = 1;
-				update_servos();
-				update_servos_from_server_f = 0;
-			}
+	/* We'll never reach this line */
+	return 0;
+}
 
-			break;
-		}
-		default:
-			break;
-		}
+/*
+ * Replies have been queued (posted by USART3_handler)
+ */
+static void net_rx_task(uint32_t events)
+{
+	net_reply_t reply;
 
-		// Every time, regardless of state:
-		// If we received a packet, print it
-		if (received_new_packet) {
-//			switch (recv_msg.pingmsg.type) {
-//			case TYPE_PING:
-//				print_string("[PING,id=");
-//				printUnsignedDecimal(recv_msg.pingmsg.id);
-//				print_string("]\n");
-//				break;
-//			case TYPE_UPDATE:
-//				print_string("[UPDATE,id=");
-//				printUnsignedDecimal(recv_msg.respmsg.id);
-//				print_string(",average=");
-//				printUnsignedDecimal(recv_msg.respmsg.average);
-//				print_string(",{");
-//				for (int i=0; i<CLASS_SIZE_MAX; i++) {
-//					print_string(" ");
-//					printUnsignedDecimal(recv_msg.respmsg.values[i]);
-//				}
-//				print_string("}]\n\r");
-//				break;
-//			default:
-//				break;
-//			}
-			// Reset the flag
-			received_new_packet = 0;
-
-			// If we're in client mode, set the servo values to those from the server
-			if (mode_state == CLIENT_S) {
-				if (recv_msg.respmsg.type == TYPE_UPDATE) {
-					for (int i=1; i<=5; i++)
-						servo_update(i, recv_msg.respmsg.values[i]);
-				}
-			}
-		}
+	// Everything that's come in, oldest first - more may land meanwhile
+	while (net_receive(&reply)) {
+		// If we're in client mode, set the servo values to those from the server
+		if (mode_state == CLIENT_S)
+			set_servos_from_network(&reply);
+	}
 
-		// After switching states, update leds
-		if (update_leds_f) {
-			switch (mode_state) {
-			case CONFIGURE_S:
-				LED_update(LED_BLUE_ON|LED_ORANGE_OFF);
-				// Configuration:
-				// $$$ (escape sequence)
-				// set ip dhcp 1 (get IP address with dhcp)
-				// set ip host 172.16.1.10 (set remote IP)
-				// set ip remote 8004
-				// set wlan join 1 (try to connect to stored access point)
-				// set wlan auth 4 (set to WPA2-PSK)
-				// set wlan phrase ENGS62wifi
-				// set wlan ssid ENGS62
-				// save
-				// reboot
-				break;
-			case CLIENT_S:
-				LED_update(LED_BLUE_OFF|LED_ORANGE_ON);
-				break;
-			case COMMAND_S:
-				LED_update(LED_BLUE_ON|LED_ORANGE_ON);
-				waiting_to_recv_packet = 0;
-				break;
-			}
-			update_leds_f = 0;
-		}
+//	switch (reply.msg.pingmsg.type) {
+//	case TYPE_PING:
+//		print_string("[PING,id=");
+//		printUnsignedDecimal(reply.msg.pingmsg.id);
+//		print_string("]\n");
+//		break;
+//	case TYPE_UPDATE:
+//		print_string("[UPDATE,id=");
+//		printUnsignedDecimal(reply.msg.respmsg.id);
+//		print_string(",average=");
+//		printUnsignedDecimal(reply.msg.respmsg.average);
+//		print_string(",{");
+//		for (int i=0; i<CLASS_SIZE_MAX; i++) {
+//			print_string(" ");
+//			printUnsignedDecimal(reply.msg.respmsg.values[i]);
+//		}
+//		print_string("}]\n\r");
+//		break;
+//	default:
+//		break;
+//	}
+}
 
-		// If in debug mode, print ADC data to the console
-		if (DEBUG && test_flag)
-		{
-			test_flag = 0;
-			uint32_t data[5];
-			// Initialize the data array to 0 for clarity
-			for (int i=0; i<5; i++) {
-				data[i] = 0;
-			}
+/*
+ * After switching states (posted by the button), update leds
+ */
+static void mode_task(uint32_t events)
+{
+	// Replies to the old mode's requests are no use to the new one,
+	// and a new COMMAND session should start with a full update
+	net_reset();
+	update_server_reset();
+	jitter_reset();
+	// A capture left running would keep COMMAND mode from sending
+	// when it comes back round
+	calib_capture_cancel();
+	TRACE(TRACE_MODE, mode_state, 0);
+
+	/* Only the tasks this mode uses, so the rest don't wake the loop.
+	 * CONFIGURE is all USART handlers passing bytes along, so the loop
+	 * can stay parked between them.
+	 */
+	sched_enable(TASK_CLIENT_POLL, mode_state == CLIENT_S);
+	sched_enable(TASK_COMMAND, mode_state == COMMAND_S);
+	// The joints are only read in COMMAND, and the 1 kHz scans would
+	// wake the loop for nothing anywhere else
+	ADC_run(mode_state == COMMAND_S);
+	sched_sleep_on_exit(mode_state == CONFIGURE_S);
+
+	switch (mode_state) {
+	case CONFIGURE_S:
+		LED_update(LED_BLUE_ON|LED_ORANGE_OFF);
+		// Configuration:
+		// $$$ (escape sequence)
+		// set ip dhcp 1 (get IP address with dhcp)
+		// set ip host 172.16.1.10 (set remote IP)
+		// set ip remote 8004
+		// set wlan join 1 (try to connect to stored access point)
+		// set wlan auth 4 (set to WPA2-PSK)
+		// set wlan phrase ENGS62wifi
+		// set wlan ssid ENGS62
+		// save
+		// reboot
+		break;
+	case CLIENT_S:
+		LED_update(LED_BLUE_OFF|LED_ORANGE_ON);
+		break;
+	case COMMAND_S:
+		LED_update(LED_BLUE_ON|LED_ORANGE_ON);
+		break;
+	}
+}
 
-			ADC_read(data);
-			for (int i=0; i<5; i++) {
-				printUnsignedDecimal((uint16_t)data[i]);
-				print_string("\n");
-				print_string("\r");
+/* 'c' on the console in COMMAND mode starts a calibration capture,
+ * and the next 'c' ends it and takes the extremes seen as the
+ * new pot endpoints
+ */
+static void calib_key_task(uint32_t events)
+{
+	if (!calib_capturing()) {
+		calib_capture_start();
+		print_string("\n\rCalibrating: move every joint end to end, then press c\n\r");
+	} else {
+		int updated = calib_capture_finish();
+		for (int i=PIVOT_ID; i<=GRIP_ID; i++) {
+			print_string("joint ");
+			printUnsignedDecimal(i);
+			if (updated & (1 << i)) {
+				print_string(": ");
+				printUnsignedDecimal(calib[i].adc_min);
+				print_string(" - ");
+				printUnsignedDecimal(calib[i].adc_max);
+			} else {
+				print_string(": not enough travel, unchanged");
 			}
-			print_string("-----------\n");
+			print_string("\n\r");
 		}
+		// Send the arm with the new mapping straight away
+		update_server_reset();
 	}
-	/* We'll never reach this line */
-	return 0;
 }
 
-
 /*
- * The systick Interrupt Service Routine
+ * In CLIENT mode, poll the server for new servo values every systick
  */
-void __attribute__ ((interrupt)) systick_handler(void)
+static void client_poll_task(uint32_t events)
 {
-	static int waiting_prev = 0;
+	if (net_can_send())
+		update_servos();
+}
 
-	/*
-	 * Every .5 seconds, toggle the green LED
-	 */
-	if (systemTicks % 20 == 0)
-	{
-		LED_toggle(LED_GREEN);
+/*
+ * Every .5 seconds, toggle the green LED
+ */
+static void heartbeat_task(uint32_t events)
+{
+	LED_toggle(LED_GREEN);
+}
 
-		// Test ADC
-		test_flag = 1;
+/* In COMMAND mode, check the arm each time the filter has new readings
+ * (posted from the ADC's DMA interrupt), if the window has room for
+ * another request (up to NET_WINDOW can be waiting on the server at
+ * once, and ones that get dropped time out - see NET_TIMEOUT_US).
+ *
+ * Each check reads all the joints at once and sends the ones that moved
+ * past their deadband (or all of them, when the keep-alive is due) to
+ * the server - see update_server_changed.
+ */
+static void command_task(uint32_t events)
+{
+	uint32_t data[NUM_JOINTS]; // Array to hold ADC data
+
+	if (calib_capturing()) {
+		// Calibrating: just watch the pots, don't drive the server's arm
+		filter_read(data);
+		calib_capture_sample(data);
+	} else if (net_can_send()) {
+		filter_read(data);
+		update_server_changed(data);
 	}
+}
 
-	/*
-	 * If we're in client mode, we want to account for dropped packets
-	 * so we won't wait forever. If we're waiting for two consecutive systicks,
-	 * (.2 seconds), reset the waiting_to_recv_packet flag to low
-	 */
-	if (mode_state == CLIENT_S) {
-		update_servos_from_server_f = 1;
-		if (waiting_to_recv_packet == waiting_prev) {
-			waiting_to_recv_packet = 0;
-		}
-		waiting_prev = waiting_to_recv_packet;
+/*
+ * If in debug mode, or on 's' from the console, print ADC data, the
+ * update and request counters, task timings and how much of the time the
+ * CPU has been asleep. On 'p'
+ * (with PROFILE_ENABLE), print the probe report instead, and on 't'
+ * (with TRACE_ENABLE) send the event trace (trace.h) for
+ * tools/trace_decode - a part at a time, with a timer posting this
+ * again for the next part, so the loop isn't held up for the whole
+ * dump. Other output is dropped until it's done.
+ */
+static void debug_task(uint32_t events)
+{
+	uint32_t data[5];
+
+#if PROFILE_ENABLE
+	if (events & DEBUG_EV_PROFILE)
+		profile_report();
+#endif
+#if TRACE_ENABLE
+	if ((events & DEBUG_EV_TRACE) && trace_dump())
+		timer_start(&trace_dump_timer, TRACE_DUMP_POLL_US, 0, trace_dump_more, 0);
+#endif
+	// Only 'p' or 't' asked for anything
+	if (!(events & ~(DEBUG_EV_PROFILE | DEBUG_EV_TRACE)))
+		return;
+
+	// Initialize the data array to 0 for clarity
+	for (int i=0; i<5; i++) {
+		data[i] = 0;
 	}
 
-	/*
-	 * If we're in command mode, send an update flag
-	 * (to "reset" the sending if we happened to drop a packet)
-	 * every second
-	 */
-	if (mode_state == COMMAND_S) {
-		send_update_f = 1;
+	ADC_read(data);
+	for (int i=0; i<5; i++) {
+		printUnsignedDecimal((uint16_t)data[i]);
+		print_string("\n");
+		print_string("\r");
+	}
+	// Where the server last said the joints should be (t_high, us)
+	const joint_state_t *joints = net_latest_joints();
+	print_string("server joints (#");
+	printUnsignedDecimal(joints->gen);
+	print_string("):");
+	for (int i=0; i<NUM_JOINTS; i++) {
+		print_string(" ");
+		printUnsignedDecimal(joints->values[i]);
+	}
+	print_string("\n\r");
+	// Change-driven updates (update.c) and how the requests fared
+	print_string("updates ");
+	printUnsignedDecimal(updates_sent);
+	print_string(" sent, ");
+	printUnsignedDecimal(updates_suppressed);
+	print_string(" suppressed\n\r");
+	print_string("requests ");
+	printUnsignedDecimal(net_stats.sent);
+	print_string(" sent, ");
+	printUnsignedDecimal(net_stats.acked);
+	print_string(" acked, ");
+	printUnsignedDecimal(net_stats.late);
+	print_string(" late, ");
+	printUnsignedDecimal(net_stats.superseded);
+	print_string(" superseded, ");
+	printUnsignedDecimal(net_stats.timeouts);
+	print_string(" timed out, rtt ");
+	printUnsignedDecimal(net_stats.rtt_us);
+	print_string(" us, replies dropped ");
+	printUnsignedDecimal(net_rx_dropped());
+	print_string("\n\r");
+#if FILTER_BENCHMARK
+	print_string("filter cycles: ");
+	printUnsignedDecimal(filter_cycles_last);
+	print_string(" max ");
+	printUnsignedDecimal(filter_cycles_max);
+	print_string("\n\r");
+#endif
+	// Per task: runs, longest run and worst post-to-done (us), deadline misses
+	for (int i=0; i<SCHED_NUM_TASKS; i++) {
+		print_string("task ");
+		printUnsignedDecimal(i);
+		print_string(": ");
+		printUnsignedDecimal(sched_stats[i].runs);
+		print_string(" runs, max ");
+		printUnsignedDecimal(sched_stats[i].cycles_max / (clock_hclk_hz / 1000000));
+		print_string(" us, latency ");
+		printUnsignedDecimal(sched_stats[i].latency_max / (clock_hclk_hz / 1000000));
+		print_string(" us, ");
+		printUnsignedDecimal(sched_stats[i].misses);
+		print_string(" missed\n\r");
 	}
+	// Sleep since the last report, and how long (CPU cycles) the CPU
+	// took to get going again after a tick woke it
+	print_string("idle ");
+	printUnsignedDecimal(sched_idle_percent());
+	print_string("%, ");
+	printUnsignedDecimal(sched_idle_stats.ticks_skipped);
+	print_string(" ticks skipped, wake latency ");
+	printUnsignedDecimal(sched_idle_stats.wake_latency_last);
+	print_string(" cycles, max ");
+	printUnsignedDecimal(sched_idle_stats.wake_latency_max);
+	print_string("\n\r");
+	print_string("-----------\n");
+}
+
+
+/*
+ * How many systicks the idle loop can sleep through: the tick handler
+ * has nothing to do besides the periodic tasks (request timeouts run off
+ * TIM5, whose interrupt wakes the idle loop itself)
+ */
+uint32_t idle_tick_budget(void)
+{
+	return 0xFFFFFFFF;
+}
+
+/*
+ * The systick Interrupt Service Routine
+ */
+void __attribute__ ((interrupt)) systick_handler(void)
+{
+	PROFILE_ENTER(PROF_SYSTICK_ISR);
+
+	// Post the periodic tasks whose time has come
+	sched_tick();
 
 	// global counter of how many systicks we've had
 	systemTicks++;
+
+	PROFILE_EXIT(PROF_SYSTICK_ISR);
 }
 
 
@@ -269,46 +411,72 @@ void __attribute__ ((interrupt)) USART2_handler(void) {
 	case CONFIGURE_S: // In configure mode, pass it along to the WiFly
 		USART3_send(c);
 		break;
-	default: // Other modes just echo back input
+	case COMMAND_S: // 'c' starts/stops calibration, and gets echoed too
+		if (c == 'c')
+			sched_post(TASK_CALIB_KEY, SCHED_EV_POST);
+		// fall through
+	default: // Other modes just echo back input, 's' prints the stats, 'p' the profile
+		if (c == 's')
+			sched_post(TASK_DEBUG, SCHED_EV_POST);
+#if PROFILE_ENABLE
+		if (c == 'p')
+			sched_post(TASK_DEBUG, DEBUG_EV_PROFILE);
+#endif
+#if TRACE_ENABLE
+		if (c == 't')
+			sched_post(TASK_DEBUG, DEBUG_EV_TRACE);
+#endif
 		USART2_send(c);
 		break;
 	}
 }
 
 void __attribute__ ((interrupt)) USART3_handler(void) {
-	char c = USART3_recv(); // Always immediately read the input
+	/* The DMA has already put the bytes in the receive ring. We get here
+	 * when the line goes idle (end of a frame) or when the DMA handler
+	 * pends us at half/full ring, and pull over everything new at once.
+	 */
+	PROFILE_ENTER(PROF_USART3_ISR);
+	int idle = USART3_rx_idle();
+	char buf[32];
+	int n;
 
 	switch (mode_state) {
 	case CONFIGURE_S: // In configure, pass to console
 	{
-		USART2_send(c);
+		while ((n = USART3_read(buf, sizeof(buf))) > 0)
+			USART2_write(buf, n);
 		break;
 	}
 
 	case CLIENT_S:
 	case COMMAND_S: // Intentional fall-through - these do the same thing
 	{
-		/* Read in consecutive bytes of the message */
-		*(((char*)&recv_msg)+recv_offset) = c;
-		recv_offset++;
-
-		/* When we get the full message, set a flag for it
-		 * to print in the main loop, and clear the recv_offset
-		 * and waiting_to_recv_packet flag
+		/* Hand everything to the network layer, which finds the packet
+		 * boundaries, matches replies to requests and queues them for net_rx_task.
+		 * When a new message arrives, post it to be handled in the main loop.
 		 */
-		if (recv_offset == sizeof(Update_resp_t)) {
-			received_new_packet = 1;
-			recv_offset = 0;
-			waiting_to_recv_packet = 0;
-		}
+		int got = 0;
+		while ((n = USART3_read(buf, sizeof(buf))) > 0)
+			got |= receive_bytes_USART3(buf, n);
+		if (idle)
+			got |= receive_idle_USART3();
+
+		if (got)
+			sched_post(TASK_NET_RX, SCHED_EV_POST);
 		break;
 	}
 	default:
+		// Nothing wants the bytes, just empty the ring
+		while (USART3_read(buf, sizeof(buf)) > 0);
 		break;
 	}
+
+	PROFILE_EXIT(PROF_USART3_ISR);
 }
 
 void __attribute__ ((interrupt)) EXTI0_handler(void) {
+	PROFILE_ENTER(PROF_EXTI0_ISR);
 	int n = 0;
 	/* Button debounce */
 	for (int i=0; i<1000; i++) {
@@ -318,6 +486,9 @@ void __attribute__ ((interrupt)) EXTI0_handler(void) {
 	if (n > 990)
 		buttonResponse();
 
+	// Before the asm below, which doesn't say what it clobbers
+	PROFILE_EXIT(PROF_EXTI0_ISR);
+
 	/* Reset the pending bit */
 	__asm(	".equ 	EXTI_PR, 0x40013C14\n"
 			"ldr		r1, =EXTI_PR\n"
@@ -341,6 +512,6 @@ void buttonResponse(void) {
 		mode_state = CONFIGURE_S;
 		break;
 	}
-	update_leds_f = 1;
+	sched_post(TASK_MODE, SCHED_EV_POST);
 }
 
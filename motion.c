@@ -0,0 +1,183 @@
+/*
+ * motion.c
+ *
+ * Trapezoidal motion profiles for the servos. The network (or anything
+ * else) only sets targets; the TIM1 update interrupt, once per PWM
+ * frame, moves each servo one step along a velocity- and
+ * acceleration-limited path toward its target and writes the new t_high.
+ * So the arm moves smoothly however often targets arrive.
+ *
+ * Positions are t_high in us, Q8. Velocities are Q8 us per frame and
+ * accelerations Q8 us per frame per frame.
+ *
+ * Documentation references:
+ * [1]: STM32F40x Reference Manual
+ * [4]: PM0214 STM32F3/F4 Cortex-M4 Programming Manual
+ */
+
+#include "stm32f4xx.h"
+#include "stdint.h"
+#include "servo.h"
+#include "motion.h"
+#include "jitter.h"
+#include "trace.h"
+
+typedef struct {
+	int32_t pos;		// where the servo is now
+	int32_t target;		// where it's going
+	int32_t vel;		// signed, toward +/- t_high
+	int32_t vmax;
+	int32_t accel;
+} motion_t;
+
+// Index 0 is servo 1
+static motion_t motion[MOTION_SERVOS];
+
+/**
+ * Start every servo at rest in the middle (where servo_init puts them)
+ * and turn on the TIM1 update interrupt. Call after servo_init.
+ */
+void motion_init(void) {
+	for (int i=1; i<=MOTION_SERVOS; i++) {
+		motion_jump(i, 1500);
+		motion_set_limits(i, MOTION_VMAX_US_S, MOTION_ACCEL_US_S2);
+	}
+
+	// Interrupt on every update (end of each PWM frame)
+	// Set bit 0 (UIE) of TIM1_DIER
+	// Ref: [1] 14.4.4 p.393
+	TIM1->TIMx_DIER |= 1;
+
+	/* Enable TIM1 update in the NVIC
+	 * Position 25 in the vector table [1]-10.2 p.248
+	 * Set bit 25 in NVIC_ISER0 [4]-4.3.11 p.205
+	 */
+	uint32_t *NVIC_ISER0 = (uint32_t*)0xE000E100;
+	*NVIC_ISER0 |= 1 << 25;
+}
+
+/**
+ * Set where servo id (1-5) should head to, in us of t_high
+ */
+void motion_set_target(int id, uint32_t t_high) {
+	if (id < 1 || id > MOTION_SERVOS)
+		return;
+	motion[id-1].target = (int32_t)t_high << 8;
+}
+
+/**
+ * Set servo id's (1-5) top speed (us/s) and acceleration (us/s^2)
+ */
+void motion_set_limits(int id, uint32_t vmax_us_s, uint32_t accel_us_s2) {
+	motion_t *m;
+
+	if (id < 1 || id > MOTION_SERVOS)
+		return;
+	m = &motion[id-1];
+
+	// Per frame, Q8
+	m->vmax = (vmax_us_s << 8) / MOTION_HZ;
+	m->accel = (accel_us_s2 << 8) / (MOTION_HZ * MOTION_HZ);
+	if (m->vmax < 1)
+		m->vmax = 1;
+	if (m->vmax > 0xFFFF) // so vmax^2 fits in a uint32_t
+		m->vmax = 0xFFFF;
+	if (m->accel < 1)
+		m->accel = 1;
+}
+
+/**
+ * Put servo id (1-5) straight at t_high, at rest, with no profile
+ */
+void motion_jump(int id, uint32_t t_high) {
+	if (id < 1 || id > MOTION_SERVOS)
+		return;
+	motion[id-1].pos = (int32_t)t_high << 8;
+	motion[id-1].target = motion[id-1].pos;
+	motion[id-1].vel = 0;
+}
+
+/**
+ * Returns 1 if servo id (1-5) has arrived and stopped
+ */
+int motion_at_target(int id) {
+	if (id < 1 || id > MOTION_SERVOS)
+		return 1;
+	return motion[id-1].pos == motion[id-1].target && motion[id-1].vel == 0;
+}
+
+/*
+ * One frame of one servo's profile
+ */
+static void motion_step_one(motion_t *m) {
+	int32_t err = m->target - m->pos;
+	int32_t dist = err < 0 ? -err : err;
+	int32_t dir = err < 0 ? -1 : 1;
+	// Speed toward the target (negative if moving away from it)
+	int32_t v = m->vel * dir;
+
+	if (err == 0 && m->vel == 0)
+		return;
+
+	if (v < 0) {
+		// Going the wrong way (the target moved behind us): brake
+		v += m->accel;
+		if (v > 0)
+			v = 0;
+	} else if ((uint32_t)v * (uint32_t)v / (uint32_t)(2 * m->accel) >= (uint32_t)dist) {
+		// Can only just stop in time: brake
+		v -= m->accel;
+		if (v < m->accel)
+			v = m->accel; // creep the rest of the way
+	} else {
+		// Speed up, to the limit
+		v += m->accel;
+		if (v > m->vmax)
+			v = m->vmax;
+	}
+
+	if (v > 0 && v >= dist) {
+		// Arrived
+		m->pos = m->target;
+		m->vel = 0;
+		return;
+	}
+
+	m->vel = v * dir;
+	m->pos += m->vel;
+}
+
+/**
+ * Move every servo one frame along its profile and commit the new
+ * t_highs together
+ */
+void motion_step(void) {
+	uint32_t t_high[MOTION_SERVOS];
+	uint16_t seq;
+
+	for (int i=0; i<MOTION_SERVOS; i++) {
+		motion_step_one(&motion[i]);
+		// Round Q8 to whole us
+		t_high[i] = (uint32_t)(motion[i].pos + 128) >> 8;
+	}
+	servo_commit_frame(t_high);
+
+	// This is the first frame headed for a setpoint playback just got to
+	if (jitter_reached(&seq))
+		TRACE(TRACE_SERVO_COMMIT, 0, seq);
+}
+
+/*
+ * Start of a PWM frame. The DMA has just loaded the frame committed last
+ * time; the one committed here goes in at the next update.
+ */
+void __attribute__ ((interrupt)) TIM1_UP_TIM10_handler(void) {
+	// Clear the update flag
+	// Write 0 to bit 0 (UIF) of TIM1_SR
+	// Ref: [1] 14.4.5 p.395
+	TIM1->TIMx_SR = ~1;
+
+	// In CLIENT mode, move the targets along the buffered setpoints first
+	jitter_step();
+	motion_step();
+}
@@ -0,0 +1,29 @@
+/*
+ * motion.h
+ *
+ * Slews the servos toward their targets once per PWM frame
+ */
+
+#ifndef MOTION_H_
+#define MOTION_H_
+
+#include "stdint.h"
+#include "servo.h"
+
+#define MOTION_SERVOS SERVO_COUNT
+#define MOTION_HZ SERVO_TIM1_HZ		// TIM1 update rate (one step per PWM frame)
+
+// Defaults for every servo
+#define MOTION_VMAX_US_S 1000		// top speed, us of t_high per second
+#define MOTION_ACCEL_US_S2 4000		// acceleration, us per second per second
+
+void motion_init(void);
+void motion_set_target(int id, uint32_t t_high);
+void motion_set_limits(int id, uint32_t vmax_us_s, uint32_t accel_us_s2);
+void motion_jump(int id, uint32_t t_high);
+int motion_at_target(int id);
+void motion_step(void);
+
+void __attribute__ ((interrupt)) TIM1_UP_TIM10_handler(void);
+
+#endif /* MOTION_H_ */
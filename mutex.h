@@ -8,11 +8,25 @@
 #ifndef MUTEX_H_
 #define MUTEX_H_
 
+#include "stdint.h"
+
 void lock_mutex_blocking(int *mutex);
 // Return 0 on success, else nonzero
 int lock_mutex(int *mutex);
 
 void unlock_mutex(int *mutex);
 
+// Atomic *addr |= bits, *addr &= bits, *addr = val and *addr += n;
+// each returns the old value. atomic_swap has a dmb either side, the
+// others one after.
+uint32_t atomic_or(volatile uint32_t *addr, uint32_t bits);
+uint32_t atomic_and(volatile uint32_t *addr, uint32_t bits);
+uint32_t atomic_swap(volatile uint32_t *addr, uint32_t val);
+uint32_t atomic_add(volatile uint32_t *addr, uint32_t n);
+
+// Read a word with acquire / write it with release ordering (dmb)
+uint32_t load_acquire(volatile uint32_t *addr);
+void store_release(volatile uint32_t *addr, uint32_t val);
+
 
 #endif /* MUTEX_H_ */
@@ -8,20 +8,239 @@
  * putting the data into packets, will be taken care of by
  * the WiFi board.
  *
- * The send_packet_USART3 function will simply send the message
- * byte by byte over USART3. Not sure if that will work.
+ * The send_packet_USART3 function queues the message on the
+ * USART3 transmit ring, which DMA drains in the background, so
+ * sending never blocks the main loop.
  */
 
 #include "USART3.h"
 #include "USART2.h"
 #include "network.h"
 #include "io.h"
+#include "framing.h"
+#include "systick.h"
+#include "timebase.h"
+#include "ring.h"
+#include "profile.h"
+#include "trace.h"
 
-void send_packet_USART3(Msg_t *msg) {
+#if NET_FRAMING
+// Every message has to fit in a frame (the array size goes negative if not)
+typedef char frame_fits_msg_t[sizeof(Msg_t) <= FRAME_MAX_PAYLOAD ? 1 : -1];
+
+// Decoder state and corrupt-frame counters for the receive side
+frame_decoder_t rx_decoder;
+#else
+// Bare packets are gathered here until the line goes idle
+static char rx_frame[sizeof(Msg_t)];
+static int recv_offset = 0;
+#endif
+
+// Sequence number for the next request
+static uint16_t tx_seq = 0;
+
+/* Requests waiting for a reply. Slots are only claimed from the main loop
+ * (send_packet_USART3) and only released from interrupts (the USART3
+ * handler and the slot's own timeout, which runs from the TIM5 handler -
+ * neither preempts the other) or by net_reset on a mode change, so a slot
+ * is never fought over.
+ */
+typedef struct {
+	volatile int in_use;
+	uint16_t seq;
+	uint32_t sent_time;	// time_now_us when it went out
+	sw_timer_t timeout;	// gives up on it after NET_TIMEOUT_US
+} inflight_t;
+
+static inflight_t inflight[NET_WINDOW];
+static uint16_t last_applied;
+static int have_applied = 0;
+
+/* Replies to apply, from the USART3 handler (receive_packet_USART3) to
+ * the main loop (net_receive). A reply that comes in while the last is
+ * still being read just takes the next slot.
+ */
+static net_reply_t rx_slots[NET_RX_SLOTS];
+static msgq_t rx_queue = { .buf = (uint8_t *)rx_slots, .size = sizeof(net_reply_t), .slots = NET_RX_SLOTS };
+
+// The newest joint setpoints from the server, for anyone who only wants
+// where the arm is meant to be now (net_latest_joints)
+static joint_mailbox_t joints = MAILBOX_INIT;
+
+volatile net_stats_t net_stats;
+
+/*
+ * Queue a packet for the WiFly, framed if NET_FRAMING is set
+ */
+static int send_payload(const uint8_t *payload, int len) {
+#if NET_FRAMING
+	uint8_t frame[FRAME_MAX_SIZE];
+
+	len = frame_encode(payload, len, frame);
+	if (len < 0)
+		return -1;
+	payload = frame;
+#endif
+	// Returns right away - the whole packet is queued, or dropped if the ring is full
+	return USART3_write((const char *)payload, len);
+}
+
+/*
+ * Number of requests waiting for a reply
+ */
+static int inflight_count(void) {
+	int n = 0;
+	for (int i=0; i<NET_WINDOW; i++)
+		n += inflight[i].in_use;
+	return n;
+}
+
+/*
+ * Done with a slot: it's answered, out of date or given up on
+ */
+static void inflight_release(inflight_t *f) {
+	f->in_use = 0;
+	timer_stop(&f->timeout);
+}
+
+/*
+ * A request's timer ran out before its reply came (TIM5 handler): give
+ * up on it, which opens the window back up
+ */
+static void request_timeout(void *arg) {
+	inflight_t *f = arg;
+
+	if (f->in_use) {
+		f->in_use = 0;
+		net_stats.timeouts++;
+	}
+}
+
+/*
+ * Returns nonzero if there's room in the window for another request
+ */
+int net_can_send(void) {
+	return inflight_count() < NET_WINDOW;
+}
+
+/*
+ * Give up on every outstanding request (e.g. on a mode change)
+ */
+void net_reset(void) {
+	for (int i=0; i<NET_WINDOW; i++)
+		inflight_release(&inflight[i]);
+	have_applied = 0;
+	// From the main loop, which is the queue's consumer
+	msgq_drop(&rx_queue, msgq_count(&rx_queue));
+}
+
+/*
+ * Match a reply to its request and decide whether to apply it.
+ * has_seq is 0 for v1 replies, which carry no seq: v1 only ever has one
+ * request waiting (NET_WINDOW), and the reply goes with that.
+ * Returns 1 if the reply is the newest answer we have, and sets *seq
+ * to the request it answers and *sent_time to when that went out.
+ */
+static int match_reply(int has_seq, uint16_t *seq, uint32_t *sent_time) {
+	int slot = -1;
+
+	for (int i=0; i<NET_WINDOW; i++) {
+		if (!inflight[i].in_use)
+			continue;
+		if (has_seq) {
+			if (inflight[i].seq == *seq)
+				slot = i;
+		} else if (slot < 0 || (int16_t)(inflight[i].seq - inflight[slot].seq) < 0) {
+			slot = i;
+		}
+	}
+
+	if (slot < 0) { // timed out, superseded or never asked for
+		net_stats.late++;
+		return 0;
+	}
+
+	*seq = inflight[slot].seq;
+	inflight_release(&inflight[slot]);
+	net_stats.rtt_us = time_since_us(inflight[slot].sent_time);
+
+	if (have_applied && (int16_t)(*seq - last_applied) <= 0) {
+		net_stats.late++;
+		return 0;
+	}
+
+	// Anything sent before this request is out of date now
+	for (int i=0; i<NET_WINDOW; i++) {
+		if (inflight[i].in_use && (int16_t)(inflight[i].seq - *seq) < 0) {
+			inflight_release(&inflight[i]);
+			net_stats.superseded++;
+		}
+	}
+
+	last_applied = *seq;
+	*sent_time = inflight[slot].sent_time;
+	have_applied = 1;
+	net_stats.acked++;
+	return 1;
+}
+
+/*
+ * Take the oldest reply waiting to be applied (main loop only).
+ * Returns 1 if one was copied into reply, 0 if there aren't any.
+ */
+int net_receive(net_reply_t *reply) {
+	return msgq_get(&rx_queue, reply);
+}
+
+/*
+ * The joints in the newest reply, whole, and when their request went
+ * out (gen 0 before the first). Main loop only: the snapshot stays put
+ * until its next call.
+ */
+const joint_state_t *net_latest_joints(void) {
+	return mailbox_read(&joints);
+}
+
+/*
+ * Pull the joint setpoints out of a reply: the full class response
+ * (joints in slots 1-5 of values[]) or the batched TYPE_UPDATE_ALL
+ * layout. Returns 0, or -1 if it isn't a reply with joints in.
+ */
+int net_joint_values(const Msg_t *msg, int *values) {
+	switch (msg->pingmsg.type) {
+	case TYPE_UPDATE:
+		for (int i=PIVOT_ID; i<=GRIP_ID; i++)
+			values[i] = msg->respmsg.values[JOINT_SLOT_BASE + i];
+		return 0;
+	case TYPE_UPDATE_ALL:
+		for (int i=PIVOT_ID; i<=GRIP_ID; i++)
+			values[i] = msg->allmsg.values[i];
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Replies thrown away because the main loop hadn't kept up
+ */
+uint32_t net_rx_dropped(void) {
+	return rx_queue.dropped;
+}
+
+/*
+ * Stamp msg with the next sequence number and queue it.
+ * Update requests take a slot in the window until their reply arrives;
+ * returns -1 without sending if the window is full or the ring is.
+ */
+static int send_packet(Msg_t *msg) {
 	int type = msg->pingmsg.type;
-	static int size = 0;
-	static int i;
-	static char *data;
+	uint16_t seq = tx_seq;
+	int slot = -1;
+	int size;
+#if PROTOCOL_VERSION == 2
+	uint8_t buf[V2_MAX_SIZE];
+#endif
 
 	switch (type) {
 	case TYPE_PING:
@@ -30,32 +249,310 @@ void send_packet_USART3(Msg_t *msg) {
 	case TYPE_UPDATE:
 		size = sizeof(Update_req_t);
 		break;
-	default:
-		size = 0;
+	case TYPE_UPDATE_ALL:
+		size = sizeof(Update_all_t);
 		break;
+	default:
+		return -1;
 	}
 
-//	__asm("cpsid i");
-	data = (char *)msg;
-	for (i=0; i<size; i++) {
-		USART3_send(data[i]);
+	// Claim a window slot for anything the server answers with an update
+	if (type != TYPE_PING) {
+		for (int i=0; i<NET_WINDOW; i++) {
+			if (!inflight[i].in_use) {
+				slot = i;
+				break;
+			}
+		}
+		if (slot < 0)
+			return -1;
+		inflight[slot].seq = seq;
+		inflight[slot].sent_time = time_now_us();
+		inflight[slot].in_use = 1;
+		timer_start(&inflight[slot].timeout, NET_TIMEOUT_US, 0, request_timeout, &inflight[slot]);
 	}
-//	__asm("cpsie i");
+
+#if PROTOCOL_VERSION == 2
+	size = v2_encode(msg, 0, seq, buf);
+	if (size <= 0 || send_payload(buf, size)) {
+#else
+	if (send_payload((uint8_t *)msg, size)) {
+#endif
+		if (slot >= 0)
+			inflight_release(&inflight[slot]);
+		return -1;
+	}
+
+	TRACE(TRACE_PKT_SENT, type, seq);
+	tx_seq++;
+	net_stats.sent++;
+	return 0;
 }
 
-void send_ping(void) {
-	Msg_t msg;
-	msg.pingmsg.id = 18;
-	msg.pingmsg.type = TYPE_PING;
+int send_packet_USART3(Msg_t *msg) {
+	int ret;
 
-	send_packet_USART3(&msg);
+	PROFILE_ENTER(PROF_SEND_PACKET);
+	ret = send_packet(msg);
+	PROFILE_EXIT(PROF_SEND_PACKET);
+	return ret;
 }
 
-void send_update(int val) {
+/*
+ * Take one received frame and, if it holds a reply we're waiting for
+ * and it's newer than what we've already applied, queue it for
+ * net_receive. Either format is accepted.
+ * Returns 1 if a reply was queued, 0 if the frame was thrown away.
+ */
+int receive_packet_USART3(const char *frame, int len) {
 	Msg_t msg;
-	msg.reqmsg.id = 18;
-	msg.reqmsg.type = TYPE_UPDATE;
-	msg.reqmsg.value = val;
+	net_reply_t *reply;
+	joint_state_t *latest;
+	int values[NUM_JOINTS];
+	uint32_t sent_time;
+	uint16_t seq = 0;
+	int has_seq = 0;
+
+	if (len <= 0)
+		return 0;
+
+	if (((uint8_t)frame[0] >> 4) == PROTO_V2) {
+		if (v2_decode((const uint8_t *)frame, len, &msg, &seq))
+			return 0;
+		has_seq = 1;
+	} else {
+		// v1 has no seq: match_reply pairs it with the oldest request
+		if (len != sizeof(Update_resp_t) && len != sizeof(Update_all_t))
+			return 0;
+		for (int i=0; i<len; i++)
+			((char *)&msg)[i] = frame[i];
+	}
+
+	if (msg.pingmsg.type != TYPE_UPDATE && msg.pingmsg.type != TYPE_UPDATE_ALL)
+		return 0;
+
+	if (!match_reply(has_seq, &seq, &sent_time)) {
+		TRACE(TRACE_PKT_RECV, TRACE_RX_LATE, seq);
+		return 0;
+	}
+
+	latest = mailbox_begin(&joints);
+	net_joint_values(&msg, values);
+	latest->t = sent_time;
+	for (int i=0; i<NUM_JOINTS; i++)
+		latest->values[i] = values[i];
+	mailbox_publish(&joints);
+
+	// Straight into the queue slot, visible once it's committed
+	reply = msgq_alloc(&rx_queue);
+	if (!reply) {
+		TRACE(TRACE_PKT_RECV, TRACE_RX_FULL, seq);
+		return 0;
+	}
+	for (int i=0; i<(int)sizeof(Msg_t); i++)
+		((char *)&reply->msg)[i] = ((char *)&msg)[i];
+	reply->sent_time = sent_time;
+	reply->seq = seq;
+	msgq_commit(&rx_queue);
+	TRACE(TRACE_PKT_RECV, TRACE_RX_APPLIED, seq);
+	return 1;
+}
+
+/*
+ * Feed bytes received from USART3 to the network layer.
+ * Returns 1 if at least one reply was queued.
+ */
+int receive_bytes_USART3(const char *data, int len) {
+#if NET_FRAMING
+	int got = 0;
+	int n;
+
+	for (int i=0; i<len; i++) {
+		n = frame_push(&rx_decoder, data[i]);
+		if (n)
+			got |= receive_packet_USART3((char *)rx_decoder.buf, n);
+	}
+	return got;
+#else
+	/* Gather the packet until the line goes idle. Anything that doesn't
+	 * fit can't be a valid message, so mark the packet bad.
+	 */
+	for (int i=0; i<len; i++) {
+		if (recv_offset < (int)sizeof(rx_frame))
+			rx_frame[recv_offset] = data[i];
+		if (recv_offset <= (int)sizeof(rx_frame))
+			recv_offset++;
+	}
+	return 0;
+#endif
+}
+
+/*
+ * The receive line went idle. Without framing that's the end of a packet,
+ * so hand it over and start the next one fresh - a dropped byte only
+ * costs one packet. Framed packets don't need this.
+ * Returns 1 if a reply was queued.
+ */
+int receive_idle_USART3(void) {
+#if NET_FRAMING
+	return 0;
+#else
+	int got = 0;
+
+	if (recv_offset <= (int)sizeof(rx_frame))
+		got = receive_packet_USART3(rx_frame, recv_offset);
+	recv_offset = 0;
+	return got;
+#endif
+}
+
+/*
+ * Protocol v2 encode/decode - see network.h for the layout
+ */
+
+static int v2_code(int value) {
+	if (value < 1000)
+		return V2_NO_VALUE;
+	value -= 999;
+	return value > 1023 ? 1023 : value;
+}
+
+static int v2_value(int code) {
+	return code == V2_NO_VALUE ? 0 : code + 999;
+}
+
+// Pack n values at 10 bits each, returns bytes written
+static int pack_values(const int *values, int n, uint8_t *out) {
+	uint32_t acc = 0;
+	int bits = 0;
+	int len = 0;
+
+	for (int i=0; i<n; i++) {
+		acc |= (uint32_t)v2_code(values[i]) << bits;
+		bits += V2_VALUE_BITS;
+		while (bits >= 8) {
+			out[len++] = acc & 0xFF;
+			acc >>= 8;
+			bits -= 8;
+		}
+	}
+	if (bits)
+		out[len++] = acc & 0xFF;
+	return len;
+}
+
+// Unpack n values from len bytes, returns bytes used or -1 if too short
+static int unpack_values(const uint8_t *in, int len, int *values, int n) {
+	uint32_t acc = 0;
+	int bits = 0;
+	int used = 0;
+
+	for (int i=0; i<n; i++) {
+		while (bits < V2_VALUE_BITS) {
+			if (used == len)
+				return -1;
+			acc |= (uint32_t)in[used++] << bits;
+			bits += 8;
+		}
+		values[i] = v2_value(acc & ((1 << V2_VALUE_BITS) - 1));
+		acc >>= V2_VALUE_BITS;
+		bits -= V2_VALUE_BITS;
+	}
+	return used;
+}
+
+/*
+ * Encode msg into buf (at least V2_MAX_SIZE bytes). TYPE_UPDATE is a
+ * single-joint request unless is_resp is set, then it's the class response.
+ * Returns the encoded length, or -1 for a type v2 doesn't carry.
+ */
+int v2_encode(const Msg_t *msg, int is_resp, uint16_t seq, uint8_t *buf) {
+	int type;
+	int len = V2_HDR_SIZE;
+
+	switch (msg->pingmsg.type) {
+	case TYPE_PING:
+		type = V2_PING;
+		break;
+	case TYPE_UPDATE:
+		if (is_resp) {
+			type = V2_UPDATE_RESP;
+			buf[len++] = msg->respmsg.average & 0xFF;
+			buf[len++] = (msg->respmsg.average >> 8) & 0xFF;
+			buf[len++] = CLASS_SIZE_MAX;
+			len += pack_values(msg->respmsg.values, CLASS_SIZE_MAX, buf + len);
+		} else {
+			type = V2_UPDATE;
+			buf[len++] = msg->reqmsg.value & 0xFF;
+			buf[len++] = (msg->reqmsg.value >> 8) & 0xFF;
+		}
+		break;
+	case TYPE_UPDATE_ALL:
+		type = V2_UPDATE_ALL;
+		len += pack_values(msg->allmsg.values, NUM_JOINTS, buf + len);
+		break;
+	default:
+		return -1;
+	}
+
+	buf[0] = (PROTO_V2 << 4) | type;
+	buf[1] = msg->pingmsg.id & 0xFF;
+	buf[2] = seq & 0xFF;
+	buf[3] = (seq >> 8) & 0xFF;
+	return len;
+}
+
+/*
+ * Decode a v2 frame into msg (v1 layout). Returns 0 on success,
+ * -1 if the frame is the wrong version, type or length.
+ */
+int v2_decode(const uint8_t *buf, int len, Msg_t *msg, uint16_t *seq) {
+	const uint8_t *body = buf + V2_HDR_SIZE;
+	int body_len = len - V2_HDR_SIZE;
+	int used;
+
+	if (body_len < 0 || (buf[0] >> 4) != PROTO_V2)
+		return -1;
+
+	msg->pingmsg.id = buf[1];
+	*seq = buf[2] | (buf[3] << 8);
+
+	switch (buf[0] & 0xF) {
+	case V2_PING:
+		msg->pingmsg.type = TYPE_PING;
+		used = 0;
+		break;
+	case V2_UPDATE:
+		if (body_len < 2)
+			return -1;
+		msg->reqmsg.type = TYPE_UPDATE;
+		msg->reqmsg.value = body[0] | (body[1] << 8);
+		used = 2;
+		break;
+	case V2_UPDATE_ALL:
+		msg->allmsg.type = TYPE_UPDATE_ALL;
+		used = unpack_values(body, body_len, msg->allmsg.values, NUM_JOINTS);
+		break;
+	case V2_UPDATE_RESP:
+	{
+		int count;
+		if (body_len < 3)
+			return -1;
+		count = body[2];
+		if (count > CLASS_SIZE_MAX)
+			return -1;
+		msg->respmsg.type = TYPE_UPDATE;
+		msg->respmsg.average = body[0] | (body[1] << 8);
+		used = unpack_values(body + 3, body_len - 3, msg->respmsg.values, count);
+		if (used >= 0)
+			used += 3;
+		for (int i=count; i<CLASS_SIZE_MAX; i++)
+			msg->respmsg.values[i] = 0;
+		break;
+	}
+	default:
+		return -1;
+	}
 
-	send_packet_USART3(&msg);
+	return used == body_len ? 0 : -1;
 }
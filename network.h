@@ -7,11 +7,14 @@
 
 #ifndef NETWORK_H_
 #define NETWORK_H_
+#include "stdint.h"
+#include "mailbox.h"
 
 // Types here are taken from udp62.c file provided
 /* message types */
 #define TYPE_PING 1
 #define TYPE_UPDATE 2
+#define TYPE_UPDATE_ALL 3
 #define CLASS_SIZE_MAX 30
 
 /* IDs and our group's UDP port */
@@ -21,8 +24,18 @@
 #define WRIST_ID 3
 #define GRIP_ID 4
 #define JUNK_ID 18
+#define NUM_JOINTS 5
+
+/* Joint n lives in server slot JOINT_SLOT_BASE + n, the same
+ * slots the single-joint Update_req_t messages use (1-5)
+ */
+#define JOINT_SLOT_BASE 1
 
 
+/* The v1 layouts are the server's own, byte for byte. They carry no
+ * sequence number, so a v1 reply is matched to the oldest request still
+ * waiting; v2 carries the seq in its header and the server echoes it.
+ */
 typedef struct {
   int type;
   int id;
@@ -41,18 +54,130 @@ typedef struct {
   int values[CLASS_SIZE_MAX];
 } Update_resp_t;
 
+/* Every joint from one ADC sample in a single packet.
+ * id is the server slot of values[PIVOT_ID]; the rest follow in order.
+ */
+typedef struct {
+  int type;
+  int id;
+  int values[NUM_JOINTS];
+} Update_all_t;
+
 typedef union {
   Ping_t pingmsg;
   Update_req_t reqmsg;
   Update_resp_t respmsg;
+  Update_all_t allmsg;
 } Msg_t;
 
-extern volatile Msg_t recv_msg;
-extern volatile int recv_offset;
+/*
+ * Protocol v2 - compact binary layout, sent alongside the struct layout above
+ *
+ * Header (4 bytes):
+ *   byte 0:    version (bits 7:4) | type (bits 3:0)
+ *   byte 1:    id
+ *   bytes 2-3: sequence number, little endian
+ *
+ * Joint values are packed 10 bits each, LSB first. A code of 0 means
+ * "no value", codes 1-1023 are t_high = code + 999 us, which covers
+ * the whole 1000-2000 us servo range.
+ *
+ *   type              body                            size (v1 size)
+ *   V2_PING           -                               4    (8)
+ *   V2_UPDATE         value, 16-bit                   6    (12)
+ *   V2_UPDATE_ALL     NUM_JOINTS packed values        11   (28)
+ *   V2_UPDATE_RESP    average 16-bit, count, packed   45   (132)
+ *
+ * A v1 frame always starts with a small type in its low byte, so the high
+ * nibble of byte 0 tells the two formats apart on receive.
+ */
+#define PROTOCOL_VERSION 1 // version used to send, both are understood on receive
+
+/*
+ * With NET_UPDATE_ALL set, COMMAND mode sends the whole arm in one
+ * TYPE_UPDATE_ALL (V2_UPDATE_ALL) packet, which the server has to know.
+ * Without it, each joint goes in its own TYPE_UPDATE request, which is
+ * all the original server (udp62.c) handles.
+ */
+#define NET_UPDATE_ALL 0
+
+#define PROTO_V2 2
+#define V2_PING 1
+#define V2_UPDATE 2
+#define V2_UPDATE_ALL 3
+#define V2_UPDATE_RESP 4
+#define V2_HDR_SIZE 4
+#define V2_VALUE_BITS 10
+#define V2_NO_VALUE 0
+#define V2_MAX_SIZE (V2_HDR_SIZE + 3 + (CLASS_SIZE_MAX*V2_VALUE_BITS + 7)/8)
+
+/*
+ * With NET_FRAMING set, every packet goes out COBS-framed with a CRC-16
+ * (see framing.c) and the receiver finds packets by their delimiters.
+ * Without it, packets go out bare and the receiver uses the idle gap
+ * after each one. Both ends of the link have to agree.
+ */
+#define NET_FRAMING 0
+
+/*
+ * With v2, requests are pipelined: up to NET_WINDOW can be waiting for a
+ * reply at once. Replies are matched by sequence number in any order. A
+ * reply older than one already applied is late and gets thrown away, and
+ * so do replies that take longer than NET_TIMEOUT_US (each request has
+ * its own timebase.c timer).
+ *
+ * v1 replies carry no sequence number, so there's nothing to match them
+ * by: it's stop-and-wait, one request at a time, and a reply goes with
+ * whichever request is waiting.
+ */
+#if PROTOCOL_VERSION == 2
+#define NET_WINDOW 4
+#else
+#define NET_WINDOW 1
+#endif
+#define NET_TIMEOUT_US 200000	// 8 systicks
+
+typedef struct {
+  uint32_t sent;		// requests sent
+  uint32_t acked;		// replies matched and applied
+  uint32_t late;		// replies thrown away: timed out, duplicate or out of date
+  uint32_t superseded;	// requests given up on because a newer one was answered
+  uint32_t timeouts;	// requests given up on after NET_TIMEOUT_US
+  uint32_t rtt_us;		// round trip of the last matched reply
+} net_stats_t;
+
+extern volatile net_stats_t net_stats;
+
+/* A reply to apply: the message, and when (time_now_us) the request it
+ * answers was sent. Requests go out on a steady clock, so that's a
+ * jitter-free timestamp for what it says, unlike when it arrived.
+ */
+typedef struct {
+  Msg_t msg;
+  uint32_t sent_time;
+  uint16_t seq;		// of the request
+} net_reply_t;
+
+#define NET_RX_SLOTS 4	// replies held for the main loop (power of 2)
+
+#if NET_FRAMING
+#include "framing.h"
+extern frame_decoder_t rx_decoder; // good/corrupt frame counters
+#endif
+
+int send_packet_USART3(Msg_t *msg);
+int receive_packet_USART3(const char *frame, int len);
+int receive_bytes_USART3(const char *data, int len);
+int receive_idle_USART3(void);
+
+int net_can_send(void);
+void net_reset(void);
+int net_receive(net_reply_t *reply);
+int net_joint_values(const Msg_t *msg, int *values);
+const joint_state_t *net_latest_joints(void);
+uint32_t net_rx_dropped(void);
 
-void send_ping(void);
-void send_update(int val);
-void send_packet_USART3(Msg_t *msg);
-void receive_packet_USART3(void);
+int v2_encode(const Msg_t *msg, int is_resp, uint16_t seq, uint8_t *buf);
+int v2_decode(const uint8_t *buf, int len, Msg_t *msg, uint16_t *seq);
 
 #endif /* NETWORK_H_ */
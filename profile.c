@@ -0,0 +1,160 @@
+/*
+ * profile.c
+ *
+ * Each probe (profile.h) reads the DWT cycle counter on the way in and
+ * out and records the difference here: count, min, max, a running total
+ * for the mean, and a log2 histogram, so a rare slow run shows up even
+ * when the mean looks fine. The cost of the two reads themselves is
+ * measured once and taken off.
+ *
+ * profile_report prints every probe on USART2 and starts them all over,
+ * so each report covers the time since the last one (the total only has
+ * to last that long in 32 bits - 25 s of solid running at 168 MHz).
+ *
+ * All of it but profile_cycles_start is only built with PROFILE_ENABLE.
+ *
+ * Documentation references:
+ * [1]: PM0214 STM32F4xxx Programming Manual
+ * [2]: ARMv7-M Architecture Reference Manual
+ */
+
+#include "stdint.h"
+#include "clock.h"
+#include "io.h"
+#include "profile.h"
+
+static volatile uint32_t *DEMCR = (uint32_t*)0xE000EDFC;
+static volatile uint32_t *DWT_CTRL = (uint32_t*)0xE0001000;
+
+/**
+ * Start the cycle counter, if nobody has yet: turn on the trace block,
+ * then the counter
+ */
+void profile_cycles_start(void)
+{
+	// Set bit 24 (TRCENA) of DEMCR, bit 0 (CYCCNTENA) of DWT_CTRL
+	// Ref: [2] C1.6.5, C1.8.7
+	*DEMCR |= 1 << 24;
+	*DWT_CTRL |= 1;
+}
+
+#if PROFILE_ENABLE
+
+static const char *names[PROFILE_NUM_PROBES] = {
+	"USART3_handler",
+	"systick_handler",
+	"EXTI0_handler",
+	"ADC_read",
+	"send_packet_USART3",
+};
+
+static volatile profile_probe_t probes[PROFILE_NUM_PROBES];
+// Cycles an empty ENTER/EXIT pair counts
+static uint32_t overhead = 0;
+
+static void clear(volatile profile_probe_t *p)
+{
+	p->count = 0;
+	p->min = 0xFFFFFFFF;
+	p->max = 0;
+	p->total = 0;
+	for (int k=0; k<PROFILE_BUCKETS; k++)
+		p->hist[k] = 0;
+}
+
+void profile_init(void)
+{
+	uint32_t start, cycles;
+
+	profile_cycles_start();
+
+	for (int i=0; i<PROFILE_NUM_PROBES; i++)
+		clear(&probes[i]);
+
+	// Best of a few, in case an interrupt lands in one
+	overhead = 0xFFFFFFFF;
+	for (int i=0; i<4; i++) {
+		start = PROFILE_CYCCNT;
+		cycles = PROFILE_CYCCNT - start;
+		if (cycles < overhead)
+			overhead = cycles;
+	}
+}
+
+/**
+ * Add one run of probe. Each probe is only recorded from one context,
+ * so this needs no lock.
+ */
+void profile_record(int probe, uint32_t cycles)
+{
+	volatile profile_probe_t *p = &probes[probe];
+	int k;
+
+	cycles = cycles > overhead ? cycles - overhead : 0;
+
+	p->count++;
+	p->total += cycles;
+	if (cycles < p->min)
+		p->min = cycles;
+	if (cycles > p->max)
+		p->max = cycles;
+
+	k = cycles > 1 ? 31 - __builtin_clz(cycles) : 0;
+	if (k >= PROFILE_BUCKETS)
+		k = PROFILE_BUCKETS - 1;
+	p->hist[k]++;
+}
+
+/**
+ * Print every probe on USART2 and reset them. Cycles, with the
+ * histogram as "2^k:count" for the buckets that have anything.
+ */
+void profile_report(void)
+{
+	profile_probe_t p;
+	uint32_t primask;
+
+	print_string("profile (cycles, ");
+	printUnsignedDecimal(clock_hclk_hz / 1000000);
+	print_string(" per us)\n\r");
+
+	for (int i=0; i<PROFILE_NUM_PROBES; i++) {
+		// Take it and start it over in one go, so no run is half in
+		// this report and half in the next
+		__asm volatile ("mrs %0, primask\n\tcpsid i" : "=r" (primask));
+		p.count = probes[i].count;
+		p.min = probes[i].min;
+		p.max = probes[i].max;
+		p.total = probes[i].total;
+		for (int k=0; k<PROFILE_BUCKETS; k++)
+			p.hist[k] = probes[i].hist[k];
+		clear(&probes[i]);
+		__asm volatile ("msr primask, %0" : : "r" (primask));
+
+		print_string((char *)names[i]);
+		print_string(": ");
+		printUnsignedDecimal(p.count);
+		if (p.count == 0) {
+			print_string(" runs\n\r");
+			continue;
+		}
+		print_string(" runs, min ");
+		printUnsignedDecimal(p.min);
+		print_string(" mean ");
+		printUnsignedDecimal(p.total / p.count);
+		print_string(" max ");
+		printUnsignedDecimal(p.max);
+		print_string("\n\r ");
+		for (int k=0; k<PROFILE_BUCKETS; k++) {
+			if (!p.hist[k])
+				continue;
+			print_string(" 2^");
+			printUnsignedDecimal(k);
+			print_string(":");
+			printUnsignedDecimal(p.hist[k]);
+		}
+		print_string("\n\r");
+	}
+}
+
+#endif /* PROFILE_ENABLE */
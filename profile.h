@@ -0,0 +1,67 @@
+/*
+ * profile.h
+ *
+ * Cycle-count probes around interrupt handlers and main loop stages
+ */
+
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include "stdint.h"
+
+// Set to 1 to build the probes in. At 0 they're empty macros and
+// profile.c is empty, so there's nothing left to pay for.
+#define PROFILE_ENABLE 0
+
+// Histogram bucket k counts runs of 2^k to 2^(k+1) - 1 cycles (bucket 0
+// takes 0 and 1, the last everything from 2^(PROFILE_BUCKETS-1) up -
+// 3 ms at 168 MHz)
+#define PROFILE_BUCKETS 20
+
+// What's measured
+enum {
+	PROF_USART3_ISR = 0,
+	PROF_SYSTICK_ISR,
+	PROF_EXTI0_ISR,
+	PROF_ADC_READ,
+	PROF_SEND_PACKET,
+	PROFILE_NUM_PROBES
+};
+
+// DWT cycle counter - PM0214 4.4, ARMv7-M ARM C1.8. Whoever reads it
+// (the probes, sched.c, filter.c) starts it with profile_cycles_start.
+#define PROFILE_CYCCNT (*(volatile uint32_t *)0xE0001004)
+
+void profile_cycles_start(void);
+
+#if PROFILE_ENABLE
+
+/* Bracket the code to measure, in the same block, one probe per
+ * context. Time spent in higher priority interrupts in between is
+ * counted too.
+ */
+#define PROFILE_ENTER(p) uint32_t profile_start_##p = PROFILE_CYCCNT
+#define PROFILE_EXIT(p) profile_record((p), PROFILE_CYCCNT - profile_start_##p)
+
+typedef struct {
+	uint32_t count;
+	uint32_t min;			// cycles
+	uint32_t max;
+	uint32_t total;			// since the last report, for the mean
+	uint32_t hist[PROFILE_BUCKETS];
+} profile_probe_t;
+
+void profile_init(void);
+void profile_record(int probe, uint32_t cycles);
+void profile_report(void);
+
+#else
+
+#define PROFILE_ENTER(p)
+#define PROFILE_EXIT(p)
+#define profile_init()
+#define profile_report()
+
+#endif
+
+#endif /* PROFILE_H_ */
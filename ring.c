@@ -0,0 +1,170 @@
+/*
+ * ring.c
+ *
+ * Queues between exactly one producer and one consumer, which don't
+ * need a lock or interrupts masked: each index has a single writer, so
+ * there's nothing for ldrex/strex to arbitrate. What does matter is the
+ * order things become visible in. The producer fills the slot and only
+ * then publishes head (store_release); the consumer reads head
+ * (load_acquire) before touching the slot, and is done with it before
+ * it publishes tail. The barriers are in mutex.S alongside the atomics.
+ *
+ * Nothing is ever overwritten: a write that doesn't fit is refused and
+ * counted, so the consumer never sees a message half old and half new.
+ *
+ * The byte copies are done by hand (no libc here).
+ */
+
+#include "stdint.h"
+#include "mutex.h"
+#include "ring.h"
+
+/*******************************************
+ * Byte rings
+ *******************************************/
+
+void ring_init(ring_t *r, void *buf, uint32_t size)
+{
+	r->buf = buf;
+	r->size = size;
+	r->head = 0;
+	r->tail = 0;
+	r->dropped = 0;
+}
+
+/**
+ * Bytes queued (exact from the consumer, a lower bound from the producer)
+ */
+uint32_t ring_count(ring_t *r)
+{
+	return load_acquire(&r->head) - r->tail;
+}
+
+/**
+ * Bytes free (exact from the producer, a lower bound from the consumer)
+ */
+uint32_t ring_space(ring_t *r)
+{
+	return r->size - (r->head - load_acquire(&r->tail));
+}
+
+int ring_write(ring_t *r, const void *data, uint32_t len)
+{
+	uint32_t head = r->head;
+	uint32_t mask = r->size - 1;
+
+	if (len > ring_space(r)) {
+		r->dropped++;
+		return -1;
+	}
+
+	for (uint32_t i=0; i<len; i++)
+		r->buf[(head + i) & mask] = ((const uint8_t *)data)[i];
+	store_release(&r->head, head + len);
+	return 0;
+}
+
+uint32_t ring_read(ring_t *r, void *data, uint32_t max)
+{
+	uint32_t tail = r->tail;
+	uint32_t mask = r->size - 1;
+	uint32_t n = load_acquire(&r->head) - tail;
+
+	if (n > max)
+		n = max;
+	for (uint32_t i=0; i<n; i++)
+		((uint8_t *)data)[i] = r->buf[(tail + i) & mask];
+	store_release(&r->tail, tail + n);
+	return n;
+}
+
+uint32_t ring_peek(ring_t *r, const uint8_t **data)
+{
+	uint32_t tail = r->tail;
+	uint32_t off = tail & (r->size - 1);
+	uint32_t n = load_acquire(&r->head) - tail;
+
+	if (off + n > r->size)
+		n = r->size - off;
+	*data = &r->buf[off];
+	return n;
+}
+
+void ring_skip(ring_t *r, uint32_t len)
+{
+	store_release(&r->tail, r->tail + len);
+}
+
+/*******************************************
+ * Message rings
+ *******************************************/
+
+void msgq_init(msgq_t *q, void *buf, uint32_t size, uint32_t slots)
+{
+	q->buf = buf;
+	q->size = size;
+	q->slots = slots;
+	q->head = 0;
+	q->tail = 0;
+	q->dropped = 0;
+}
+
+#define SLOT(q, i) (&(q)->buf[((i) & ((q)->slots - 1)) * (q)->size])
+
+/**
+ * Messages queued (exact from the consumer, a lower bound from the producer)
+ */
+uint32_t msgq_count(msgq_t *q)
+{
+	return load_acquire(&q->head) - q->tail;
+}
+
+void *msgq_alloc(msgq_t *q)
+{
+	if (q->head - load_acquire(&q->tail) >= q->slots) {
+		q->dropped++;
+		return 0;
+	}
+	return SLOT(q, q->head);
+}
+
+void msgq_commit(msgq_t *q)
+{
+	store_release(&q->head, q->head + 1);
+}
+
+int msgq_put(msgq_t *q, const void *msg)
+{
+	uint8_t *slot = msgq_alloc(q);
+
+	if (!slot)
+		return -1;
+	for (uint32_t i=0; i<q->size; i++)
+		slot[i] = ((const uint8_t *)msg)[i];
+	msgq_commit(q);
+	return 0;
+}
+
+void *msgq_peek(msgq_t *q, uint32_t i)
+{
+	if (i >= msgq_count(q))
+		return 0;
+	return SLOT(q, q->tail + i);
+}
+
+void msgq_drop(msgq_t *q, uint32_t n)
+{
+	store_release(&q->tail, q->tail + n);
+}
+
+int msgq_get(msgq_t *q, void *msg)
+{
+	const uint8_t *slot = msgq_peek(q, 0);
+
+	if (!slot)
+		return 0;
+	for (uint32_t i=0; i<q->size; i++)
+		((uint8_t *)msg)[i] = slot[i];
+	msgq_drop(q, 1);
+	return 1;
+}
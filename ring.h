@@ -0,0 +1,62 @@
+/*
+ * ring.h
+ *
+ * Lock-free single-producer/single-consumer queues: byte rings and
+ * rings of fixed-size messages
+ */
+
+#ifndef RING_H_
+#define RING_H_
+
+#include "stdint.h"
+
+/* One context puts, one other context takes (an interrupt handler and
+ * the main loop, say). head is only written by the producer and tail
+ * only by the consumer; both are free-running and masked on use, so
+ * head - tail is always what's queued. Sizes must be powers of 2.
+ */
+typedef struct {
+	uint8_t *buf;
+	uint32_t size;				// bytes
+	volatile uint32_t head;
+	volatile uint32_t tail;
+	volatile uint32_t dropped;	// writes refused for want of room (producer)
+} ring_t;
+
+typedef struct {
+	uint8_t *buf;				// slots * size bytes
+	uint32_t size;				// bytes per message
+	uint32_t slots;
+	volatile uint32_t head;
+	volatile uint32_t tail;
+	volatile uint32_t dropped;	// messages refused because it was full
+} msgq_t;
+
+void ring_init(ring_t *r, void *buf, uint32_t size);
+uint32_t ring_count(ring_t *r);
+uint32_t ring_space(ring_t *r);
+// Producer: all or nothing, returns 0 if queued, -1 if there wasn't room
+int ring_write(ring_t *r, const void *data, uint32_t len);
+// Consumer: returns how many bytes were copied into data
+uint32_t ring_read(ring_t *r, void *data, uint32_t max);
+// Consumer, in place: the next contiguous run (up to the end of the
+// buffer), then ring_skip past however much of it was used
+uint32_t ring_peek(ring_t *r, const uint8_t **data);
+void ring_skip(ring_t *r, uint32_t len);
+
+void msgq_init(msgq_t *q, void *buf, uint32_t size, uint32_t slots);
+uint32_t msgq_count(msgq_t *q);
+// Producer: returns 0 if queued, -1 if full (the message is dropped)
+int msgq_put(msgq_t *q, const void *msg);
+// Consumer: returns 1 if a message was copied into msg, 0 if empty
+int msgq_get(msgq_t *q, void *msg);
+
+// Producer, in place: a slot to fill or 0 if full, then msgq_commit it
+void *msgq_alloc(msgq_t *q);
+void msgq_commit(msgq_t *q);
+// Consumer, in place: the i'th oldest message (0 if there aren't that
+// many), then msgq_drop the ones that are finished with
+void *msgq_peek(msgq_t *q, uint32_t i);
+void msgq_drop(msgq_t *q, uint32_t n);
+
+#endif /* RING_H_ */
@@ -0,0 +1,276 @@
+/*
+ * sched.c
+ *
+ * The main loop used to spin checking a flag per job, in whatever order
+ * the checks happened to be written. Now interrupts post events to
+ * tasks (sched_post) and sched_run runs the highest priority task that
+ * has any, to completion, then looks again. Tasks can also be given a
+ * period in systicks, and get SCHED_EV_TIMER each time it comes round.
+ *
+ * Posting is lock-free, so it's safe from any interrupt: the events are
+ * ORed into the task's word and its bit into the pending mask with
+ * ldrex/strex (atomic_or in mutex.S), and the scheduler takes them with
+ * atomic_swap. Posting twice before the task runs merges the events.
+ *
+ * Each run is timed with the DWT cycle counter. A task given a deadline
+ * counts a miss whenever it finishes later than that after the first
+ * event it was posted, which covers both waiting behind other tasks and
+ * its own run time.
+ *
+ * With nothing to run it sleeps (WFI) until an interrupt, letting the
+ * tick go for as long as no periodic task or idle_tick_budget (main.c)
+ * needs it (systick_sleep). In modes where everything happens in
+ * interrupt handlers it can also set SLEEPONEXIT, so the core goes
+ * straight back to sleep after each handler instead of returning here;
+ * sched_post clears it again, so posting still wakes the loop.
+ *
+ * Documentation references:
+ * [1]: STM32F40x Reference Manual
+ * [2]: PM0214 STM32F4xxx Programming Manual
+ */
+
+#include "stdint.h"
+#include "clock.h"
+#include "mutex.h"
+#include "systick.h"
+#include "timebase.h"
+#include "profile.h"
+#include "sched.h"
+
+// System Control Register, bit 1 (SLEEPONEXIT) - [2] 4.4.6 p.230
+static volatile uint32_t *SCR = (uint32_t*)0xE000ED10;
+#define SCR_SLEEPONEXIT (1 << 1)
+
+typedef struct {
+	sched_task_fn fn;
+	uint32_t period;		// systicks, 0 if not periodic
+	uint32_t deadline;		// cycles, 0 for none
+} task_t;
+
+static task_t tasks[SCHED_NUM_TASKS];
+
+// Bit n set: task n has events waiting
+static volatile uint32_t pending = 0;
+static volatile uint32_t events[SCHED_NUM_TASKS];
+// Cycle count at the first post since the task last ran
+static volatile uint32_t released[SCHED_NUM_TASKS];
+// Systicks to each periodic task's next run (sched_tick only)
+static uint32_t countdown[SCHED_NUM_TASKS];
+// Bit n set: task n takes posts (sched_enable)
+static volatile uint32_t enabled = 0xFFFFFFFF;
+
+// Park in SLEEPONEXIT when idle
+static volatile int sleep_on_exit = 0;
+// Start of the interval sched_idle_percent reports on
+static uint32_t idle_window = 0;
+
+volatile sched_stats_t sched_stats[SCHED_NUM_TASKS];
+volatile sched_idle_stats_t sched_idle_stats;
+
+void sched_init(void)
+{
+	profile_cycles_start();
+}
+
+/**
+ * Install the function for task id. A non-zero period (systicks) posts
+ * it SCHED_EV_TIMER that often; deadline_us (0 for none) is how long
+ * after being posted it should have finished.
+ */
+void sched_task(int id, sched_task_fn fn, uint32_t period_ticks, uint32_t deadline_us)
+{
+	uint32_t primask;
+
+	// sched_tick counts these down
+	__asm volatile ("mrs %0, primask\n\tcpsid i" : "=r" (primask));
+	tasks[id].fn = fn;
+	tasks[id].deadline = deadline_us * (clock_hclk_hz / 1000000);
+	tasks[id].period = period_ticks;
+	countdown[id] = period_ticks;
+	__asm volatile ("msr primask, %0" : : "r" (primask));
+}
+
+/**
+ * Turn task id on or off. Posts to a task that's off are dropped, and
+ * its period doesn't run (or keep the idle loop from sleeping); turning
+ * it back on starts the period over.
+ */
+void sched_enable(int id, int on)
+{
+	uint32_t bit = 1u << id;
+	uint32_t primask;
+
+	__asm volatile ("mrs %0, primask\n\tcpsid i" : "=r" (primask));
+	if (on) {
+		if (!(enabled & bit))
+			countdown[id] = tasks[id].period;
+		enabled |= bit;
+	} else {
+		enabled &= ~bit;
+		pending &= ~bit;
+		events[id] = 0;
+	}
+	__asm volatile ("msr primask, %0" : : "r" (primask));
+}
+
+/**
+ * Whether the idle loop may park in SLEEPONEXIT: for modes where all the
+ * work is done in interrupt handlers
+ */
+void sched_sleep_on_exit(int enable)
+{
+	sleep_on_exit = enable;
+}
+
+/**
+ * Give task id some events to handle. Safe from interrupts.
+ */
+void sched_post(int id, uint32_t ev)
+{
+	uint32_t bit = 1u << id;
+
+	if (!(enabled & bit))
+		return;
+
+	atomic_or(&events[id], ev);
+	// Only the first post since it last ran starts the deadline
+	if (!(atomic_or(&pending, bit) & bit))
+		released[id] = PROFILE_CYCCNT;
+
+	// If the loop is parked, come back to it after this handler
+	*SCR &= ~SCR_SLEEPONEXIT;
+}
+
+/**
+ * Count down the periodic tasks (from systick_handler)
+ */
+void sched_tick(void)
+{
+	for (int i=0; i<SCHED_NUM_TASKS; i++) {
+		if (tasks[i].period && (enabled & (1u << i)) && --countdown[i] == 0) {
+			countdown[i] = tasks[i].period;
+			sched_post(i, SCHED_EV_TIMER);
+		}
+	}
+}
+
+/*
+ * Nothing to run: sleep until an interrupt
+ */
+static void idle(void)
+{
+	systick_wake_t wake;
+	uint32_t budget, t0;
+	int parked = 0;
+
+	// Masked, so a post between the check and the WFI still wakes it,
+	// and the tick can be sorted out before any handler sees it
+	__asm volatile ("cpsid i" : : : "memory");
+	if (pending) {
+		__asm volatile ("cpsie i" : : : "memory");
+		return;
+	}
+
+	if (sleep_on_exit) {
+		// Handlers run with the loop parked, so nothing could make up
+		// skipped ticks - keep the tick going
+		*SCR |= SCR_SLEEPONEXIT;
+		parked = 1;
+		budget = 1;
+	} else {
+		// Ticks until a periodic task is due, or main.c needs one
+		budget = idle_tick_budget();
+		for (int i=0; i<SCHED_NUM_TASKS; i++)
+			if (tasks[i].period && (enabled & (1u << i)) && countdown[i] < budget)
+				budget = countdown[i];
+	}
+
+	systick_sleep(budget, &wake);
+
+	// Ticks with no interrupt didn't count the periodic tasks down
+	// (budget keeps every countdown above what's skipped)
+	for (int i=0; i<SCHED_NUM_TASKS; i++)
+		if (tasks[i].period && (enabled & (1u << i)))
+			countdown[i] -= wake.skipped;
+
+	sched_idle_stats.sleeps++;
+	sched_idle_stats.ticks_skipped += wake.skipped;
+	sched_idle_stats.idle_us += wake.slept / (clock_hclk_hz / 1000000);
+	if (wake.latency >= 0) {
+		sched_idle_stats.wake_latency_last = wake.latency;
+		if ((uint32_t)wake.latency > sched_idle_stats.wake_latency_max)
+			sched_idle_stats.wake_latency_max = wake.latency;
+	}
+
+	t0 = time_now_us();
+	__asm volatile ("cpsie i" : : : "memory");
+	if (parked) {
+		// Back once something was posted: the time in between was
+		// spent asleep apart from the handlers, which aren't taken out
+		*SCR &= ~SCR_SLEEPONEXIT;
+		sched_idle_stats.idle_us += time_since_us(t0);
+	}
+}
+
+/**
+ * Percentage of the time since the last call spent asleep
+ */
+uint32_t sched_idle_percent(void)
+{
+	uint32_t now = time_now_us();
+	uint32_t total = now - idle_window;
+	uint32_t idle = sched_idle_stats.idle_us;
+
+	idle_window = now;
+	sched_idle_stats.idle_us = 0;
+	if (total < 100)
+		return 0;
+	if (idle > total)
+		idle = total;
+	return idle / (total / 100);
+}
+
+/**
+ * Run tasks forever
+ */
+void sched_run(void)
+{
+	while (1) {
+		uint32_t ready = pending;
+		uint32_t bit, ev, release, start, end;
+		volatile sched_stats_t *st;
+		int id;
+
+		if (!ready) {
+			idle();
+			continue;
+		}
+
+		// Lowest bit is the highest priority
+		id = __builtin_ctz(ready);
+		bit = 1u << id;
+
+		// Clear pending before taking the events: a post after this
+		// sets it again and gets another run
+		release = released[id];
+		atomic_and(&pending, ~bit);
+		ev = atomic_swap(&events[id], 0);
+		if (!ev || !tasks[id].fn)
+			continue;
+
+		start = PROFILE_CYCCNT;
+		tasks[id].fn(ev);
+		end = PROFILE_CYCCNT;
+
+		st = &sched_stats[id];
+		st->runs++;
+		st->cycles_last = end - start;
+		if (st->cycles_last > st->cycles_max)
+			st->cycles_max = st->cycles_last;
+		st->cycles_total += st->cycles_last;
+		if (end - release > st->latency_max)
+			st->latency_max = end - release;
+		if (tasks[id].deadline && end - release > tasks[id].deadline)
+			st->misses++;
+	}
+}
@@ -0,0 +1,67 @@
+/*
+ * sched.h
+ *
+ * Run-to-completion task scheduler for the main loop
+ */
+
+#ifndef SCHED_H_
+#define SCHED_H_
+
+#include "stdint.h"
+
+/* The tasks, highest priority first. A task runs when something posts
+ * it an event, and always runs to the end; when several are waiting the
+ * one nearest the top goes first.
+ */
+enum {
+	TASK_NET_RX = 0,	// replies queued by the network layer
+	TASK_MODE,			// the button changed mode
+	TASK_CALIB_KEY,		// 'c' on the console
+	TASK_CLIENT_POLL,	// ask the server for the arm (periodic)
+	TASK_COMMAND,		// new filtered pot readings to send
+	TASK_HEARTBEAT,		// blink the green LED (periodic)
+	TASK_DEBUG,			// console dump (periodic, or 's' on the console)
+	SCHED_NUM_TASKS
+};
+
+// Event bits a task is handed; the rest are the poster's to define
+#define SCHED_EV_TIMER (1u << 31)	// its period came round
+#define SCHED_EV_POST (1u << 0)		// plain "something happened"
+
+typedef void (*sched_task_fn)(uint32_t events);
+
+typedef struct {
+	uint32_t runs;
+	uint32_t cycles_last;	// execution time, CPU cycles
+	uint32_t cycles_max;
+	uint32_t cycles_total;	// wraps - use with runs for a mean over an interval
+	uint32_t latency_max;	// first post to finishing, cycles
+	uint32_t misses;		// finished after the deadline
+} sched_stats_t;
+
+extern volatile sched_stats_t sched_stats[SCHED_NUM_TASKS];
+
+typedef struct {
+	uint32_t sleeps;
+	uint32_t ticks_skipped;		// systicks slept through with no interrupt
+	uint32_t wake_latency_last;	// tick due to running again, cycles
+	uint32_t wake_latency_max;
+	uint32_t idle_us;			// asleep since sched_idle_percent
+} sched_idle_stats_t;
+
+extern volatile sched_idle_stats_t sched_idle_stats;
+
+void sched_init(void);
+void sched_task(int id, sched_task_fn fn, uint32_t period_ticks, uint32_t deadline_us);
+void sched_enable(int id, int on);
+void sched_sleep_on_exit(int enable);
+uint32_t sched_idle_percent(void);
+void sched_post(int id, uint32_t events);
+void sched_tick(void);
+void sched_run(void);
+
+// How many systicks main.c can do without (for the tick handler's own
+// work); the idle loop sleeps through no more than that
+uint32_t idle_tick_budget(void);
+
+#endif /* SCHED_H_ */
@@ -1,15 +1,22 @@
 /*
  * servo.c
  *
- * Enable servos on ports PE9, PE11, PE13, PE14, and PC6
-
- * PC6 = TIM8_CH1
- * * via channels 1-4 of TIM1 (GPIOE) and channel 1 of TIM8 (GPIOC)
+ * Servo PWM outputs: a timer per group of up to four servos, each with
+ * its own frame rate and tick (servo.h), and t_high in each channel's
+ * compare register. Callers always pass t_high in us.
+ *
+ * The outputs are listed once, in SERVO_CHANNELS (servo.h); everything
+ * here loops over the tables built from that list, so adding a servo is
+ * one line there. TIM1 sets the frame, and every other timer at the
+ * same frame rate is reset by TIM1's update event, so all those outputs
+ * start each period together.
+ *
+ * TIM1 and TIM8 have their compare registers loaded by DMA on the update
+ * event, so each of their frames is committed whole (see
+ * servo_commit_frame). TIM3/TIM4 are written directly and aren't: a
+ * servo there changes at its own timer's next update event, which needn't
+ * be the one the DMA loads on.
  *
- * PE9 = TIM1_CH1
- * PE11 = TIM1_CH2
- * PE13 = TIM1_CH3
- * PE14 = TIM1_CH4
  * Documentation references:
  * [1]: STM32F40x Reference Manual
  * [2]: STM32F407VG Datasheet
@@ -21,353 +28,279 @@
 
 #include "stm32f4xx.h"
 #include "stdint.h"
+#include "clock.h"
+#include "DMA.h"
+#include "servo.h"
+
+/* The timers a servo can be on.
+ * RCC enable register and bit (which also says which APB bus clocks it),
+ * whether it's an advanced timer (has a BDTR to turn the outputs on), and
+ * which servo DMA stream (if any) loads its compare registers. Rates come
+ * from SERVO_TIMx_HZ/_TICK_MHZ.
+ * Ref: [1] 6.3.13, 6.3.14 (RCC), 9.3.3 Table 35 (DMA)
+ */
+#define SERVO_DMA_NONE (-1)
+
+#define SERVO_TIMERS(X) \
+	/* timer bus RCC     bit adv DMA */ \
+	X(TIM1, 2, APB2ENR, 0, 1, DMA_SERVO_TIM1) \
+	X(TIM3, 1, APB1ENR, 1, 0, SERVO_DMA_NONE) \
+	X(TIM4, 1, APB1ENR, 2, 0, SERVO_DMA_NONE) \
+	X(TIM8, 2, APB2ENR, 1, 1, DMA_SERVO_TIM8)
+
+typedef struct {
+	// TIM2-5 share the TIM1/TIM8 layout for everything used here but BDTR
+	TIMx_ADV_TypeDef *tim;
+	uint8_t apb;		// CLOCK_APB1 or CLOCK_APB2
+	volatile uint32_t *rcc_enr;
+	uint8_t rcc_bit;
+	uint8_t advanced;
+	int8_t dma;
+	uint8_t sync;		// reset by TIM1's update (same frame rate)
+	uint16_t arr;
+	uint8_t ticks_per_us;
+} servo_timer_t;
+
+typedef struct {
+	uint8_t timer;		// index into servo_timers
+	uint8_t channel;	// 1-4
+	GPIO_TypeDef *port;
+	uint8_t pin;
+	uint8_t af;
+	uint8_t ticks_per_us;
+	uint16_t min_us;
+	uint16_t max_us;	// already limited to the frame length
+	volatile uint32_t *ccr;
+} servo_channel_t;
+
+#define SERVO_MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define SERVO_TIMER_ENUM(tim, apb, enr, bit, adv, dma) SERVO_TIMER_##tim,
+enum { SERVO_TIMERS(SERVO_TIMER_ENUM) SERVO_NUM_TIMERS };
+
+#define SERVO_TIMER_ENTRY(tim, apb, enr, bit, adv, dma) \
+	{ (TIMx_ADV_TypeDef*)(tim), apb, &RCC->enr, bit, adv, dma, \
+	  SERVO_##tim##_HZ == SERVO_TIM1_HZ, \
+	  SERVO_##tim##_TICK_MHZ * 1000000 / SERVO_##tim##_HZ - 1, \
+	  SERVO_##tim##_TICK_MHZ },
+static const servo_timer_t servo_timers[SERVO_NUM_TIMERS] = {
+	SERVO_TIMERS(SERVO_TIMER_ENTRY)
+};
+
+#define SERVO_CHANNEL_ENTRY(tim, ch, port, pin, af, min, max) \
+	{ SERVO_TIMER_##tim, ch, port, pin, af, SERVO_##tim##_TICK_MHZ, min, \
+	  SERVO_MIN(max, 1000000 / SERVO_##tim##_HZ - SERVO_MIN_LOW_US), \
+	  &(tim)->TIMx_CCR1 + (ch) - 1 },
+static const servo_channel_t servo_channels[SERVO_COUNT] = {
+	SERVO_CHANNELS(SERVO_CHANNEL_ENTRY)
+};
+
+// The frames the DMA copies in at the next update: CCR1-4 of TIM1 and TIM8
+static uint32_t frame_tim1[4];
+static uint32_t frame_tim8[4];
 
-void servo_init(void)
+/*
+ * Does any servo use this timer? (TIM1 always runs - it sets the period)
+ */
+static int timer_used(int t)
 {
-	uint32_t val;
-
-	/*******************************************
-	 * Enable clocks
-	 *******************************************/
-	// Enable clock for GPIOE - [1] 6.3.12 p.145
-	// Set bit 4 of RCC_AHB1ENR (GPIOEEN) to high
-	// Ref. [1] 6.3.12 p.145
-	RCC->AHB1ENR |= 1 << 4;
-
-	// Enable clock for GPIOC
-	// Set bit 2 of RCC_AHB1ENR (GPIOCEN) to high
-	// Ref. [1] 6.3.12 p.145
-	RCC->AHB1ENR |= 4;
-
-	// Enable clock for Advanced-control timer TIM1
-	// Set bit 0 of RCC_APB2ENR (TIM1EN) to high
-	// Ref.	[1] 6.3.17 p.154
-	RCC->APB2ENR |= 1;
-
-	// Enable clock for advanced-control timer TIM8
-	// Set bit 1 of RCC_APB2ENR (TIM8EN) to high
-	// Ref. [1] 6.3.17 p.154
-	RCC->APB2ENR |= 2;
-
-	/*******************************************
-	 * Configure GPIO pins
-	 *******************************************/
-
-	// Configure Port E pins 9, 11, 13, and 14 to AF mode
-	// Set GPIOx_MODER bits 29:28 (MODER14), 27:26 (MODER13),
-	// 23:22 (MODER11), and 19:18 (MODER9) to '10', alternate
-	// function mode
-	//
-	// Ref. [1] 7.4.1 p.198
-	GPIOE->MODER = (GPIOE->MODER & ~0x3CCC0000) | 0x28880000;
-
-	//Configure port C pin 6 to AF mode
-	// Set GPIOx_MODER bits 13:12 (MODER6) to '10'
-	//
-	// Ref. [1] 7.4.1 p.198
-	GPIOC->MODER = (GPIOC->MODER & ~0x3000) | 0x2000;
-
-
-	// Set ports 9, 11, 13, and 14 on GPIOE to AF1 for
-	// TIM1 channels 1-4
-	//
-	// Set GPIOE_AFRH bits 27:24 (AFRH14), 23:20 (AFRH13),
-	// 15:12 (AFRH11), and 7:4 (AFRH9) to '0001' for AF1
-	//
-	// Ref. [2] Table 8 p.60
-	// 	[1] 7.4.10 p.203
-	GPIOE->AFRH = (GPIOE->AFRH & ~0xFF0F0F0) | 0x1101010;
+	if (t == SERVO_TIMER_TIM1)
+		return 1;
+	for (int i=0; i<SERVO_COUNT; i++)
+		if (servo_channels[i].timer == t)
+			return 1;
+	return 0;
+}
 
-	// Set port 6 on GPIOC to AF3 (TIM8/9/10/11) for
-	// TIM8_CH1
-	//
-	// Set GPIOC_AFRL bits 27:24 to '0011' for AF3
-	// Ref.	[2] Table 8 p.59
-	//		[1] 7.4.9 p.202
-	GPIOC->AFRL = (GPIOC->AFRL & ~0xF000000) | 0x3000000;
-
-	/*******************************************
-	 * Configure TIM1
-	 *******************************************/
-	// Set Prescaler to 15 (downclock to 1 MHz) - [1] 14.4.11 p.409
-	TIM1->TIMx_PSC = (TIM1->TIMx_PSC & ~0xFFFF) | 15;
-
-	// Set auto-reload register to 20,000 (20ms clock period) - [1] 14.4.12 p.409
-	TIM1->TIMx_ARR = (~0xFFFF & TIM1->TIMx_ARR) | 20000;
-
-
-	/*******************************************
-	 * Configure TIM8
-	 *******************************************/
-	// Set Prescaler to 15 (downclock to 1 MHz)
-	// Set bits 15:0 of TIMx_PSC to 15
-	// Ref. [1] 14.4.11 p.409
-	TIM8->TIMx_PSC = (TIM8->TIMx_PSC & ~0xFFFF) | 15;
-
-	// Set a 20ms clock period
-	// Set bits 15:0 of TIMx_ARR (auto-reload register) to 20,000
-	// Ref: [1] 15.4.12 p.470
-	TIM8->TIMx_ARR = (~0xFFFF & TIM8->TIMx_ARR) | 20000;
-
-	/*******************************************
-	 * Configure Compare/capture for TIM1_CH1
-	 *******************************************/
-	// Set Compare/Capture 1 Selection (CC1S) Bits 1:0
-	// to 00: output
-	// Ref: [1] 14.4.7 p.403
-	TIM1->TIMx_CCMR1 = (TIM1->TIMx_CCMR1 & ~0x3) | 0;
-
-	// In Capture/Compare Mode Register 1 (CCMR1)
-	// Set Output Compare 1 mode (OC1M) Bits 6:4
-	// to '110': PWM Mode 1
-	// Ref: [1] 14.4.7 p.402
-	TIM1->TIMx_CCMR1 = (TIM1->TIMx_CCMR1 & ~0x70) | 0x60;
-
-	// Enable Output compare 1 preload enable
-	// This enables the register to preload a value at update events
-	// Discussed in [1] - 14.3.10
-	//
-	// Set bit 3 (OC1PE) of CCMR1 to high
-	// Ref: [1] - 14.4.7 p.402
-	TIM1->TIMx_CCMR1 |= 0x8;
-
-	// Configure a default duty cycle of 7.5% (t_high = 1.5ms)
-	// To do this, set CCR1 to 1,500 - [1] 14.4.14 p.410
-	val = (TIM1->TIMx_CCR1 & TIMx_CCR1_MASK) | 1500;
-	TIM1->TIMx_CCR1 = val;
-
-	// Enable Capture/compare 1 to output
-	// Set CC1E on to enable output - [1] 14.4.9 p.407
-	val = (TIM1->TIMx_CCER & TIMx_CCER_CC1E_MASK) | TIMx_CCER_CC1E;
-	TIM1->TIMx_CCER = val;
-
-	/*******************************************
-	 * Configure Compare/capture for TIM1_CH2
-	 *******************************************/
-	// Set Compare/Capture 2 to output
-	// Set bits 9:8 of TIMx_CCMR1 to '00'
-	// Ref: [1] 14.4.7 p.403
-	TIM1->TIMx_CCMR1 = (TIM1->TIMx_CCMR1 & ~0x300) | 0;
-
-	// Set output compare mode to PWM1
-	//
-	// In Capture/Compare Mode Register 1 (CCMR1)
-	// Set Output Compare 2 mode (OC2M) Bits 14:12
-	// to '110': PWM Mode 1
-	//
-	// Ref: [1] 14.4.7 p.402
-	TIM1->TIMx_CCMR1 = (TIM1->TIMx_CCMR1 & ~0x7000) | 0x6000;
+/*
+ * Clock, period and master/slave setup for one timer
+ */
+static void timer_init(int t)
+{
+	const servo_timer_t *st = &servo_timers[t];
+	TIMx_ADV_TypeDef *tim = st->tim;
+	uint32_t psc;
+
+	// Enable the timer's clock
+	// Ref: [1] 6.3.13 p.148, 6.3.14 p.152
+	*st->rcc_enr |= 1 << st->rcc_bit;
+
+	// Set Prescaler for the tick from whatever the bus is running at
+	// (83 gives 1 MHz from APB1's 84 MHz timer clock) - [1] 14.4.11 p.409
+	psc = clock_timer_hz(st->apb) / (st->ticks_per_us * 1000000) - 1;
+	tim->TIMx_PSC = (tim->TIMx_PSC & ~0xFFFF) | psc;
+
+	if (t == SERVO_TIMER_TIM1 || !st->sync) {
+		// Set auto-reload register to one frame (20,000 for 50 Hz at 1 MHz)
+		// Ref: [1] 14.4.12 p.409
+		tim->TIMx_ARR = (~0xFFFF & tim->TIMx_ARR) | st->arr;
+	}
 
-	// Enable Output compare 2 preload enable
-	// This enables the register to preload a value at update events
-	// Discussed in [1] - 14.3.10
-	//
-	// Set bit 11 of Capture/Control Mode Register 1 (CCMR1) to high
-	// Ref: [1] 14.4.7 p.402
-	TIM1->TIMx_CCMR1 = TIM1->TIMx_CCMR1 | 1 << 11;
-
-	// Configure a default duty cycle of 7.5% (t_high = 1.5ms)
-	// Set CCR2 bits 15:0 to 1,500
-	// Ref: [1] 14.4.15 p.411
-	TIM1->TIMx_CCR2 = (TIM1->TIMx_CCR2 & ~0xFFFF) | 1500;
-
-	// Enable Capture/compare 2 to output
-	// Set bit 4 (CC2E) in CCER to high
-	// Ref: [1] 14.4.9 p.407
-	TIM1->TIMx_CCER |= 0x10;
-
-	/*******************************************
-	 * Configure Compare/capture for TIM1_CH3
-	 *******************************************/
-	// Set compare/capture 3 to output
-	// Set bits 1:0 in TIMx_CCMR2 to '00'
-	// Ref: [1] 14.4.8 p.404
-	TIM1->TIMx_CCMR2 = (TIM1->TIMx_CCMR2 & ~0x3) | 0;
-
-	// In Capture/Compare Mode Register 2 (CCMR2)
-	// Set Output Compare 3 mode (OC3M) Bits 6:4
-	// to '110': PWM Mode 1
-	// Ref: [1] 14.4.8 p.404
-	TIM1->TIMx_CCMR2 = (TIM1->TIMx_CCMR2 & ~0x70) | 0x60;
-
-	// In Capture/Control Mode Register 2 (CCMR2)
-	// Enable Output compare 3 preload enable (OCM3PE)
-	// This enables the register to preload a value at update events
-	// Discussed in [1] - 14.3.10
-	//
-	// Set bit 3 of TIMx_CCMR2 to high
-	// Ref: [1] - 14.4.8 p.404
-	TIM1->TIMx_CCMR2 |= 0x8;
-
-	// Configure a default duty cycle of 7.5% (t_high = 1.5ms)
-	// Set CCR3 bits 15:0 to 1,500
-	// Ref: [1] 14.4.16 p.411
-	TIM1->TIMx_CCR3 = (TIM1->TIMx_CCR3 & ~0xFFFF) | 1500;
-
-	// Enable Capture/compare 3 to output
-	// set bit 8 (CC3E) in CCER to high
-	// Ref: [1] 14.4.9 p.407
-	TIM1->TIMx_CCER |= 0x100;
-
-	/*******************************************
-	 * Configure Compare/capture for TIM1_CH4
-	 *******************************************/
-	// Set Compare/Capture 4 to output
-	// Set bits 9:8 of TIMx_CCMR2 to '00'
-	// Ref: [1] 14.4.8 p.404
-	TIM1->TIMx_CCMR2 = (TIM1->TIMx_CCMR2 & ~0x300) | 0;
-
-	// Set output compare mode to PWM1
-	//
-	// In Capture/Compare Mode Register 2 (CCMR2)
-	// Set Output Compare 4 mode (OC4M) Bits 14:12
-	// to '110': PWM Mode 1
-	//
-	// Ref: [1] 14.4.8 p.404
-	TIM1->TIMx_CCMR2 = (TIM1->TIMx_CCMR2 & ~0x7000) | 0x6000;
+	if (t == SERVO_TIMER_TIM1) {
+		// TIM1 sends its update event out as TRGO
+		// Set bits 6:4 (MMS) of TIM1_CR2 to '010'
+		// Ref: [1] 14.4.2 p.391
+		tim->TIMx_CR2 = (tim->TIMx_CR2 & ~0x70) | 0x20;
+	} else if (st->sync) {
+		// These get their period from TIM1, so let them count past
+		// the end of a frame rather than wrap on their own
+		// Set bits 15:0 of TIMx_ARR (auto-reload register) to 0xFFFF
+		// Ref: [1] 15.4.12 p.470
+		tim->TIMx_ARR = (~0xFFFF & tim->TIMx_ARR) | 0xFFFF;
+
+		// Reset (and update) on ITR0, which is TIM1 TRGO for TIM3, TIM4 and TIM8
+		// Set bits 6:4 (TS) of TIMx_SMCR to '000' and bits 2:0 (SMS) to '100'
+		// Ref: [1] 14.4.3 p.392, Table 86 p.394, 18.4.3 Table 93 p.523
+		tim->TIMx_SMCR = (tim->TIMx_SMCR & ~0x77) | 0x4;
+	}
 
-	// Enable Output compare 4 preload enable
-	// This enables the register to preload a value at update events
-	// Discussed in [1] - 14.3.10
-	//
-	// Set bit 11 (OC4PE) of Capture/Control Mode Register 2 (CCMR2) to high
-	// Ref: [1] 14.4.8 p.404
-	TIM1->TIMx_CCMR2 = TIM1->TIMx_CCMR2 | 1 << 11;
-
-	// Configure a default duty cycle of 7.5% (t_high = 1.5ms)
-	// Set CCR4 bits 15:0 to 1,500
-	// Ref: [1] 14.4.17 p.412
-	TIM1->TIMx_CCR4 = (TIM1->TIMx_CCR4 & ~0xFFFF) | 1500;
-
-	// Enable Capture/compare 4 to output
-	// Set bit 12 (CC4E) in CCER to high
-	// Ref: [1] 14.4.9 p.407
-	TIM1->TIMx_CCER |= 0x1000;
-
-
-	/*******************************************
-	 * Configure Compare/capture for TIM8_CH1
-	 * Copy configuration from TIM1_CH1
-	 *******************************************/
-	// Set Compare/Capture 1 Selection (CC1S) Bits 1:0
-	// to 00: output
-	// Ref: [1] 14.4.7 p.403
-	TIM8->TIMx_CCMR1 = (TIM8->TIMx_CCMR1 & ~0x3) | 0;
-
-	// In Capture/Compare Mode Register 1 (CCMR1)
-	// Set Output Compare 1 mode (OC1M) Bits 6:4
-	// to '110': PWM Mode 1
-	// Ref: [1] 14.4.7 p.402
-	TIM8->TIMx_CCMR1 = (TIM8->TIMx_CCMR1 & ~0x70) | 0x60;
-
-	// Enable Output compare 1 preload enable
-	// This enables the register to preload a value at update events
-	// Discussed in [1] - 14.3.10
-	//
-	// Set bit 3 (OC1PE) of CCMR1 to high
-	// Ref: [1] - 14.4.7 p.402
-	TIM8->TIMx_CCMR1 |= 0x8;
-
-	// Configure a default duty cycle of 7.5% (t_high = 1.5ms)
-	// To do this, set CCR1 to 1,500 - [1] 14.4.14 p.410
-	val = (TIM8->TIMx_CCR1 & TIMx_CCR1_MASK) | 1500;
-	TIM8->TIMx_CCR1 = val;
-
-	// Enable Capture/compare 1 to output
-	// Set CC1E on to enable output - [1] 14.4.9 p.407
-	val = (TIM8->TIMx_CCER & TIMx_CCER_CC1E_MASK) | TIMx_CCER_CC1E;
-	TIM8->TIMx_CCER = val;
-
-	/*******************************************
-	 * Enable common settings for TIM1
-	 *******************************************/
 	// Enable auto-reload preload enable
 	// As discussed in [1] - 14.3.10
 	//
 	// Set bit 7 (ARPE) in TIMx_CR1 to high
 	// Ref: [1] 14.4.1 p.390
-	TIM1->TIMx_CR1 |= 0x80;
-
-	// Set the MOE bit in the BDTR register to enable all outputs
-	// [1] 14.4.18 p.412
-	val = TIM1->TIMx_BDTR | TIMx_BDTR_MOE;
-	TIM1->TIMx_BDTR = val;
-
-	// Update the preload registers by setting UG bit in TIMx_EGR
-	// Discussed in [1] 14.3.10 for using PWM mode
-	// Set UG bit (bit 0) in EGR
-	val = TIM1->TIMx_EGR | 1;
-	TIM1->TIMx_EGR = val;
-
-	// Enable the timer by setting CEN (bit 0 of CR1);
-	// [1] 14.4.1 p.390
-	val = TIM1->TIMx_CR1 | 1;
-	TIM1->TIMx_CR1 = val;
-
-	/*******************************************
-	 * Enable common settings for TIM8
-	 *******************************************/
-	// Enable auto-reload preload enable
-	// As discussed in [1] - 14.3.10
-	//
-	// Set bit 7 (ARPE) in TIMx_CR1 to high
-	// Ref: [1] 14.4.1 p.390
-	TIM8->TIMx_CR1 |= 0x80;
+	tim->TIMx_CR1 |= 0x80;
 
-	// Set the MOE bit in the BDTR register to enable all outputs
-	// [1] 14.4.18 p.412
-	val = TIM8->TIMx_BDTR | TIMx_BDTR_MOE;
-	TIM8->TIMx_BDTR = val;
+	if (st->advanced) {
+		// Set the MOE bit in the BDTR register to enable all outputs
+		// [1] 14.4.18 p.412
+		tim->TIMx_BDTR |= TIMx_BDTR_MOE;
+	}
 
-	// Update the preload registers by setting UG bit in TIMx_EGR
-	// Discussed in [1] 14.3.10 for using PWM mode
-	// Set UG bit (bit 0) in EGR
-	val = TIM8->TIMx_EGR | 1;
-	TIM8->TIMx_EGR = val;
+	if (st->dma != SERVO_DMA_NONE) {
+		// Burst: 4 transfers through DMAR, starting at CCR1
+		// Set bits 12:8 (DBL) of TIMx_DCR to 3 (4 transfers) and bits 4:0 (DBA)
+		// to 13 (CCR1 is at offset 0x34 = 13 words)
+		// Ref: [1] 14.4.19 p.413, 14.3.21
+		tim->TIMx_DCR = (3 << 8) | 13;
+
+		// Request DMA on update
+		// Set bit 8 (UDE) of TIMx_DIER to high
+		// Ref: [1] 14.4.4 p.393
+		tim->TIMx_DIER |= 1 << 8;
+	}
+}
 
-	// Enable the timer by setting CEN (bit 0 of CR1);
-	// [1] 14.4.1 p.390
-	val = TIM8->TIMx_CR1 | 1;
-	TIM8->TIMx_CR1 = val;
+/*
+ * Pin and compare channel setup for one servo
+ */
+static void channel_init(const servo_channel_t *sc)
+{
+	TIMx_ADV_TypeDef *tim = servo_timers[sc->timer].tim;
+	int port = ((uint32_t)sc->port - GPIOA_BASE) / 0x400;
+	// CCMR1 holds channels 1 and 2, CCMR2 3 and 4, 8 bits each
+	volatile uint32_t *ccmr = sc->channel <= 2 ? &tim->TIMx_CCMR1 : &tim->TIMx_CCMR2;
+	int shift = (sc->channel - 1) % 2 * 8;
+
+	// Enable the clock for the GPIO port
+	// Set bit <port> of RCC_AHB1ENR (GPIOxEN) to high
+	// Ref. [1] 6.3.12 p.145
+	RCC->AHB1ENR |= 1 << port;
+
+	// Put the pin in AF mode
+	// Set MODERy to '10' - [1] 7.4.1 p.198
+	sc->port->MODER = (sc->port->MODER & ~(3 << (2 * sc->pin))) | (2 << (2 * sc->pin));
+
+	// Select the timer's alternate function
+	// Set AFRy to af - [1] 7.4.9 p.202, 7.4.10 p.203
+	if (sc->pin < 8)
+		sc->port->AFRL = (sc->port->AFRL & ~(0xF << (4 * sc->pin))) | (sc->af << (4 * sc->pin));
+	else
+		sc->port->AFRH = (sc->port->AFRH & ~(0xF << (4 * (sc->pin - 8)))) | (sc->af << (4 * (sc->pin - 8)));
+
+	// Output, PWM Mode 1, with the compare register preloaded at update events
+	// Set CCxS to '00', OCxM to '110' and OCxPE high
+	// Ref: [1] 14.4.7 p.402-403, 14.3.10
+	*ccmr = (*ccmr & ~(0x7B << shift)) | ((0x60 | 0x8) << shift);
+
+	// Start at t_high = 1.5ms (centered)
+	// Ref: [1] 14.4.14 p.410
+	*sc->ccr = 1500 * sc->ticks_per_us;
+
+	// Enable Capture/compare x to output
+	// Set CCxE on to enable output - [1] 14.4.9 p.407
+	tim->TIMx_CCER |= 1 << (4 * (sc->channel - 1));
+}
+
+void servo_init(void)
+{
+	for (int t=0; t<SERVO_NUM_TIMERS; t++)
+		if (timer_used(t))
+			timer_init(t);
+
+	for (int i=0; i<SERVO_COUNT; i++)
+		channel_init(&servo_channels[i]);
+
+	DMA_servo_init();
+
+	// Update the preload registers by setting UG bit in TIMx_EGR, then
+	// enable the timer by setting CEN (bit 0 of CR1). The slaves go first
+	// so they're already counting when TIM1 first resets them.
+	// Ref: [1] 14.3.10, 14.4.6 p.397, 14.4.1 p.390
+	for (int t=0; t<SERVO_NUM_TIMERS; t++) {
+		if (t == SERVO_TIMER_TIM1 || !timer_used(t))
+			continue;
+		servo_timers[t].tim->TIMx_EGR |= 1;
+		servo_timers[t].tim->TIMx_CR1 |= 1;
+	}
+	TIM1->TIMx_EGR |= 1;
+	TIM1->TIMx_CR1 |= 1;
+}
 
+/*
+ * Wait until a timer isn't within SERVO_COMMIT_GUARD us of its update
+ * event. Re-arming a stream while its burst is running would split it.
+ */
+static void wait_commit_window(const servo_timer_t *st)
+{
+	uint32_t guard = SERVO_COMMIT_GUARD * st->ticks_per_us;
+	uint32_t cnt;
+
+	do {
+		cnt = st->tim->TIMx_CNT;
+	} while (cnt < guard || cnt + guard > st->tim->TIMx_ARR);
 }
 
 /**
- * t_high is the desired t_high period in microseconds
- * id is the servo to update.
- * 0 = PE9
- * 1 = PE11
- * 2 = PE13
- * 3 = PE14
- * 4 = PC6
+ * Set every servo (t_high[0] = servo 1 ...) in the same PWM period.
+ * TIM1 and TIM8 values are handed to the DMA, which loads them all on the
+ * next update event. TIM3/TIM4 values are written now, one register at a
+ * time, and each takes effect at its timer's next update event through
+ * the preload - not part of the same atomic frame. Values are in us,
+ * clamped to each servo's limits.
  */
-void servo_update(int id, uint16_t t_high)
+void servo_commit_frame(const uint32_t *t_high)
 {
-	if (t_high > 2000 || t_high < 1000) // return if invalid time
-		return;
-
-	switch (id) {
-	case 1:
-		// Set bits 15:0 of CCR1 to t_high
-		TIM1->TIMx_CCR1 = 0xFFFF & t_high;
-		break;
-	case 2:
-		// Set bits 15:0 of TIM1_CCR2 to t_high
-		TIM1->TIMx_CCR2 = 0xFFFF & t_high;
-		break;
-	case 3:
-		// Set bits 15:0 of TIM1_CCR3 to t_high
-		TIM1->TIMx_CCR3 = 0xFFFF & t_high;
-		break;
-	case 4:
-		// Set bits 15:0 of TIM1_CCR4 to t_high
-		TIM1->TIMx_CCR4 = 0xFFFF & t_high;
-		break;
-	case 5:
-		// set bits 15:0 of TIM2_CCR4 to t_high
-		TIM8->TIMx_CCR1 = 0xFFFF & t_high;
-		break;
-	default:
-		break;
+	// Synced timers update with TIM1, so TIM1's window covers them
+	wait_commit_window(&servo_timers[SERVO_TIMER_TIM1]);
+
+	for (int i=0; i<SERVO_COUNT; i++) {
+		const servo_channel_t *sc = &servo_channels[i];
+		uint32_t t = t_high[i];
+
+		if (t < sc->min_us)
+			t = sc->min_us;
+		if (t > sc->max_us)
+			t = sc->max_us;
+		t *= sc->ticks_per_us;
+
+		switch (servo_timers[sc->timer].dma) {
+		case DMA_SERVO_TIM1:
+			frame_tim1[sc->channel - 1] = t;
+			break;
+		case DMA_SERVO_TIM8:
+			frame_tim8[sc->channel - 1] = t;
+			break;
+		default:
+			*sc->ccr = t;
+			break;
+		}
+	}
+
+	start_DMA_servo_frame(DMA_SERVO_TIM1, frame_tim1);
+	if (timer_used(SERVO_TIMER_TIM8)) {
+		if (!servo_timers[SERVO_TIMER_TIM8].sync)
+			wait_commit_window(&servo_timers[SERVO_TIMER_TIM8]);
+		start_DMA_servo_frame(DMA_SERVO_TIM8, frame_tim8);
 	}
 }
@@ -9,7 +9,62 @@
 #define SERVO_H_
 #include "stdint.h"
 
+/* Every servo output, in servo id order (the first is servo 1).
+ * To add one, add a line: the timer (TIM1, TIM3, TIM4 or TIM8), its
+ * channel (1-4), the pin it comes out on with that pin's alternate
+ * function number ([2] Table 9), and the t_high limits in us.
+ *
+ * For example, a second arm could use TIM3 and TIM4 on port B:
+ *	X(TIM3, 1, GPIOB,  4, 2, 1000, 2000)
+ *	X(TIM3, 2, GPIOB,  5, 2, 1000, 2000)
+ *	X(TIM4, 1, GPIOB,  6, 2, 1000, 2000)
+ *	X(TIM4, 2, GPIOB,  7, 2, 1000, 2000)
+ *	X(TIM4, 3, GPIOB,  8, 2, 1000, 2000)
+ *	X(TIM4, 4, GPIOB,  9, 2, 1000, 2000)
+ * (TIM4 on port D would fight the LEDs on PD12-15.)
+ */
+#define SERVO_CHANNELS(X) \
+	/* timer ch  port  pin af  min   max */ \
+	X(TIM1,  1, GPIOE,  9, 1, 1000, 2000) \
+	X(TIM1,  2, GPIOE, 11, 1, 1000, 2000) \
+	X(TIM1,  3, GPIOE, 13, 1, 1000, 2000) \
+	X(TIM1,  4, GPIOE, 14, 1, 1000, 2000) \
+	X(TIM8,  1, GPIOC,  6, 3, 1000, 2000)
+
+#define SERVO_ONE(tim, ch, port, pin, af, min, max) + 1
+#define SERVO_COUNT (0 SERVO_CHANNELS(SERVO_ONE))
+
+/* PWM frame rate (Hz) and tick (MHz) for each timer.
+ * Analog servos want 50 Hz; digital ones take up to 333 Hz, which gets a
+ * new position to them every 3 ms instead of every 20. A timer with the
+ * same frame rate as TIM1 is locked to TIM1's period; the others run on
+ * their own. The tick must divide the timer clock (84 MHz for TIM3/TIM4,
+ * 168 MHz for TIM1/TIM8, see clock.h), and a frame must fit in 65536
+ * ticks. Everything outside servo.c works in us regardless.
+ */
+#define SERVO_TIM1_HZ 50
+#define SERVO_TIM1_TICK_MHZ 1
+#define SERVO_TIM3_HZ 50
+#define SERVO_TIM3_TICK_MHZ 1
+#define SERVO_TIM4_HZ 50
+#define SERVO_TIM4_TICK_MHZ 1
+#define SERVO_TIM8_HZ 50
+#define SERVO_TIM8_TICK_MHZ 1
+
+#if SERVO_TIM1_TICK_MHZ * 1000000 / SERVO_TIM1_HZ > 65536 || \
+	SERVO_TIM3_TICK_MHZ * 1000000 / SERVO_TIM3_HZ > 65536 || \
+	SERVO_TIM4_TICK_MHZ * 1000000 / SERVO_TIM4_HZ > 65536 || \
+	SERVO_TIM8_TICK_MHZ * 1000000 / SERVO_TIM8_HZ > 65536
+#error "servo PWM frame doesn't fit in 16 bits at that tick - lower SERVO_TIMx_TICK_MHZ"
+#endif
+
+// Shortest low time (us) a pulse must leave at the end of its frame
+#define SERVO_MIN_LOW_US 100
+
+// How close (us) to a PWM update servo_commit_frame won't re-arm the DMA
+#define SERVO_COMMIT_GUARD 5
+
 void servo_init(void);
-void servo_update(int id, uint32_t t_high);
+void servo_commit_frame(const uint32_t *t_high);
 
 #endif /* SERVO_H_ */
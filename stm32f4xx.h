@@ -233,6 +233,12 @@ volatile typedef struct
 
 #define TIM2_BASE		(0x40000000)
 #define TIM2			((TIMx_GP_TypeDef*)TIM2_BASE)
+#define TIM3_BASE		(0x40000400)
+#define TIM3			((TIMx_GP_TypeDef*)TIM3_BASE)
+#define TIM4_BASE		(0x40000800)
+#define TIM4			((TIMx_GP_TypeDef*)TIM4_BASE)
+#define TIM5_BASE		(0x40000C00)
+#define TIM5			((TIMx_GP_TypeDef*)TIM5_BASE)
 
 
 // SPI
@@ -333,3 +339,27 @@ volatile typedef struct {
 
 #define DMA2_BASE	(0x40026400)
 #define DMA2		((DMA_TypeDef*)DMA2_BASE)
+#define DMA1_BASE	(0x40026000)
+#define DMA1		((DMA_TypeDef*)DMA1_BASE)
+
+/* Flash interface, see [1] 3.9 */
+volatile typedef struct {
+	uint32_t FLASH_ACR;		/* Flash access control register	- offset 0x00 */
+	uint32_t FLASH_KEYR;	/* Flash key register				- offset 0x04 */
+	uint32_t FLASH_OPTKEYR;	/* Flash option key register		- offset 0x08 */
+	uint32_t FLASH_SR;		/* Flash status register			- offset 0x0C */
+	uint32_t FLASH_CR;		/* Flash control register			- offset 0x10 */
+	uint32_t FLASH_OPTCR;	/* Flash option control register	- offset 0x14 */
+} FLASH_TypeDef;
+
+#define FLASH_BASE	(0x40023C00)
+#define FLASH		((FLASH_TypeDef*)FLASH_BASE)
+
+/* Power controller, see [1] 5.4 */
+volatile typedef struct {
+	uint32_t PWR_CR;		/* PWR power control register		- offset 0x00 */
+	uint32_t PWR_CSR;		/* PWR power control/status register - offset 0x04 */
+} PWR_TypeDef;
+
+#define PWR_BASE	(0x40007000)
+#define PWR			((PWR_TypeDef*)PWR_BASE)
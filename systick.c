@@ -1,28 +1,146 @@
 /*
  * systick.c
  *
+ * The system tick, and the idle sleep that lets it skip ticks nothing
+ * needs (systick_sleep).
+ *
  *  Created on: Feb 9, 2016
  *      Author: matthew
  */
 
 #include "stm32f4xx.h"
 #include "stdint.h"
+#include "systick.h"
+
+// Interrupt Control and State Register, bit 26 (PENDSTSET)
+// Ref: PM0214 4.4.3 p.226
+static volatile uint32_t *ICSR = (uint32_t*)0xE000ED04;
+#define ICSR_PENDSTSET (1 << 26)
+
+// Counts (HCLK / SYSTICK_CLK_DIV) per tick
+static uint32_t period = 1;
+// Counts to CPU cycles
+#define COUNTS(x) ((x) * SYSTICK_CLK_DIV)
 
 /*
  * void systick_init(int timer_count)
  *
- * Configure systick to enable interrupts at timer_count clock cycle intervals
+ * Configure systick to enable interrupts at timer_count intervals, in
+ * counts of HCLK / SYSTICK_CLK_DIV
  */
 void systick_init(uint32_t timer_count) {
 	uint32_t ctrl_val = 0;
 	uint32_t reload_val = 0;
 	reload_val = timer_count & STK_LOAD_RELOAD_MASK;
+	period = reload_val + 1;
 	STK->STK_LOAD = reload_val;
-	// Use internal clock
-	ctrl_val |= (STK_CTRL_CLKSOURCE_MASK & ONES);
+	// Count AHB / 8 (CLKSOURCE low), so the counter can stretch over
+	// several ticks in systick_sleep - [1] 6.2 Figure 21
+	ctrl_val &= ~STK_CTRL_CLKSOURCE_MASK;
 	// Enable systick interrupts
 	ctrl_val |= (STK_CTRL_TICKINT_MASK & ONES);
 	// Enable counting
 	ctrl_val |= (STK_CTRL_ENABLE_MASK & ONES);
 	STK->STK_CTRL = ctrl_val;
 }
+
+/*
+ * Restart the counter so the next tick comes in cycles (>= 1), then
+ * carry on with whole ticks. With VAL cleared, the counter takes LOAD
+ * at its first count after it's enabled - up to SYSTICK_CLK_DIV CPU
+ * cycles on - so LOAD can only be set back to the period once that's
+ * happened: VAL has moved off 0, or (for a count of 1) already come
+ * back to it. A LOAD of 0 would stop the counter, hence at least 2.
+ * Ref: PM0214 4.5.1-4.5.3
+ */
+static void restart(uint32_t cycles) {
+	if (cycles < 2)
+		cycles = 2;
+	STK->STK_LOAD = cycles - 1;
+	STK->STK_VAL = 0;		// (clears COUNTFLAG too)
+	STK->STK_CTRL |= STK_CTRL_ENABLE_MASK;
+	while (STK->STK_VAL == 0 && !(STK->STK_CTRL & STK_CTRL_COUNTFLAG_MASK))
+		;
+	STK->STK_LOAD = period - 1;
+}
+
+/*
+ * void systick_sleep(uint32_t max_ticks, systick_wake_t *wake)
+ *
+ * Sleep (WFI) until an interrupt. Call with interrupts masked (PRIMASK)
+ * so the wake-up comes back here before any handler runs.
+ *
+ * If nothing needs the tick interrupt for max_ticks ticks, the counter
+ * is stretched to run that long in one go (as far as 24 bits allow) and
+ * the ticks that went by without an interrupt are added to systemTicks
+ * on the way out; the caller has to account for them anywhere else
+ * (wake->skipped). The counter stops for a few cycles either side, so
+ * the tick drifts very slightly late each time.
+ */
+void systick_sleep(uint32_t max_ticks, systick_wake_t *wake) {
+	uint32_t before, after, val, stretch, elapsed, n;
+
+	wake->skipped = 0;
+	wake->latency = -1;
+
+	n = max_ticks;
+	if (n > (STK_LOAD_RELOAD_MASK + 1) / period)
+		n = (STK_LOAD_RELOAD_MASK + 1) / period;
+
+	if (n <= 1 || (*ICSR & ICSR_PENDSTSET)) {
+		// Just sleep, the tick carries on as normal
+		before = STK->STK_VAL;
+		__asm volatile ("dsb\n\twfi" : : : "memory");
+		after = STK->STK_VAL;
+
+		if (*ICSR & ICSR_PENDSTSET) {
+			// Woken by (or through) the tick: it's been due since the counter wrapped
+			wake->slept = COUNTS(before + (period - after));
+			wake->latency = COUNTS(period - 1 - after);
+		} else {
+			wake->slept = COUNTS(before - after);
+		}
+		return;
+	}
+
+	// Stop, and stretch what's left of this tick by n-1 more
+	STK->STK_CTRL &= ~STK_CTRL_ENABLE_MASK;
+	val = STK->STK_VAL;
+	if (*ICSR & ICSR_PENDSTSET) { // ran out just now
+		STK->STK_CTRL |= STK_CTRL_ENABLE_MASK;
+		wake->slept = 0;
+		return;
+	}
+	stretch = val + (n - 1) * period;
+	STK->STK_LOAD = stretch;
+	STK->STK_VAL = 0;
+	STK->STK_CTRL |= STK_CTRL_ENABLE_MASK;
+
+	__asm volatile ("dsb\n\twfi" : : : "memory");
+
+	STK->STK_CTRL &= ~STK_CTRL_ENABLE_MASK;
+	after = STK->STK_VAL;
+
+	if (*ICSR & ICSR_PENDSTSET) {
+		// Slept the whole way: the handler counts the last tick, the rest
+		// were skipped. The counter has gone round from stretch again.
+		elapsed = stretch - after;
+		wake->skipped = n - 1;
+		wake->latency = COUNTS(elapsed);
+		wake->slept = COUNTS(stretch + 1 + elapsed);
+		restart(elapsed < period ? period - elapsed : 1);
+	} else {
+		// Something else woke us: count the ticks that went by and
+		// line the counter up with where the next one should be
+		elapsed = stretch - after;
+		wake->slept = COUNTS(elapsed);
+		if (elapsed < val) {
+			restart(val - elapsed);
+		} else {
+			elapsed -= val;
+			wake->skipped = 1 + elapsed / period;
+			restart(period - elapsed % period);
+		}
+	}
+	systemTicks += wake->skipped;
+}
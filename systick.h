@@ -9,6 +9,22 @@
 #ifndef SYSTICK_H_
 #define SYSTICK_H_
 
+// Interrupts per second
+#define SYSTICK_HZ 40
+// The counter runs at HCLK / 8 (systick_init's count is clock_hclk_hz / 8 / SYSTICK_HZ)
+#define SYSTICK_CLK_DIV 8
+
+// What a systick_sleep was like
+typedef struct {
+	uint32_t slept;		// cycles asleep
+	uint32_t skipped;	// ticks that went by with no interrupt
+	int32_t latency;	// cycles from the tick falling due to waking, -1 if something else woke it
+} systick_wake_t;
+
 void systick_init(uint32_t timer_count);
+void systick_sleep(uint32_t max_ticks, systick_wake_t *wake);
+
+// Count of systick interrupts since reset (main.c)
+extern volatile int systemTicks;
 
 #endif /* SYSTICK_H_ */
@@ -0,0 +1,247 @@
+/*
+ * timebase.c
+ *
+ * TIM5 is 32 bits wide, so counting at 1 MHz it makes a microsecond
+ * clock that only wraps every 71 minutes. Timestamps come straight from
+ * its counter - no interrupt involved.
+ *
+ * Its compare channel 1 runs the software timers. They hang off a wheel
+ * of TIMER_WHEEL_SLOTS lists by expiry time, so starting or stopping
+ * one only touches one slot. The compare is set to the earliest expiry
+ * in the first slot that has anything due this revolution (or one
+ * revolution on, if nothing is), and turned off altogether when no
+ * timer is running, so there's no interrupt unless something is due.
+ * When it goes off, the wheel is walked up to now and everything due
+ * is called, still from the interrupt - keep the callbacks short (a
+ * sched_post, say).
+ *
+ * Documentation references:
+ * [1]: STM32F40x Reference Manual
+ */
+
+#include "stm32f4xx.h"
+#include "stdint.h"
+#include "clock.h"
+#include "timebase.h"
+
+#define SLOT(t) (((t) >> TIMER_WHEEL_SHIFT) & (TIMER_WHEEL_SLOTS - 1))
+#define REVOLUTION (TIMER_WHEEL_SLOTS * TIMER_WHEEL_TICK_US)
+
+// sw_timer_t.active
+#define TIMER_ON_WHEEL 1
+#define TIMER_FIRING 2		// due, taken off the wheel to be called
+
+static sw_timer_t *wheel[TIMER_WHEEL_SLOTS];
+// Start of the slot the wheel has been run up to
+static uint32_t cursor = 0;
+// Timers running
+static int count = 0;
+
+void timebase_init(void)
+{
+	// Enable clock for TIM5
+	// Set bit 3 of RCC_APB1ENR (TIM5EN) to high
+	// Ref: [1] 6.3.13 p.148
+	RCC->APB1ENR |= 1 << 3;
+
+	// Count microseconds (83 from APB1's 84 MHz timer clock), all 32 bits
+	// Ref: [1] 18.4.11 p.535, 18.4.12 p.535
+	TIM5->TIMx_PSC = clock_timer_hz(CLOCK_APB1) / 1000000 - 1;
+	TIM5->TIMx_ARR = 0xFFFFFFFF;
+
+	// Channel 1 as a plain compare: CC1S '00' (output), OC1M '000'
+	// (frozen - it sets the flag, the pin isn't used)
+	// Ref: [1] 18.4.7 p.529
+	TIM5->TIMx_CCMR1 &= ~0xFF;
+
+	// Load the prescaler now rather than at the first wrap, and clear
+	// the update flag that sets
+	// Set bit 0 (UG) of TIMx_EGR - [1] 18.4.6 p.527
+	TIM5->TIMx_EGR = 1;
+	TIM5->TIMx_SR = 0;
+
+	// Configure NVIC to accept interrupts from TIM5
+	// (Interrupt 50, ISER1 bit 18) - [1] 10.2 Table 61
+	uint32_t *NVIC_ISER1 = (uint32_t*)0xE000E104;
+	*NVIC_ISER1 |= 1 << 18;
+
+	// Enable the timer by setting CEN (bit 0 of CR1)
+	// Ref: [1] 18.4.1 p.519
+	TIM5->TIMx_CR1 |= 1;
+}
+
+/**
+ * Microseconds since timebase_init (wraps)
+ */
+uint32_t time_now_us(void)
+{
+	return TIM5->TIMx_CNT;
+}
+
+/**
+ * Microseconds since t (a time_now_us), across a wrap
+ */
+uint32_t time_since_us(uint32_t t)
+{
+	return TIM5->TIMx_CNT - t;
+}
+
+static void insert(sw_timer_t *t)
+{
+	sw_timer_t **slot = &wheel[SLOT(t->expires)];
+
+	t->next = *slot;
+	*slot = t;
+	t->active = TIMER_ON_WHEEL;
+	count++;
+}
+
+static void unlink(sw_timer_t *t)
+{
+	sw_timer_t **p = &wheel[SLOT(t->expires)];
+
+	while (*p && *p != t)
+		p = &(*p)->next;
+	if (*p)
+		*p = t->next;
+	t->active = 0;
+	count--;
+}
+
+/*
+ * Point the compare at the next thing due, or turn it off.
+ * Call with interrupts masked.
+ */
+static void program(void)
+{
+	uint32_t start = cursor;
+	uint32_t due = cursor + REVOLUTION;
+	int found = 0;
+
+	if (count == 0) {
+		// Nothing to wake up for
+		// Clear bit 1 (CC1IE) of TIMx_DIER - [1] 18.4.4 p.524
+		TIM5->TIMx_DIER &= ~(1 << 1);
+		return;
+	}
+
+	// The first slot with something due in its own revolution has the
+	// earliest expiry (later ones in a slot are a revolution or more out)
+	for (int k=0; k<TIMER_WHEEL_SLOTS && !found; k++, start += TIMER_WHEEL_TICK_US) {
+		for (sw_timer_t *t = wheel[SLOT(start)]; t; t = t->next) {
+			if ((int32_t)(t->expires - (start + TIMER_WHEEL_TICK_US)) < 0 &&
+					(int32_t)(t->expires - due) < 0) {
+				due = t->expires;
+				found = 1;
+			}
+		}
+	}
+
+	// Set CCR1 and enable CC1IE - [1] 18.4.13 p.536, 18.4.4 p.524
+	TIM5->TIMx_CCR1 = due;
+	TIM5->TIMx_DIER |= 1 << 1;
+
+	// Already gone by: the compare won't match until the counter comes
+	// round again, so make the event now
+	// Set bit 1 (CC1G) of TIMx_EGR - [1] 18.4.6 p.527
+	if ((int32_t)(TIM5->TIMx_CNT - due) >= 0)
+		TIM5->TIMx_EGR = 1 << 1;
+}
+
+/**
+ * Start (or restart) t: fn(arg) in delay_us, then every period_us if
+ * that's not 0
+ */
+void timer_start(sw_timer_t *t, uint32_t delay_us, uint32_t period_us, timer_fn fn, void *arg)
+{
+	uint32_t primask;
+
+	__asm volatile ("mrs %0, primask\n\tcpsid i" : "=r" (primask));
+	if (t->active == TIMER_ON_WHEEL)
+		unlink(t);
+
+	// The wheel stands still while nothing's running
+	if (count == 0)
+		cursor = TIM5->TIMx_CNT & ~(TIMER_WHEEL_TICK_US - 1);
+
+	t->fn = fn;
+	t->arg = arg;
+	t->period = period_us;
+	t->expires = TIM5->TIMx_CNT + delay_us;
+	insert(t);
+	program();
+	__asm volatile ("msr primask, %0" : : "r" (primask));
+}
+
+void timer_stop(sw_timer_t *t)
+{
+	uint32_t primask;
+
+	__asm volatile ("mrs %0, primask\n\tcpsid i" : "=r" (primask));
+	if (t->active == TIMER_ON_WHEEL) {
+		unlink(t);
+		program();
+	}
+	// (one that's due but not called yet won't be)
+	t->active = 0;
+	__asm volatile ("msr primask, %0" : : "r" (primask));
+}
+
+/*
+ * Compare match: run the wheel up to now and call whatever's due
+ */
+void __attribute__ ((interrupt)) TIM5_handler(void)
+{
+	uint32_t now;
+	sw_timer_t *fired = 0;
+	sw_timer_t *t;
+
+	// Clear bit 1 (CC1IF) of TIMx_SR (rc_w0) - [1] 18.4.5 p.525
+	TIM5->TIMx_SR = ~(1 << 1);
+
+	now = TIM5->TIMx_CNT;
+
+	// Take everything due off the wheel first, so the callbacks can
+	// start and stop timers as they like (a timer they stop or restart
+	// before its turn isn't called)
+	for (int k=0; k<TIMER_WHEEL_SLOTS; k++) {
+		sw_timer_t **p = &wheel[SLOT(cursor)];
+
+		while (*p) {
+			t = *p;
+			if ((int32_t)(t->expires - now) <= 0) {
+				*p = t->next;
+				count--;
+				t->active = TIMER_FIRING;
+				t->fired_next = fired;
+				fired = t;
+			} else {
+				p = &t->next;
+			}
+		}
+		if ((int32_t)(now - (cursor + TIMER_WHEEL_TICK_US)) < 0)
+			break;
+		cursor += TIMER_WHEEL_TICK_US;
+	}
+	// Been asleep more than a revolution: every slot's been looked at
+	if ((int32_t)(now - cursor) >= TIMER_WHEEL_TICK_US)
+		cursor = now & ~(TIMER_WHEEL_TICK_US - 1);
+
+	while (fired) {
+		t = fired;
+		fired = t->fired_next;
+		if (t->active != TIMER_FIRING)
+			continue;
+		t->active = 0;
+		if (t->period) {
+			// Keep to the period's phase, unless it's fallen right behind
+			t->expires += t->period;
+			if ((int32_t)(t->expires - now) <= 0)
+				t->expires = now + t->period;
+			insert(t);
+		}
+		t->fn(t->arg);
+	}
+
+	program();
+}
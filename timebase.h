@@ -0,0 +1,50 @@
+/*
+ * timebase.h
+ *
+ * Free-running microsecond clock on TIM5, and software timers run off
+ * its compare channel
+ */
+
+#ifndef TIMEBASE_H_
+#define TIMEBASE_H_
+
+#include "stdint.h"
+
+/* Timer wheel: TIMER_WHEEL_SLOTS lists of TIMER_WHEEL_TICK_US each (both
+ * powers of 2), so one revolution is 65 ms. Timers further out than
+ * that just wait in their slot for the right revolution.
+ */
+#define TIMER_WHEEL_SHIFT 10					// 1024 us per slot
+#define TIMER_WHEEL_TICK_US (1 << TIMER_WHEEL_SHIFT)
+#define TIMER_WHEEL_SLOTS 64
+
+typedef void (*timer_fn)(void *arg);
+
+// Owned by the caller, left alone by the caller while it's running
+typedef struct sw_timer {
+	struct sw_timer *next;
+	struct sw_timer *fired_next;
+	uint32_t expires;		// time_now_us it goes off at
+	uint32_t period;		// us, 0 for one-shot
+	timer_fn fn;
+	void *arg;
+	uint8_t active;			// nonzero while it's going to go off
+} sw_timer_t;
+
+void timebase_init(void);
+
+/* Microseconds since timebase_init. Wraps every 71 minutes, so compare
+ * with a signed difference or use time_since_us.
+ */
+uint32_t time_now_us(void);
+uint32_t time_since_us(uint32_t t);
+
+/* Call fn(arg) from the TIM5 interrupt delay_us from now, then every
+ * period_us if that's not 0. Restarting a running timer moves it.
+ */
+void timer_start(sw_timer_t *t, uint32_t delay_us, uint32_t period_us, timer_fn fn, void *arg);
+void timer_stop(sw_timer_t *t);
+
+void __attribute__ ((interrupt)) TIM5_handler(void);
+
+#endif /* TIMEBASE_H_ */
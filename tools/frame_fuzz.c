@@ -0,0 +1,225 @@
+/*
+ * frame_fuzz.c
+ *
+ * Feeds the COBS + CRC-16 framing (framing.c) streams of random frames
+ * with bytes dropped, flipped and inserted, and garbage between frames,
+ * and checks that it resyncs: every frame the damage didn't touch comes
+ * out intact, whatever happened to the frame before it. Also times
+ * encoding and decoding. Runs on the PC:
+ *
+ *   cc -std=c99 -D_POSIX_C_SOURCE=200809L -O2 -o frame_fuzz tools/frame_fuzz.c
+ *   ./frame_fuzz [seed]
+ *
+ * Payloads run from 1 byte to FRAME_MAX_PAYLOAD, and every stream has
+ * frames of exactly sizeof(Msg_t). Exits 1 if a check fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "host.h"
+#include "../framing.c"
+#include "../network.h"
+
+#define FRAMES 20000
+
+// Faults
+enum { FAULT_NONE = 0, FAULT_DROP, FAULT_FLIP, FAULT_INSERT };
+
+typedef struct {
+	int len;
+	uint8_t payload[FRAME_MAX_PAYLOAD];
+	int fault;		// what was done to it
+	int got;		// came out of the decoder
+} sent_t;
+
+typedef struct {
+	const char *name;
+	int fault_pct;	// share of frames hit
+	int garbage;	// also put junk between frames
+} scenario_t;
+
+static uint32_t rng = 1;
+
+static uint32_t rnd(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static sent_t sent[FRAMES];
+
+/*
+ * Build the stream for a scenario into out, returns its length
+ */
+static int build(const scenario_t *s, uint8_t *out)
+{
+	uint8_t frame[FRAME_MAX_SIZE + 1];
+	int n = 0;
+
+	for (int k=0; k<FRAMES; k++) {
+		sent_t *f = &sent[k];
+		int len;
+
+		if (k % 10 == 0)
+			f->len = sizeof(Msg_t);
+		else
+			f->len = 1 + rnd() % FRAME_MAX_PAYLOAD;
+		for (int i=0; i<f->len; i++)
+			f->payload[i] = (rnd() % 4 == 0) ? 0 : rnd(); // plenty of zeros to stuff
+		f->got = 0;
+		f->fault = FAULT_NONE;
+
+		len = frame_encode(f->payload, f->len, frame);
+		if (len < 0) {
+			printf("frame_encode refused %d bytes\n", f->len);
+			exit(1);
+		}
+
+		// Damage the frame itself, leading and trailing delimiters included
+		if ((int)(rnd() % 100) < s->fault_pct) {
+			int at = rnd() % len;
+			f->fault = FAULT_DROP + rnd() % 3;
+			switch (f->fault) {
+			case FAULT_DROP:
+				memmove(frame + at, frame + at + 1, len - at - 1);
+				len--;
+				break;
+			case FAULT_FLIP:
+				frame[at] ^= 1 << (rnd() % 8);
+				break;
+			case FAULT_INSERT:
+				at = 1 + at % (len - 1); // between the delimiters
+				memmove(frame + at + 1, frame + at, len - at);
+				frame[at] = rnd() % 2 ? 0 : rnd();
+				len++;
+				break;
+			}
+		}
+		memcpy(out + n, frame, len);
+		n += len;
+
+		// Junk on the line, sometimes long enough to overflow the decoder
+		if (s->garbage && rnd() % 8 == 0) {
+			int junk = rnd() % 2 ? rnd() % 16 : rnd() % 400;
+			for (int i=0; i<junk; i++)
+				out[n++] = rnd();
+		}
+	}
+	return n;
+}
+
+static int run(const scenario_t *s)
+{
+	static uint8_t stream[FRAMES * (FRAME_MAX_SIZE + 1 + 400)];
+	frame_decoder_t d;
+	int len = build(s, stream);
+	int next = 0;			// first frame not yet matched
+	uint32_t damaged = 0, delivered = 0, lost_intact = 0, undetected = 0;
+	int failed = 0;
+
+	memset(&d, 0, sizeof(d));
+	for (int i=0; i<len; i++) {
+		int n = frame_push(&d, stream[i]);
+		int k;
+
+		if (!n)
+			continue;
+		delivered++;
+		// Frames come out in order, so look forward from the last match
+		for (k=next; k<FRAMES; k++) {
+			if (sent[k].len == n && !memcmp(sent[k].payload, d.buf, n))
+				break;
+		}
+		if (k == FRAMES) {
+			undetected++; // damage the CRC didn't catch
+		} else {
+			sent[k].got = 1;
+			next = k + 1;
+		}
+	}
+
+	for (int k=0; k<FRAMES; k++) {
+		if (sent[k].fault != FAULT_NONE)
+			damaged++;
+		else if (!sent[k].got)
+			lost_intact++;
+	}
+
+	// CRC-16 lets about 1 in 65536 corrupt frames through
+	if (lost_intact || undetected > 2 + damaged / 8192)
+		failed = 1;
+
+	printf("%-20s %6u %8u %9u %7u %10u | %6u %5u %5u  %s\n", s->name, FRAMES, damaged,
+			delivered, lost_intact, undetected,
+			d.frames_ok, d.frames_crc_err, d.frames_bad, failed ? "FAIL" : "ok");
+	return failed;
+}
+
+/*
+ * Encode and decode throughput on clean frames of the largest message
+ */
+static void throughput(void)
+{
+	static uint8_t stream[FRAMES * FRAME_MAX_SIZE];
+	uint8_t payload[sizeof(Msg_t)];
+	frame_decoder_t d;
+	uint64_t t0, enc_ns, dec_ns;
+	int n = 0;
+	uint32_t good = 0;
+
+	for (unsigned i=0; i<sizeof(payload); i++)
+		payload[i] = rnd();
+
+	t0 = now_ns();
+	for (int k=0; k<FRAMES; k++) {
+		payload[0] = k;
+		n += frame_encode(payload, sizeof(payload), stream + n);
+	}
+	enc_ns = now_ns() - t0;
+
+	memset(&d, 0, sizeof(d));
+	t0 = now_ns();
+	for (int i=0; i<n; i++)
+		good += frame_push(&d, stream[i]) != 0;
+	dec_ns = now_ns() - t0;
+
+	printf("\n%u-byte frames: encode %.1f MB/s (%.0f ns each), decode %.1f MB/s (%.0f ns each), %u/%u good\n",
+			(unsigned)sizeof(payload), n * 1e3 / enc_ns, (double)enc_ns / FRAMES,
+			n * 1e3 / dec_ns, (double)dec_ns / FRAMES, good, FRAMES);
+}
+
+int main(int argc, char **argv)
+{
+	static const scenario_t scenarios[] = {
+		{ "clean", 0, 0 },
+		{ "1% damaged", 1, 0 },
+		{ "10% damaged", 10, 0 },
+		{ "50% damaged", 50, 0 },
+		{ "garbage between", 0, 1 },
+		{ "10% + garbage", 10, 1 },
+	};
+	int failed = 0;
+
+	if (argc > 1)
+		rng = strtoul(argv[1], NULL, 0) | 1;
+	printf("seed %u\n", rng);
+	printf("%-20s %6s %8s %9s %7s %10s | %6s %5s %5s\n", "stream", "frames", "damaged",
+			"delivered", "lost ok", "undetected", "ok", "crc", "bad");
+	for (unsigned i=0; i<sizeof(scenarios)/sizeof(scenarios[0]); i++)
+		failed |= run(&scenarios[i]);
+	throughput();
+	return failed;
+}
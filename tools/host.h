@@ -0,0 +1,92 @@
+/*
+ * host.h
+ *
+ * Lets the tests in tools/ build firmware sources on the PC. A test
+ * includes its system headers, then this, then the firmware .c files it
+ * exercises, so it can see their statics:
+ *
+ *   #include <stdio.h>
+ *   #include "host.h"
+ *   #include "../ring.c"
+ *
+ * Build with -std=c99 (plus -D_POSIX_C_SOURCE=200809L for clock_gettime
+ * and threads): in strict C99 mode the C library headers don't define
+ * the int8_t that clashes with the firmware's own stdint.h.
+ */
+
+#ifndef HOST_H_
+#define HOST_H_
+
+#include "../stdint.h"
+
+// The firmware's stdint.h stops at 32 bits
+typedef long long int64_t;
+typedef unsigned long long uint64_t;
+
+// Interrupt handlers are plain functions here
+#define interrupt unused
+
+// The Cortex-M inline asm (masking interrupts around a few lines) is
+// compiled out: the tests run everything from one thread, or only use
+// code that doesn't mask
+#define __asm if (0) __asm__
+
+/* mutex.S, in C. Every one is a full barrier, which is at least as
+ * strong as the dmb the firmware versions have.
+ */
+static inline uint32_t atomic_or(volatile uint32_t *addr, uint32_t bits)
+{
+	return __atomic_fetch_or(addr, bits, __ATOMIC_SEQ_CST);
+}
+
+static inline uint32_t atomic_and(volatile uint32_t *addr, uint32_t bits)
+{
+	return __atomic_fetch_and(addr, bits, __ATOMIC_SEQ_CST);
+}
+
+static inline uint32_t atomic_swap(volatile uint32_t *addr, uint32_t val)
+{
+	return __atomic_exchange_n(addr, val, __ATOMIC_SEQ_CST);
+}
+
+static inline uint32_t atomic_add(volatile uint32_t *addr, uint32_t n)
+{
+	return __atomic_fetch_add(addr, n, __ATOMIC_SEQ_CST);
+}
+
+static inline uint32_t load_acquire(volatile uint32_t *addr)
+{
+	return __atomic_load_n(addr, __ATOMIC_ACQUIRE);
+}
+
+static inline void store_release(volatile uint32_t *addr, uint32_t val)
+{
+	__atomic_store_n(addr, val, __ATOMIC_RELEASE);
+}
+
+// The event trace goes nowhere
+static inline void trace_event(uint32_t type, uint32_t arg8, uint32_t arg16)
+{
+	(void)type;
+	(void)arg8;
+	(void)arg16;
+}
+
+/* timebase.c: the test moves the clock (unless it's testing timebase.c
+ * itself, and defines HOST_TIMEBASE)
+ */
+#ifndef HOST_TIMEBASE
+uint32_t host_time_us;
+
+static inline uint32_t time_now_us(void)
+{
+	return host_time_us;
+}
+
+static inline uint32_t time_since_us(uint32_t t)
+{
+	return host_time_us - t;
+}
+#endif
+
+#endif /* HOST_H_ */
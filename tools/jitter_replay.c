@@ -0,0 +1,250 @@
+/*
+ * jitter_replay.c
+ *
+ * Replays lossy, jittery and reordered reply traces through the jitter
+ * buffer and dead reckoning (jitter.c) and checks what reaches the
+ * motion engine against where the arm really was. Runs on the PC:
+ *
+ *   cc -std=c99 -D_POSIX_C_SOURCE=200809L -O2 -o jitter_replay tools/jitter_replay.c -lm
+ *   ./jitter_replay [-v] [seed]
+ *
+ * The far arm moves each joint along its own sine. CLIENT mode asks for
+ * it every systick and each reply carries the joints as they were when
+ * the request went out; replies take a base transit time plus random
+ * jitter, and the scenarios drop or swap some. Playback is compared with
+ * the real position at its play point (now - delay): the error, and
+ * stalls - a joint's output staying put for three frames or more while
+ * the joint moved over 10 us a frame. (The prediction is linear, so it
+ * can't see a joint turning round: a loss right at a turnaround can
+ * leave the output still for a frame or two.) For comparison, "hold" is
+ * the worst error of simply holding the newest setpoint played until
+ * the next one comes in.
+ * -v prints each frame. Exits 1 if a check fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "host.h"
+#include "../ring.c"
+#include "../jitter.c"
+
+#define REQ_US 25000			// SYSTICK_HZ
+#define FRAME_US (1000000 / MOTION_HZ)
+#define RUN_US 60000000
+#define WARMUP_US 2000000
+#define BASE_TRANSIT_US 40000
+#define REQS (RUN_US / REQ_US)
+
+// The motion engine's side: the targets jitter_step set
+static int target[NUM_JOINTS];
+
+void motion_set_target(int id, uint32_t t_high)
+{
+	target[id-1] = t_high;
+}
+
+static uint32_t rng = 1;
+
+static uint32_t rnd(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+/*
+ * Where joint j really is at t: 1500 +- 400 us on periods of 1.7 to
+ * 5.3 s, up to about 1500 us/s
+ */
+static double truth(int j, double t_us)
+{
+	static const double period_s[NUM_JOINTS] = { 1.7, 2.3, 3.1, 4.0, 5.3 };
+
+	return 1500 + 400 * sin(2 * 3.14159265358979 * t_us / 1e6 / period_s[j] + j);
+}
+
+typedef struct {
+	const char *name;
+	int jitter_us;		// transit is BASE_TRANSIT_US + 0..jitter_us
+	int loss_every;		// about every this many replies, lose 1-3 (0: none)
+	int swap_pct;		// replies that trade places with the next
+	int outage;			// replies lost in a row every 10 s (0: none)
+	double max_err;		// allowed error outside outages (us)
+} scenario_t;
+
+typedef struct {
+	uint32_t sent;
+	uint32_t arrive;	// 0: lost
+} reply_t;
+
+static reply_t replies[REQS];
+
+static int run(const scenario_t *s, int verbose)
+{
+	int lost = 0, swapped = 0;
+	int next_arrival = 0, order[REQS];
+	double sum = 0, worst = 0, hold_worst = 0;
+	uint32_t frames = 0, stalls = 0, late_frames = 0;
+	int frozen[NUM_JOINTS];
+	uint32_t settle_until = 0;
+	double prev_truth[NUM_JOINTS];
+	int prev_out[NUM_JOINTS];
+	int failed = 0;
+
+	// Build the trace
+	for (int k=0; k<REQS; k++) {
+		replies[k].sent = WARMUP_US / 4 + k * REQ_US;
+		replies[k].arrive = replies[k].sent + BASE_TRANSIT_US + (s->jitter_us ? rnd() % s->jitter_us : 0);
+		order[k] = k;
+	}
+	for (int k=0; k<REQS; k++) {
+		if (s->loss_every && rnd() % s->loss_every == 0) {
+			for (int n=1 + rnd() % 3; n > 0 && k < REQS; n--, k++) {
+				replies[k].arrive = 0;
+				lost++;
+			}
+		}
+		if (s->outage && k > 0 && k % (10000000 / REQ_US) == 0) {
+			for (int n=s->outage; n > 0 && k < REQS; n--, k++) {
+				replies[k].arrive = 0;
+				lost++;
+			}
+		}
+	}
+	for (int k=0; k+1<REQS; k++) {
+		if ((int)(rnd() % 100) < s->swap_pct && replies[k].arrive && replies[k+1].arrive) {
+			uint32_t t = replies[k].arrive;
+			replies[k].arrive = replies[k+1].arrive + 1;
+			replies[k+1].arrive = t < replies[k+1].arrive ? t : replies[k+1].arrive;
+			swapped++;
+			k++;
+		}
+	}
+	// Arrival order
+	for (int i=1; i<REQS; i++) {
+		int k = order[i], j = i;
+		while (j > 0 && replies[order[j-1]].arrive > replies[k].arrive) {
+			order[j] = order[j-1];
+			j--;
+		}
+		order[j] = k;
+	}
+
+	host_time_us = 0;
+	jitter_reset();
+	for (int j=0; j<NUM_JOINTS; j++) {
+		target[j] = prev_out[j] = 0;
+		prev_truth[j] = 0;
+		frozen[j] = 0;
+	}
+	jitter_stats.pushed = jitter_stats.late = jitter_stats.dropped = 0;
+	jitter_stats.underruns = jitter_stats.predicted = 0;
+
+	for (host_time_us = 0; host_time_us < RUN_US + WARMUP_US / 4; host_time_us += 1000) {
+		// Replies in by now, in the order they came
+		while (next_arrival < REQS && replies[order[next_arrival]].arrive <= host_time_us) {
+			reply_t *r = &replies[order[next_arrival++]];
+			int values[NUM_JOINTS];
+
+			if (!r->arrive)
+				continue;
+			for (int j=0; j<NUM_JOINTS; j++)
+				values[j] = (int)lround(truth(j, r->sent));
+			jitter_push(r->sent, (uint16_t)(r - replies), values);
+		}
+
+		if (host_time_us % FRAME_US)
+			continue;
+		if (!jitter_step() || host_time_us < WARMUP_US)
+			continue;
+
+		// An outage, and the frames after it while playback catches up,
+		// are only reported
+		if (jitter_stats.underruns && jitter_stats.predicted < jitter_stats.underruns &&
+				(int32_t)(host_time_us - settle_until) > 0) {
+			settle_until = host_time_us + jitter_stats.delay + 10 * FRAME_US;
+		}
+
+		double play = (double)host_time_us - jitter_stats.delay;
+		double err = 0, hold_err = 0;
+		int stalled = 0;
+		int held = -1;
+
+		// The newest setpoint at or before the play point that's in by now
+		for (int k=0; k<REQS && replies[k].sent <= play; k++)
+			if (replies[k].arrive && replies[k].arrive <= host_time_us)
+				held = k;
+
+		for (int j=0; j<NUM_JOINTS; j++) {
+			double want = truth(j, play);
+			double e = fabs(target[j] - want);
+			if (e > err)
+				err = e;
+			if (held >= 0 && fabs(truth(j, replies[held].sent) - want) > hold_err)
+				hold_err = fabs(truth(j, replies[held].sent) - want);
+			if (frames && target[j] == prev_out[j] && fabs(want - prev_truth[j]) > 10)
+				frozen[j]++;
+			else
+				frozen[j] = 0;
+			if (frozen[j] >= 3)
+				stalled = 1;
+			prev_out[j] = target[j];
+			prev_truth[j] = want;
+		}
+		if ((int32_t)(host_time_us - settle_until) < 0) {
+			late_frames++;
+		} else {
+			sum += err;
+			if (err > worst)
+				worst = err;
+			if (hold_err > hold_worst)
+				hold_worst = hold_err;
+			stalls += stalled;
+		}
+		frames++;
+		if (verbose)
+			printf("%8.3f s  delay %6u  err %6.1f%s%s\n", host_time_us / 1e6,
+					jitter_stats.delay, err, stalled ? "  stall" : "",
+					(int32_t)(host_time_us - settle_until) < 0 ? "  (outage)" : "");
+		// Drop the underrun marks this frame so the next outage is seen
+		jitter_stats.predicted = jitter_stats.underruns = 0;
+	}
+
+	if (stalls || worst > s->max_err)
+		failed = 1;
+	printf("%-18s %5d %4d %6u %7u %6.1f %6.1f %6.1f %6u %7u %7u  %s\n", s->name, lost, swapped,
+			jitter_stats.dropped, frames, sum / (frames - late_frames), worst, hold_worst, stalls,
+			late_frames, jitter_stats.delay / 1000, failed ? "FAIL" : "ok");
+	return failed;
+}
+
+int main(int argc, char **argv)
+{
+	static const scenario_t scenarios[] = {
+		{ "clean",            10000,  0,  0,  0,  5 },
+		{ "lose 1-3",         10000, 20,  0,  0, 80 },
+		{ "lose 1-3, often",  10000,  6,  0,  0, 80 },
+		{ "reordered",        60000,  0, 10,  0, 10 },
+		{ "lose + reorder",   60000, 10, 10,  0, 80 },
+		{ "0.5 s outages",    10000,  0,  0, 20, 80 },
+	};
+	int verbose = 0, failed = 0;
+
+	if (argc > 1 && argv[1][0] == '-' && argv[1][1] == 'v') {
+		verbose = 1;
+		argc--;
+		argv++;
+	}
+	if (argc > 1)
+		rng = strtoul(argv[1], NULL, 0) | 1;
+
+	printf("seed %u, %d s of replies every %d ms, errors in us\n", rng, RUN_US / 1000000, REQ_US / 1000);
+	printf("%-18s %5s %4s %6s %7s %6s %6s %6s %6s %7s %7s\n", "trace", "lost", "swap", "behind",
+			"frames", "mean", "max", "hold", "stalls", "outage", "ms dly");
+	for (unsigned i=0; i<sizeof(scenarios)/sizeof(scenarios[0]); i++)
+		failed |= run(&scenarios[i], verbose);
+	return failed;
+}
@@ -0,0 +1,109 @@
+/*
+ * mailbox_stress.c
+ *
+ * Runs a writer and a reader on the triple-buffer mailbox (mailbox.c)
+ * from two threads flat out, standing in for the ADC interrupt and the
+ * main loop, and checks every snapshot the reader gets: all its fields
+ * must come from the same publish, and gen must never go backwards.
+ * Runs on the PC:
+ *
+ *   cc -std=c99 -D_POSIX_C_SOURCE=200809L -O2 -o mailbox_stress tools/mailbox_stress.c -lpthread
+ *   ./mailbox_stress [seconds]
+ *
+ * The writer fills the fields one at a time through mailbox_begin, so a
+ * reader sharing its buffer would see a mix, and both sides yield every
+ * so often, the writer part way through a snapshot, so that they
+ * interleave even on one core. With two cores the threads also run at
+ * once, which is harsher than the board, where the interrupt only ever
+ * cuts into the main loop. Exits 1 if a check fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "host.h"
+#include "../mailbox.c"
+
+static joint_mailbox_t mb = MAILBOX_INIT;
+static volatile uint32_t stop;
+static uint32_t published;
+
+// What publish n holds
+static uint32_t value(uint32_t gen, int i)
+{
+	return gen * 2654435761u + i * 40503u;
+}
+
+static void *writer(void *arg)
+{
+	(void)arg;
+	while (!load_acquire(&stop)) {
+		uint32_t gen = published + 1;
+		joint_state_t *s = mailbox_begin(&mb);
+
+		s->t = gen;
+		for (int i=0; i<MAILBOX_JOINTS; i++) {
+			((volatile uint32_t *)s->values)[i] = value(gen, i);
+			if (gen % 8 == (uint32_t)i)
+				sched_yield();	// let the reader in half way
+		}
+		mailbox_publish(&mb);
+		published = gen;
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	int seconds = argc > 1 ? atoi(argv[1]) : 3;
+	uint32_t last = 0, reads = 0, fresh = 0, torn = 0, backwards = 0, max_skip = 0;
+	time_t end;
+	pthread_t w;
+
+	if (pthread_create(&w, NULL, writer, NULL)) {
+		printf("can't start the writer\n");
+		return 1;
+	}
+
+	end = time(NULL) + seconds;
+	while (time(NULL) < end) {
+		for (int k=0; k<100000; k++) {
+			const joint_state_t *s = mailbox_read(&mb);
+			uint32_t gen = s->gen;
+
+			if (++reads % 16 == 0)
+				sched_yield();
+			if (gen < last) {
+				backwards++;
+				continue;
+			}
+			if (gen == last)
+				continue;
+			fresh++;
+			if (gen - last - 1 > max_skip)
+				max_skip = gen - last - 1;
+			last = gen;
+			if (s->t != gen) {
+				torn++;
+				continue;
+			}
+			for (int i=0; i<MAILBOX_JOINTS; i++) {
+				if (s->values[i] != value(gen, i)) {
+					torn++;
+					break;
+				}
+			}
+		}
+	}
+	store_release(&stop, 1);
+	pthread_join(w, NULL);
+
+	printf("%u published, %u reads, %u new snapshots (most missed in a row %u)\n",
+			published, reads, fresh, max_skip);
+	printf("torn %u, gen went backwards %u  %s\n", torn, backwards,
+			torn || backwards || !fresh ? "FAIL" : "ok");
+	return torn || backwards || !fresh;
+}
@@ -0,0 +1,237 @@
+/*
+ * proto_bench.c
+ *
+ * Bytes per arm update and encode/decode cost for the v1 struct layout
+ * and the packed v2 format (network.h), using the packers in network.c.
+ * Runs on the PC:
+ *
+ *   cc -std=c99 -D_POSIX_C_SOURCE=200809L -O2 -o proto_bench tools/proto_bench.c
+ *   ./proto_bench
+ *
+ * v1 "encoding" is what send_packet does with it, copying the struct out
+ * byte by byte, and decoding is receive_packet_USART3's copy back in.
+ * Times are per message, in ns and in ticks of the x86 time-stamp
+ * counter where there is one (close to core cycles on a modern PC; the
+ * M4 at 168 MHz will take several times as many cycles). Every v2
+ * message is decoded again and checked against what went in.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "host.h"
+#include "../ring.c"
+#include "../mailbox.c"
+#include "../framing.c"
+#include "../network.c"
+
+#define RUNS 1000000
+#define BAUD 115200
+
+// What network.c needs from the rest of the firmware
+volatile int systemTicks;
+
+int USART3_write(const char *data, int len)
+{
+	(void)data;
+	(void)len;
+	return 0;
+}
+
+// Request timeouts never go off here
+void timer_start(sw_timer_t *t, uint32_t delay_us, uint32_t period_us, timer_fn fn, void *arg)
+{
+	(void)t;
+	(void)delay_us;
+	(void)period_us;
+	(void)fn;
+	(void)arg;
+}
+
+void timer_stop(sw_timer_t *t)
+{
+	(void)t;
+}
+
+static volatile uint8_t sink;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/*
+ * A message of the given type with joint values that move each call,
+ * so nothing can be folded away
+ */
+static void make_msg(Msg_t *msg, int type, int is_resp, int k)
+{
+	msg->pingmsg.type = type;
+	msg->pingmsg.id = JOINT_SLOT_BASE;
+	if (type == TYPE_UPDATE_ALL) {
+		for (int i=0; i<NUM_JOINTS; i++)
+			msg->allmsg.values[i] = 1000 + (k * 7 + i * 131) % 1001;
+	} else if (is_resp) {
+		msg->respmsg.average = 1500;
+		for (int i=0; i<CLASS_SIZE_MAX; i++)
+			msg->respmsg.values[i] = 1000 + (k * 3 + i * 37) % 1001;
+	} else {
+		msg->reqmsg.value = 1000 + k % 1001;
+	}
+}
+
+static int v1_size(int type, int is_resp)
+{
+	if (type == TYPE_UPDATE_ALL)
+		return sizeof(Update_all_t);
+	return is_resp ? sizeof(Update_resp_t) : sizeof(Update_req_t);
+}
+
+static int framed_size(const uint8_t *payload, int len)
+{
+	uint8_t frame[FRAME_MAX_SIZE];
+
+	return frame_encode(payload, len, frame);
+}
+
+/*
+ * Check that a v2 message decodes to what was encoded. Values outside
+ * 1000-2022 us can't be carried, but make_msg stays inside.
+ */
+static int v2_check(const Msg_t *in, int is_resp)
+{
+	uint8_t buf[V2_MAX_SIZE];
+	Msg_t out;
+	uint16_t seq;
+	int len = v2_encode(in, is_resp, 1234, buf);
+
+	if (len <= 0 || v2_decode(buf, len, &out, &seq) || seq != 1234 ||
+			out.pingmsg.type != in->pingmsg.type || out.pingmsg.id != in->pingmsg.id)
+		return -1;
+	if (in->pingmsg.type == TYPE_UPDATE_ALL) {
+		for (int i=0; i<NUM_JOINTS; i++)
+			if (out.allmsg.values[i] != in->allmsg.values[i])
+				return -1;
+	} else if (is_resp) {
+		if (out.respmsg.average != in->respmsg.average)
+			return -1;
+		for (int i=0; i<CLASS_SIZE_MAX; i++)
+			if (out.respmsg.values[i] != in->respmsg.values[i])
+				return -1;
+	} else if (out.reqmsg.value != in->reqmsg.value) {
+		return -1;
+	}
+	return 0;
+}
+
+typedef struct {
+	const char *name;
+	int type;
+	int is_resp;
+	int per_update;		// messages per arm update
+} case_t;
+
+static int bench(const case_t *c)
+{
+	static Msg_t msgs[256];
+	uint8_t wire[sizeof(Msg_t)];
+	uint8_t buf[V2_MAX_SIZE];
+	Msg_t out;
+	uint16_t seq;
+	int v1_len = v1_size(c->type, c->is_resp);
+	int v2_len;
+	uint64_t t0, c0;
+	double ns[4], tk[4];
+
+	for (int k=0; k<256; k++) {
+		make_msg(&msgs[k], c->type, c->is_resp, k);
+		if (v2_check(&msgs[k], c->is_resp)) {
+			printf("%s: v2 round trip failed\n", c->name);
+			return -1;
+		}
+	}
+
+	// v1 encode: copy the struct out
+	t0 = now_ns();
+	c0 = ticks();
+	for (int k=0; k<RUNS; k++) {
+		const uint8_t *p = (const uint8_t *)&msgs[k & 255];
+		for (int i=0; i<v1_len; i++)
+			wire[i] = p[i];
+		sink = wire[k % v1_len];
+	}
+	tk[0] = (double)(ticks() - c0) / RUNS;
+	ns[0] = (double)(now_ns() - t0) / RUNS;
+
+	// v1 decode: copy it back in
+	t0 = now_ns();
+	c0 = ticks();
+	for (int k=0; k<RUNS; k++) {
+		wire[0] = k;
+		for (int i=0; i<v1_len; i++)
+			((uint8_t *)&out)[i] = wire[i];
+		sink = out.pingmsg.type;
+	}
+	tk[1] = (double)(ticks() - c0) / RUNS;
+	ns[1] = (double)(now_ns() - t0) / RUNS;
+
+	// v2 encode
+	v2_len = v2_encode(&msgs[0], c->is_resp, 0, buf);
+	t0 = now_ns();
+	c0 = ticks();
+	for (int k=0; k<RUNS; k++) {
+		v2_encode(&msgs[k & 255], c->is_resp, k, buf);
+		sink = buf[k % v2_len];
+	}
+	tk[2] = (double)(ticks() - c0) / RUNS;
+	ns[2] = (double)(now_ns() - t0) / RUNS;
+
+	// v2 decode
+	t0 = now_ns();
+	c0 = ticks();
+	for (int k=0; k<RUNS; k++) {
+		buf[2] = k;
+		v2_decode(buf, v2_len, &out, &seq);
+		sink = out.pingmsg.id + seq;
+	}
+	tk[3] = (double)(ticks() - c0) / RUNS;
+	ns[3] = (double)(now_ns() - t0) / RUNS;
+
+	printf("%-22s v1 %4d B %5d framed %6.2f ms | enc %6.1f ns %6.0f tk | dec %6.1f ns %6.0f tk\n",
+			c->name, v1_len * c->per_update,
+			framed_size((const uint8_t *)&msgs[0], v1_len) * c->per_update,
+			v1_len * c->per_update * 10000.0 / BAUD, ns[0], tk[0], ns[1], tk[1]);
+	printf("%-22s v2 %4d B %5d framed %6.2f ms | enc %6.1f ns %6.0f tk | dec %6.1f ns %6.0f tk\n",
+			"", v2_len * c->per_update, framed_size(buf, v2_len) * c->per_update,
+			v2_len * c->per_update * 10000.0 / BAUD, ns[2], tk[2], ns[3], tk[3]);
+	return 0;
+}
+
+int main(void)
+{
+	static const case_t cases[] = {
+		{ "request per joint x5", TYPE_UPDATE, 0, NUM_JOINTS },
+		{ "UPDATE_ALL request", TYPE_UPDATE_ALL, 0, 1 },
+		{ "class response", TYPE_UPDATE, 1, 1 },
+	};
+	int failed = 0;
+
+	printf("per arm update: bytes, COBS+CRC framed bytes, unframed wire time at %d baud;\n"
+			"per message: encode and decode time (tk = TSC ticks)\n\n", BAUD);
+	for (unsigned i=0; i<sizeof(cases)/sizeof(cases[0]); i++)
+		failed |= bench(&cases[i]);
+	return failed ? 1 : 0;
+}
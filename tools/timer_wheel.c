@@ -0,0 +1,176 @@
+/*
+ * timer_wheel.c
+ *
+ * Runs the software timers (timebase.c) against a stand-in TIM5 on the
+ * PC and checks that every timer goes off, on time, and that a stopped
+ * or restarted one doesn't go off for its old expiry:
+ *
+ *   cc -std=c99 -D_POSIX_C_SOURCE=200809L -O2 -o timer_wheel tools/timer_wheel.c
+ *   ./timer_wheel [seed]
+ *
+ * Timers are started, restarted and stopped at random, one-shot and
+ * periodic, some further out than a revolution of the wheel, and the
+ * callbacks start and stop other timers too. The clock moves on in
+ * random steps (now and then a long one, like a sleep), and the "compare
+ * interrupt" runs whenever the counter passes CCR1 with CC1IE set, or
+ * CC1G was written. Each timer has to go off in the step its expiry
+ * falls in (or at the end of it, if it was started already due). The
+ * counter starts just short of its wrap.
+ * Exits 1 if a check fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define HOST_TIMEBASE
+#include "host.h"
+#include "../stm32f4xx.h"
+
+static TIMx_GP_TypeDef tim5;
+#undef TIM5
+#define TIM5 (&tim5)
+
+#include "../timebase.c"
+
+// timebase_init isn't run here
+uint32_t clock_timer_hz(int bus)
+{
+	(void)bus;
+	return 84000000;
+}
+
+#define TIMERS 64
+#define STEPS 2000000
+
+// What each timer should do
+typedef struct {
+	sw_timer_t t;
+	int armed;
+	uint32_t due;
+	uint32_t period;
+	uint32_t fired;
+} model_t;
+
+static model_t timers[TIMERS];
+static uint32_t step_us;	// the step the clock just took
+static uint32_t fires, early, late, stray, missed, max_late;
+
+static uint32_t rng = 1;
+
+static uint32_t rnd(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+static void fn(void *arg);
+
+static void start(model_t *m)
+{
+	uint32_t delay = rnd() % 4 ? rnd() % 20000 : rnd() % 300000;
+
+	m->period = rnd() % 3 ? 0 : 500 + rnd() % 50000;
+	m->due = tim5.TIMx_CNT + delay;
+	m->armed = 1;
+	timer_start(&m->t, delay, m->period, fn, m);
+}
+
+static void stop(model_t *m)
+{
+	m->armed = 0;
+	timer_stop(&m->t);
+}
+
+static void fn(void *arg)
+{
+	model_t *m = arg;
+	uint32_t now = tim5.TIMx_CNT;
+
+	fires++;
+	m->fired++;
+	if (!m->armed) {
+		stray++;
+		return;
+	}
+	if ((int32_t)(now - m->due) < 0)
+		early++;
+	else if (now - m->due > step_us)
+		late++;
+	if (now - m->due > max_late)
+		max_late = now - m->due;
+
+	if (m->period) {
+		m->due += m->period;
+		if ((int32_t)(m->due - now) <= 0)
+			m->due = now + m->period;
+	} else {
+		m->armed = 0;
+	}
+
+	// Now and then, move another timer about from here
+	if (rnd() % 16 == 0) {
+		model_t *o = &timers[rnd() % TIMERS];
+		if (o != m) {
+			if (rnd() % 2)
+				start(o);
+			else
+				stop(o);
+		}
+	}
+}
+
+/*
+ * Move the counter on, taking the compare interrupt as it would come
+ */
+static void advance(uint32_t us)
+{
+	uint32_t t0 = tim5.TIMx_CNT;
+
+	step_us = us;
+	tim5.TIMx_CNT = t0 + us;
+	if ((tim5.TIMx_DIER & (1 << 1)) && (int32_t)(tim5.TIMx_CCR1 - t0) > 0 &&
+			(int32_t)(tim5.TIMx_CCR1 - tim5.TIMx_CNT) <= 0)
+		tim5.TIMx_EGR |= 1 << 1;
+	while ((tim5.TIMx_DIER & (1 << 1)) && (tim5.TIMx_EGR & (1 << 1))) {
+		tim5.TIMx_EGR = 0;
+		TIM5_handler();
+	}
+	tim5.TIMx_EGR = 0;
+
+	for (int i=0; i<TIMERS; i++)
+		if (timers[i].armed && (int32_t)(timers[i].due - tim5.TIMx_CNT) <= 0)
+			missed++;
+}
+
+int main(int argc, char **argv)
+{
+	int failed;
+
+	if (argc > 1)
+		rng = strtoul(argv[1], NULL, 0) | 1;
+	printf("seed %u\n", rng);
+
+	tim5.TIMx_CNT = 0xFFFFFFFF - 5000000;
+	for (int k=0; k<STEPS; k++) {
+		model_t *m = &timers[rnd() % TIMERS];
+
+		switch (rnd() % 8) {
+		case 0:
+		case 1:
+			start(m);
+			break;
+		case 2:
+			stop(m);
+			break;
+		}
+		advance(rnd() % 1000 ? 1 + rnd() % 2000 : 100000 + rnd() % 200000);
+	}
+
+	failed = early || late || stray || missed || count < 0;
+	printf("%u fired, running %d at the end\n", fires, count);
+	printf("early %u, late %u (worst %u us after due), fired when stopped %u, missed %u  %s\n",
+			early, late, max_late, stray, missed, failed ? "FAIL" : "ok");
+	return failed;
+}
@@ -0,0 +1,309 @@
+/*
+ * trace_decode.c
+ *
+ * Turns the event trace the board sends on 't' (trace.h) into a
+ * timeline and latency statistics. Runs on the PC, not the board - the
+ * Makefile doesn't build it:
+ *
+ *   cc -O2 -o trace_decode tools/trace_decode.c
+ *   (capture the console to a file, press 't')
+ *   ./trace_decode [-q] capture.bin
+ *
+ * The capture can have console text around the dumps, and more than one
+ * dump; each is decoded on its own. -q leaves out the timeline.
+ *
+ * Latencies (from the matching records):
+ *   pot to server     filter output (ADC_FRAME) to the next update sent
+ *   round trip        request sent to its reply coming in
+ *   server to servo   reply coming in to playback reaching it
+ *   end to end        request sent to playback reaching its reply
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* Same values as trace.h and network.h on the board */
+enum {
+	TRACE_NONE = 0,
+	TRACE_PKT_SENT,
+	TRACE_PKT_RECV,
+	TRACE_RESYNC,
+	TRACE_SERVO_COMMIT,
+	TRACE_PREDICT,
+	TRACE_MODE,
+	TRACE_ADC_FRAME,
+	TRACE_NUM_TYPES
+};
+
+enum { TRACE_RX_APPLIED = 0, TRACE_RX_LATE, TRACE_RX_FULL };
+
+#define TYPE_PING 1
+#define TYPE_UPDATE 2
+#define TYPE_UPDATE_ALL 3
+
+#define REC_SIZE 8
+
+static const char *type_names[TRACE_NUM_TYPES] = {
+	"none", "pkt_sent", "pkt_recv", "resync", "servo_commit",
+	"predict", "mode", "adc_frame",
+};
+static const char *rx_names[] = { "applied", "late", "full" };
+static const char *resync_names[] = { "overflow", "bad cobs", "bad crc" };
+static const char *msg_names[] = { "?", "ping", "update", "update_all" };
+static const char *mode_names[] = { "configure", "client", "command" };
+
+typedef struct {
+	uint32_t t;
+	uint8_t type;
+	uint8_t arg8;
+	uint16_t arg16;
+} rec_t;
+
+/* A latency distribution, in us */
+typedef struct {
+	const char *name;
+	int64_t *v;
+	size_t n, cap;
+} dist_t;
+
+static void dist_add(dist_t *d, int64_t us)
+{
+	if (d->n == d->cap) {
+		d->cap = d->cap ? 2 * d->cap : 256;
+		d->v = realloc(d->v, d->cap * sizeof(*d->v));
+		if (!d->v) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	d->v[d->n++] = us;
+}
+
+static int cmp64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void dist_print(dist_t *d)
+{
+	int64_t sum = 0;
+	int hist[32] = { 0 };
+	int top = 0;
+
+	printf("%s: ", d->name);
+	if (d->n == 0) {
+		printf("no samples\n");
+		return;
+	}
+	qsort(d->v, d->n, sizeof(*d->v), cmp64);
+	for (size_t i=0; i<d->n; i++) {
+		int k = 0;
+		sum += d->v[i];
+		while (k < 31 && d->v[i] >= ((int64_t)2 << k))
+			k++;
+		hist[k]++;
+		if (k > top)
+			top = k;
+	}
+	printf("%zu samples, us: min %lld  p50 %lld  p90 %lld  p99 %lld  max %lld  mean %lld\n",
+			d->n, (long long)d->v[0], (long long)d->v[d->n / 2],
+			(long long)d->v[d->n * 9 / 10], (long long)d->v[d->n * 99 / 100],
+			(long long)d->v[d->n - 1], (long long)(sum / (int64_t)d->n));
+	for (int k=0; k<=top; k++) {
+		if (!hist[k])
+			continue;
+		printf("  < %8lld us %6d ", (long long)2 << k, hist[k]);
+		for (int j=0; j<hist[k] * 50 / (int)d->n + 1; j++)
+			putchar('#');
+		putchar('\n');
+	}
+	d->n = 0;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void print_record(const rec_t *r, int64_t t)
+{
+	printf("%10lld.%03lld ms  %-13s", (long long)(t / 1000), (long long)(t % 1000),
+			r->type < TRACE_NUM_TYPES ? type_names[r->type] : "?");
+	switch (r->type) {
+	case TRACE_PKT_SENT:
+		printf("%s seq %u", r->arg8 <= TYPE_UPDATE_ALL ? msg_names[r->arg8] : "?", r->arg16);
+		break;
+	case TRACE_PKT_RECV:
+		printf("%s seq %u", r->arg8 <= TRACE_RX_FULL ? rx_names[r->arg8] : "?", r->arg16);
+		break;
+	case TRACE_RESYNC:
+		printf("%s, %u bytes", r->arg8 <= 2 ? resync_names[r->arg8] : "?", r->arg16);
+		break;
+	case TRACE_SERVO_COMMIT:
+	case TRACE_PREDICT:
+		printf("seq %u", r->arg16);
+		break;
+	case TRACE_MODE:
+		printf("%s", r->arg8 <= 2 ? mode_names[r->arg8] : "?");
+		break;
+	case TRACE_ADC_FRAME:
+		printf("output %u", r->arg16);
+		break;
+	default:
+		printf("%02x %04x", r->arg8, r->arg16);
+		break;
+	}
+	putchar('\n');
+}
+
+/*
+ * One dump: print the timeline (unless quiet) and the statistics
+ */
+static void decode(const rec_t *recs, uint32_t n, uint32_t lost, int quiet)
+{
+	// Per seq: when it was sent and when its reply came in (-1 = not seen)
+	static int64_t sent[65536], recv[65536];
+	dist_t pot = { .name = "pot to server" }, rtt = { .name = "round trip" };
+	dist_t s2s = { .name = "server to servo" }, e2e = { .name = "end to end" };
+	uint32_t counts[TRACE_NUM_TYPES] = { 0 };
+	uint32_t rx[3] = { 0 }, resync[3] = { 0 };
+	int64_t t = 0, last_adc = -1;
+
+	for (int i=0; i<65536; i++)
+		sent[i] = recv[i] = -1;
+
+	for (uint32_t i=0; i<n; i++) {
+		const rec_t *r = &recs[i];
+		uint16_t seq = r->arg16;
+
+		// Timestamps wrap every 71 minutes, so go by differences
+		if (i > 0)
+			t += (int32_t)(r->t - recs[i-1].t);
+		if (!quiet)
+			print_record(r, t);
+		if (r->type < TRACE_NUM_TYPES)
+			counts[r->type]++;
+
+		switch (r->type) {
+		case TRACE_ADC_FRAME:
+			last_adc = t;
+			break;
+		case TRACE_PKT_SENT:
+			sent[seq] = t;
+			recv[seq] = -1;
+			if ((r->arg8 == TYPE_UPDATE || r->arg8 == TYPE_UPDATE_ALL) && last_adc >= 0) {
+				dist_add(&pot, t - last_adc);
+				last_adc = -1; // each reading is only sent once
+			}
+			break;
+		case TRACE_PKT_RECV:
+			if (r->arg8 <= TRACE_RX_FULL)
+				rx[r->arg8]++;
+			if (sent[seq] >= 0)
+				dist_add(&rtt, t - sent[seq]);
+			if (r->arg8 == TRACE_RX_APPLIED)
+				recv[seq] = t;
+			break;
+		case TRACE_SERVO_COMMIT:
+			if (recv[seq] >= 0)
+				dist_add(&s2s, t - recv[seq]);
+			if (sent[seq] >= 0)
+				dist_add(&e2e, t - sent[seq]);
+			recv[seq] = sent[seq] = -1;
+			break;
+		case TRACE_RESYNC:
+			if (r->arg8 <= 2)
+				resync[r->arg8]++;
+			break;
+		}
+	}
+
+	printf("\n%u events over %lld.%03lld ms", n, (long long)(t / 1000), (long long)(t % 1000));
+	if (lost)
+		printf(" (%u lost while the last dump went out)", lost);
+	printf("\n");
+	for (int k=1; k<TRACE_NUM_TYPES; k++)
+		printf("  %-13s %u\n", type_names[k], counts[k]);
+	printf("replies: %u applied, %u late, %u dropped for a full queue\n", rx[0], rx[1], rx[2]);
+	printf("resyncs: %u overflow, %u bad cobs, %u bad crc\n\n", resync[0], resync[1], resync[2]);
+
+	dist_print(&pot);
+	dist_print(&rtt);
+	dist_print(&s2s);
+	dist_print(&e2e);
+	free(pot.v);
+	free(rtt.v);
+	free(s2s.v);
+	free(e2e.v);
+}
+
+int main(int argc, char **argv)
+{
+	FILE *f = stdin;
+	uint8_t *buf = NULL;
+	size_t len = 0, cap = 0, got;
+	int quiet = 0, dumps = 0;
+
+	if (argc > 1 && strcmp(argv[1], "-q") == 0) {
+		quiet = 1;
+		argc--;
+		argv++;
+	}
+	if (argc > 1 && !(f = fopen(argv[1], "rb"))) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	do {
+		if (len == cap) {
+			cap = cap ? 2 * cap : 65536;
+			if (!(buf = realloc(buf, cap))) {
+				perror("realloc");
+				return 1;
+			}
+		}
+		got = fread(buf + len, 1, cap - len, f);
+		len += got;
+	} while (got);
+
+	for (size_t i=0; i + 20 <= len; i++) { // header and end marker
+		uint32_t n, lost;
+		rec_t *recs;
+		const uint8_t *p;
+
+		if (memcmp(buf + i, "TRC1", 4))
+			continue;
+		n = get32(buf + i + 4);
+		lost = get32(buf + i + 8);
+		p = buf + i + 16;
+		if (n > (len - (i + 20)) / REC_SIZE || memcmp(p + n * REC_SIZE, "TEND", 4)) {
+			fprintf(stderr, "dump at byte %zu is cut short, skipping\n", i);
+			continue;
+		}
+
+		recs = malloc((n ? n : 1) * sizeof(*recs));
+		if (!recs) {
+			perror("malloc");
+			return 1;
+		}
+		for (uint32_t r=0; r<n; r++, p += REC_SIZE) {
+			recs[r].t = get32(p);
+			recs[r].type = p[4];
+			recs[r].arg8 = p[5];
+			recs[r].arg16 = p[6] | p[7] << 8;
+		}
+
+		printf("=== dump %d (byte %zu)\n", ++dumps, i);
+		decode(recs, n, lost, quiet);
+		free(recs);
+		i = p + 4 - buf - 1;
+	}
+
+	if (!dumps)
+		fprintf(stderr, "no trace dump found\n");
+	free(buf);
+	return dumps ? 0 : 1;
+}
@@ -0,0 +1,169 @@
+/*
+ * tx_bench.c
+ *
+ * Main loop iterations per second with the two USART3 transmit paths:
+ * the old one, which wrote each byte and spun on TXE until the USART
+ * took it, and the ring that DMA drains (ring.c, as USART3_write uses
+ * it). Runs on the PC against a USART modelled at 115200 baud, since
+ * there's nothing to time the board with here:
+ *
+ *   cc -std=c99 -D_POSIX_C_SOURCE=200809L -O2 -o tx_bench tools/tx_bench.c
+ *   ./tx_bench
+ *
+ * Each loop pass does a fixed slice of other work, then queues whatever
+ * packets are due: five 12-byte Update_req_t per 25 ms systick (COMMAND
+ * mode, one request per joint), then a request every 1.2 ms, which keeps
+ * the link 75% busy. The "DMA" is a poll each pass that retires the
+ * bytes the line has had time to send, standing in for the stream.
+ *
+ * Besides passes per second it prints the share of the time spent in
+ * the send path and the longest time one round of sends held the loop.
+ * Those are wall-clock times, so on a loaded PC they pick up whatever
+ * else the scheduler ran meanwhile.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "host.h"
+#include "../ring.c"
+
+#define BAUD 115200
+#define BYTE_NS (10 * 1000000000ULL / BAUD)	// start + 8 data + stop
+#define PACKET_SIZE 12						// sizeof(Update_req_t)
+#define TX_BUF_SIZE 256						// as in USART3.c
+#define RUN_NS 2000000000ULL
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * The other work in a pass: a few microseconds of arithmetic the compiler
+ * can't drop
+ */
+static volatile uint32_t sink;
+
+static void work(void)
+{
+	uint32_t x = sink;
+
+	for (int i=0; i<2000; i++)
+		x = x * 1664525 + 1013904223;
+	sink = x;
+}
+
+/*
+ * Old path: one byte at a time. The USART holds one byte in DR and one
+ * in the shift register, so TXE comes back once the line is no more
+ * than a byte behind.
+ */
+static uint64_t line_busy_until;
+
+static void old_send(const uint8_t *data, int len)
+{
+	for (int i=0; i<len; i++) {
+		uint64_t now;
+		while ((now = now_ns()) + BYTE_NS < line_busy_until)
+			; // wait for TXE
+		line_busy_until = (now > line_busy_until ? now : line_busy_until) + BYTE_NS;
+		(void)data[i];
+	}
+}
+
+/*
+ * New path: queue the packet and go. dma_poll retires bytes at the line
+ * rate while there are any queued.
+ */
+static uint8_t tx_buf[TX_BUF_SIZE];
+static ring_t tx_ring;
+static uint64_t dma_next;	// when the byte going out now is done
+
+static int new_send(const uint8_t *data, int len)
+{
+	if (ring_count(&tx_ring) == 0)
+		dma_next = now_ns() + BYTE_NS;
+	return ring_write(&tx_ring, data, len);
+}
+
+static void dma_poll(void)
+{
+	uint64_t now = now_ns();
+
+	while (ring_count(&tx_ring) && now >= dma_next) {
+		ring_skip(&tx_ring, 1);
+		dma_next += BYTE_NS;
+	}
+}
+
+typedef struct {
+	const char *name;
+	uint64_t burst_ns;	// how often packets are due
+	int burst;			// how many each time
+} load_t;
+
+static void run(const load_t *load, int use_ring)
+{
+	uint8_t packet[PACKET_SIZE] = { 2, 0, 0, 0, 18 };
+	uint64_t start, now, last, next_burst, t0, in_send = 0, worst = 0;
+	uint64_t passes = 0, sent = 0, dropped = 0;
+
+	ring_init(&tx_ring, tx_buf, TX_BUF_SIZE);
+	line_busy_until = 0;
+
+	start = last = now_ns();
+	next_burst = start;
+	do {
+		work();
+		if (last >= next_burst) {
+			t0 = now_ns();
+			for (int i=0; i<load->burst; i++) {
+				if (use_ring) {
+					if (new_send(packet, PACKET_SIZE))
+						dropped++;
+					else
+						sent++;
+				} else {
+					old_send(packet, PACKET_SIZE);
+					sent++;
+				}
+			}
+			next_burst += load->burst_ns;
+			t0 = now_ns() - t0;
+			in_send += t0;
+			if (t0 > worst)
+				worst = t0;
+		}
+		if (use_ring)
+			dma_poll();
+
+		last = now = now_ns();
+		passes++;
+	} while (now - start < RUN_NS);
+
+	printf("%-22s %-10s %12.0f %9.1f%% %10.1f %8llu %8llu\n", load->name,
+			use_ring ? "DMA ring" : "spin TXE",
+			passes * 1e9 / (now - start), in_send * 100.0 / (now - start), worst / 1000.0,
+			(unsigned long long)sent, (unsigned long long)dropped);
+}
+
+int main(void)
+{
+	static const load_t loads[] = {
+		{ "5 requests / systick", 25000000, 5 },
+		{ "request / 1.2 ms", 1200000, 1 },
+	};
+
+	printf("%-22s %-10s %12s %10s %10s %8s %8s\n",
+			"load", "path", "passes/s", "sending", "stall us", "packets", "dropped");
+	for (unsigned i=0; i<sizeof(loads)/sizeof(loads[0]); i++) {
+		run(&loads[i], 0);
+		run(&loads[i], 1);
+	}
+	return 0;
+}
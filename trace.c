@@ -0,0 +1,99 @@
+/*
+ * trace.c
+ *
+ * Any context can log an event: one atomic_add (mutex.S) claims the next
+ * slot, then the timestamp and arguments are stored in it - a couple of
+ * dozen cycles, no lock, no interrupts masked. A writer that's
+ * interrupted just has its slot filled in a little after the one the
+ * interrupt claimed. The ring is a flight recorder: once full, each new
+ * event replaces the oldest.
+ *
+ * trace_dump sends the lot on the USART2 console and starts over. A dump
+ * is about 8 KB, most of a second at 115200 baud, so each call only
+ * queues what fits in the console ring and says whether to call again.
+ * Events are turned away until it's done (and counted), so nothing it
+ * reads can be written under it, and it has the console to itself
+ * (USART2_claim), so no other output lands inside the dump.
+ */
+
+#include "stm32f4xx.h"
+#include "stdint.h"
+#include "mutex.h"
+#include "USART2.h"
+#include "trace.h"
+
+#if TRACE_ENABLE
+
+static trace_rec_t ring[TRACE_SLOTS];
+// Events logged since the last dump (free-running, masked on use)
+static volatile uint32_t head = 0;
+static volatile uint32_t paused = 0;
+static volatile uint32_t lost = 0;
+
+void trace_event(uint32_t type, uint32_t arg8, uint32_t arg16)
+{
+	trace_rec_t *r;
+
+	if (paused) {
+		atomic_add(&lost, 1);
+		return;
+	}
+
+	r = &ring[atomic_add(&head, 1) & (TRACE_SLOTS - 1)];
+	// TIM5 is the microsecond clock (timebase.c)
+	r->t = TIM5->TIMx_CNT;
+	r->type = type;
+	r->arg8 = arg8;
+	r->arg16 = arg16;
+}
+
+// Dump in progress: records [dump_next, dump_end) still to go
+static int dumping = 0;
+static uint32_t dump_next, dump_end, dump_dropped;
+
+/**
+ * Send the next part of a dump to USART2 (see trace.h for the format),
+ * starting one if none is going: as much as there's room for in the
+ * console ring right now. Once it's all gone the ring starts over.
+ * Returns 1 while there's more to send - call again once some has gone
+ * out - and 0 when the dump is done. Main loop only.
+ */
+int trace_dump(void)
+{
+	uint32_t hdr[4];
+
+	if (!dumping) {
+		if (USART2_tx_space() < (int)sizeof(hdr))
+			return 1; // no room to start yet
+		// Anything that claimed a slot has finished with it by the time
+		// the main loop runs again
+		paused = 1;
+		dump_end = head;
+		dump_next = dump_end > TRACE_SLOTS ? dump_end - TRACE_SLOTS : 0;
+		dump_dropped = lost;
+		USART2_claim(1);
+
+		hdr[0] = 'T' | 'R' << 8 | 'C' << 16 | '1' << 24;
+		hdr[1] = dump_end - dump_next;
+		hdr[2] = dump_dropped;
+		hdr[3] = TIM5->TIMx_CNT;
+		USART2_write_claimed((const char *)hdr, sizeof(hdr));
+		dumping = 1;
+	}
+
+	while (dump_next != dump_end && USART2_tx_space() >= (int)sizeof(trace_rec_t)) {
+		USART2_write_claimed((const char *)&ring[dump_next & (TRACE_SLOTS - 1)], sizeof(trace_rec_t));
+		dump_next++;
+	}
+	if (dump_next != dump_end || USART2_write_claimed("TEND", 4))
+		return 1;
+
+	USART2_claim(0);
+	head = 0;
+	atomic_add(&lost, -dump_dropped);
+	paused = 0;
+	dumping = 0;
+	return 0;
+}
+
+#endif /* TRACE_ENABLE */
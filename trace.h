@@ -0,0 +1,70 @@
+/*
+ * trace.h
+ *
+ * Binary event trace: timestamped records in a RAM ring, dumped over
+ * USART2 on request and decoded on the PC (tools/trace_decode.c)
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include "stdint.h"
+
+// Set to 0 to take every TRACE() out
+#define TRACE_ENABLE 1
+
+// Records kept (power of 2): the newest this many are dumped
+#define TRACE_SLOTS 1024
+
+/* Event types, and what their two arguments hold.
+ * tools/trace_decode.c has its own copy - keep them in step.
+ */
+enum {
+	TRACE_NONE = 0,
+	TRACE_PKT_SENT,		// arg8 message type, arg16 seq
+	TRACE_PKT_RECV,		// arg8 TRACE_RX_*, arg16 seq (0 if unmatched, untagged)
+	TRACE_RESYNC,		// arg8 TRACE_RESYNC_*, arg16 coded length thrown away
+	TRACE_SERVO_COMMIT,	// arg16 seq: first servo frame committed once playback reached it
+	TRACE_PREDICT,		// setpoints ran out, dead reckoning from here
+	TRACE_MODE,			// arg8 the new state_t
+	TRACE_ADC_FRAME,	// arg16 filter output count (low bits)
+	TRACE_NUM_TYPES
+};
+
+// TRACE_PKT_RECV outcomes
+enum {
+	TRACE_RX_APPLIED = 0,	// queued to be applied
+	TRACE_RX_LATE,			// timed out, superseded, duplicate or unasked for
+	TRACE_RX_FULL,			// the main loop hadn't kept up
+};
+
+// TRACE_RESYNC reasons
+enum {
+	TRACE_RESYNC_OVERFLOW = 0,
+	TRACE_RESYNC_COBS,
+	TRACE_RESYNC_CRC,
+};
+
+/* Little-endian on the wire, as in memory. A dump is:
+ *   "TRC1", uint32 count, uint32 lost, uint32 time_now_us at the dump,
+ *   count records oldest first, "TEND"
+ * lost is events that came while the last dump was going out.
+ */
+typedef struct {
+	uint32_t t;			// time_now_us
+	uint8_t type;
+	uint8_t arg8;
+	uint16_t arg16;
+} trace_rec_t;
+
+#if TRACE_ENABLE
+#define TRACE(type, arg8, arg16) trace_event((type), (arg8), (arg16))
+void trace_event(uint32_t type, uint32_t arg8, uint32_t arg16);
+int trace_dump(void);
+#else
+// (sizeof so a variable only kept for the trace doesn't look unused)
+#define TRACE(type, arg8, arg16) ((void)sizeof((arg8) + (arg16)))
+#define trace_dump() 0
+#endif
+
+#endif /* TRACE_H_ */
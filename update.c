@@ -6,43 +6,102 @@
  */
 #include "network.h"
 #include "servo.h"
-#include "ADC.h"
+#include "motion.h"
+#include "jitter.h"
+#include "systick.h"
+#include "update.h"
+#include "calib.h"
+
+/* Change detection for COMMAND mode.
+ * A joint counts as moved once it's more than its deadband away from the
+ * value last *sent* (not the last sample), so slow drift still gets sent
+ * eventually but noise around one spot doesn't. A joint that hasn't been
+ * sent for update_keepalive_ticks is re-sent anyway, so the server doesn't
+ * go stale on it however busy the other joints are.
+ */
+int joint_deadband_us[NUM_JOINTS] = {
+	UPDATE_DEADBAND_US, UPDATE_DEADBAND_US, UPDATE_DEADBAND_US,
+	UPDATE_DEADBAND_US, UPDATE_DEADBAND_US,
+};
+int update_keepalive_ticks = UPDATE_KEEPALIVE_TICKS;
+
+static int last_sent[NUM_JOINTS];
+static int last_sent_tick[NUM_JOINTS];
+static int have_sent = 0;
+static int pending = 0;	// bit n: joint n is owed to the server
+
+volatile uint32_t updates_sent = 0;
+volatile uint32_t updates_suppressed = 0;
 
 /**
- * Read each value from the ADC, and update the server accordingly
+ * Send the joints that moved past their deadband to the server, and any
+ * whose keep-alive period has run out: as one TYPE_UPDATE_ALL packet
+ * with NET_UPDATE_ALL, otherwise a TYPE_UPDATE per joint. Joints that
+ * don't fit in the window this time are sent on the next call.
+ * Returns 1 if anything went out, 0 if there was nothing to send, -1 if
+ * nothing could be queued.
  */
-void update_server_from_adc(void) {
-	uint32_t data[5];
-	int t_high;
-	float f_t_high;
+int update_server_changed(uint32_t data[NUM_JOINTS]) {
 	Msg_t msg;
+	int values[NUM_JOINTS];
+	int diff;
+	int sent = 0;
 
-	ADC_read(data);
+	for (int i=PIVOT_ID; i<=GRIP_ID; i++) {
+		values[i] = calib_map(i, data[i]);
+		diff = values[i] - last_sent[i];
+		if (!have_sent || systemTicks - last_sent_tick[i] >= update_keepalive_ticks ||
+				diff > joint_deadband_us[i] || diff < -joint_deadband_us[i])
+			pending |= 1 << i;
+	}
+	have_sent = 1;
 
-	// Send each value as a separate update message
+	if (!pending) {
+		updates_suppressed++;
+		return 0;
+	}
 
-	for (int i=1; i<6; i++) {
-		f_t_high = data[i-1] / (float)(0xFFF); // percentage
-		t_high = (f_t_high * 1000) + 1000;
-		msg.reqmsg.id = i;
+#if NET_UPDATE_ALL
+	msg.allmsg.type = TYPE_UPDATE_ALL;
+	msg.allmsg.id = JOINT_SLOT_BASE + PIVOT_ID;
+	for (int i=PIVOT_ID; i<=GRIP_ID; i++)
+		msg.allmsg.values[i] = values[i];
+	if (send_packet_USART3(&msg) == 0) {
+		for (int i=PIVOT_ID; i<=GRIP_ID; i++) {
+			last_sent[i] = values[i];
+			last_sent_tick[i] = systemTicks;
+		}
+		pending = 0;
+		sent = 1;
+	}
+#else
+	for (int i=PIVOT_ID; i<=GRIP_ID; i++) {
+		if (!(pending & (1 << i)))
+			continue;
 		msg.reqmsg.type = TYPE_UPDATE;
-		msg.reqmsg.value = t_high;
-		send_packet_USART3(&msg);
+		msg.reqmsg.id = JOINT_SLOT_BASE + i;
+		msg.reqmsg.value = values[i];
+		if (send_packet_USART3(&msg))
+			break; // window or ring full
+		last_sent[i] = values[i];
+		last_sent_tick[i] = systemTicks;
+		pending &= ~(1 << i);
+		sent++;
 	}
-}
+#endif
 
-void update_server(int id, uint32_t data[5]) {
-	int t_high;
-	float f_t_high;
-	Msg_t msg;
+	if (!sent)
+		return -1;
+	updates_sent += sent;
+	return 1;
+}
 
-	// Send an update message for the given ID
-	f_t_high = data[id-1] / (float)(0xFFF); // percentage
-	t_high = (f_t_high * 1000) + 1000;
-	msg.reqmsg.id = id;
-	msg.reqmsg.type = TYPE_UPDATE;
-	msg.reqmsg.value = t_high;
-	send_packet_USART3(&msg);
+/**
+ * Forget what was last sent, so the next update_server_changed goes out
+ */
+void update_server_reset(void) {
+	have_sent = 0;
+	pending = 0;
 }
 
 void update_servos(void) {
@@ -51,14 +110,20 @@ void update_servos(void) {
 	msg.reqmsg.type = TYPE_UPDATE;
 	msg.reqmsg.value = 8888; // Junk value, we just want to get the response
 	send_packet_USART3(&msg);
-	// When the server responds, the USART3 handler will call set_servos_from_network with the response
+	// When the server responds, the main loop will call set_servos_from_network with the response
 }
 
-void set_servos_from_network(Msg_t *update)
+/**
+ * Apply a server message to the servos (see net_joint_values for the
+ * layouts). Servo n+1 drives joint n. The setpoint goes into the jitter buffer,
+ * stamped with when it was asked for (see net_reply_t);
+ * jitter.c plays it back to the motion engine at a steady pace.
+ */
+void set_servos_from_network(const net_reply_t *reply)
 {
-	if (update->pingmsg.id != TYPE_UPDATE) {
+	int values[NUM_JOINTS];
+
+	if (net_joint_values(&reply->msg, values))
 		return;
-	}
-	for (int i=1; i<6; i++)
-		servo_update(i, update->respmsg.values[i]);
+	jitter_push(reply->sent_time, reply->seq, values);
 }
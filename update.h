@@ -8,8 +8,18 @@
 #ifndef UPDATE_H_
 #define UPDATE_H_
 #include "network.h"
-void update_server_from_adc(void);
-void update_server(int id, 	uint32_t data[5]);
+
+// Defaults for change-driven updates in COMMAND mode
+#define UPDATE_DEADBAND_US 8		// t_high change (us) that counts as a move
+#define UPDATE_KEEPALIVE_TICKS 40	// re-send an idle joint every second
+
+extern int joint_deadband_us[NUM_JOINTS];
+extern int update_keepalive_ticks;
+extern volatile uint32_t updates_sent;
+extern volatile uint32_t updates_suppressed;
+
+int update_server_changed(uint32_t data[NUM_JOINTS]);
+void update_server_reset(void);
 void update_servos(void);
-void set_servos_from_network(Msg_t *update);
+void set_servos_from_network(const net_reply_t *reply);
 #endif /* UPDATE_H_ */